@@ -6,9 +6,324 @@
 #include <vector>
 #include <cstring>
 #include <openssl/sha.h>
-#include <iomanip>
+#include <openssl/evp.h>
+#include <curl/curl.h>
 #include <ctime>
+#include <iomanip>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <map>
+#include <cstdint>
+#include <charconv>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <cerrno>
+#include <set>
+#include <list>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <optional>
+#include <string_view>
+#include <iterator>
+#include <chrono>
+#include <utility>
+#include <cmath>
+#include <dlfcn.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define PROTO_GIT_IO_URING 1
+#endif
+
+
+// hex lookup tables, built at compile time: byte -> two digits, and digit -> nibble (-1 = not hex)
+struct HexTables {
+    char encode[256][2];
+    int8_t decode[256];
+
+    constexpr HexTables() : encode(), decode() {
+        const char digits[] = "0123456789abcdef";
+        for (int i = 0; i < 256; i++) {
+            encode[i][0] = digits[i >> 4];
+            encode[i][1] = digits[i & 15];
+            decode[i] = -1;
+        }
+        for (int i = 0; i < 10; i++) decode['0' + i] = static_cast<int8_t>(i);
+        for (int i = 0; i < 6; i++) {
+            decode['a' + i] = static_cast<int8_t>(10 + i);
+            decode['A' + i] = static_cast<int8_t>(10 + i);
+        }
+    }
+};
+constexpr HexTables HEX_TABLES;
+
+// object id
+// a SHA-1 held by value as its 20 raw bytes: no heap, cheap to copy, compare and hash.
+// hex is only produced at the edges (paths, output) and parsed from user input and the wire
+struct ObjectId {
+    static const size_t RAW_SIZE = 20;
+    static const size_t HEX_SIZE = 40;
+
+    std::array<uint8_t, RAW_SIZE> bytes{};
+
+    static ObjectId from_raw(const void* raw) {
+        ObjectId id;
+        memcpy(id.bytes.data(), raw, RAW_SIZE);
+        return id;
+    }
+
+    // false unless hex is exactly 40 hex digits
+    static bool parse(const char* hex, size_t n, ObjectId& out) {
+        if (n != HEX_SIZE) return false;
+        for (size_t i = 0; i < RAW_SIZE; i++) {
+            int hi = HEX_TABLES.decode[static_cast<unsigned char>(hex[2 * i])];
+            int lo = HEX_TABLES.decode[static_cast<unsigned char>(hex[2 * i + 1])];
+            if ((hi | lo) < 0) return false;
+            out.bytes[i] = static_cast<uint8_t>((hi << 4) | lo);
+        }
+        return true;
+    }
+    static bool parse(const std::string& hex, ObjectId& out) { return parse(hex.data(), hex.size(), out); }
+
+    // parse() for ids that must be valid
+    static ObjectId from_hex(const std::string& hex) {
+        ObjectId id;
+        if (!parse(hex, id)) throw std::runtime_error("Not a valid object id: '" + hex + "'");
+        return id;
+    }
+
+    // writes exactly 40 characters
+    void to_hex(char* out) const {
+        for (size_t i = 0; i < RAW_SIZE; i++) {
+            out[2 * i] = HEX_TABLES.encode[bytes[i]][0];
+            out[2 * i + 1] = HEX_TABLES.encode[bytes[i]][1];
+        }
+    }
+
+    std::string hex() const {
+        std::string s(HEX_SIZE, '\0');
+        to_hex(s.data());
+        return s;
+    }
+
+    // "xx/xxxx..." below the objects directory
+    std::string loose_path() const {
+        std::string s(HEX_SIZE + 1, '/');
+        to_hex(s.data() + 1);
+        s[0] = s[1];
+        s[1] = s[2];
+        s[2] = '/';
+        return s;
+    }
+
+    const uint8_t* data() const { return bytes.data(); }
+
+    bool operator==(const ObjectId& o) const { return bytes == o.bytes; }
+    bool operator!=(const ObjectId& o) const { return bytes != o.bytes; }
+    bool operator<(const ObjectId& o) const { return memcmp(bytes.data(), o.bytes.data(), RAW_SIZE) < 0; }
+};
+
+std::ostream& operator<<(std::ostream& os, const ObjectId& id) {
+    char hex[ObjectId::HEX_SIZE];
+    id.to_hex(hex);
+    return os.write(hex, sizeof(hex));
+}
+
+// SHA-1 output is uniformly distributed already, so its first bytes are a perfect hash
+namespace std {
+template <> struct hash<ObjectId> {
+    size_t operator()(const ObjectId& id) const noexcept {
+        size_t h;
+        memcpy(&h, id.bytes.data(), sizeof(h));
+        return h;
+    }
+};
+}
+
+// tracing
+// PROTO_GIT_TRACE=<file> records every TraceSpan as a Chrome trace (complete events, one track per
+// thread; opens in chrome://tracing or Perfetto), PROTO_GIT_METRICS=<file> writes per-span totals
+// and the counters as one JSON object. "%p" in either file name becomes the pid. both are written
+// when the process exits. with neither variable set, a span or a counter costs one branch
+const bool TRACING = std::getenv("PROTO_GIT_TRACE") || std::getenv("PROTO_GIT_METRICS");
+
+enum class Counter {
+    ObjectsWritten, ObjectsSkipped, BytesHashed, BytesDeflated, BytesWritten,
+    CacheHits, CacheMisses, InflateCalls, BytesInflated,
+    FilesStatted, FilesRehashed, DirsScanned, DirsReused, IoBatches, IoOps,
+    Count
+};
+
+const char* const COUNTER_NAMES[] = {
+    "objects_written", "objects_skipped", "bytes_hashed", "bytes_deflated", "bytes_written",
+    "cache_hits", "cache_misses", "inflate_calls", "bytes_inflated",
+    "files_statted", "files_rehashed", "dirs_scanned", "dirs_reused", "io_batches", "io_ops",
+};
+
+uint64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Tracer {
+public:
+    static Tracer& get() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    // the command line, for the output
+    void set_command(std::string c) { command = std::move(c); }
+
+    void add(Counter c, uint64_t n) { counters[static_cast<size_t>(c)].fetch_add(n, std::memory_order_relaxed); }
+
+    void record(const char* name, uint64_t start, uint64_t duration) {
+        thread_local ThreadEvents* mine = nullptr;
+        if (!mine) {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(std::make_unique<ThreadEvents>());
+            mine = threads.back().get();
+            mine->tid = static_cast<uint32_t>(threads.size());
+        }
+        mine->events.push_back({name, start, duration});
+    }
+
+private:
+    struct Event {
+        const char* name;
+        uint64_t start, duration;
+    };
+    // each thread appends to its own list; the tracer owns them, so they outlive the thread
+    struct ThreadEvents {
+        uint32_t tid = 0;
+        std::vector<Event> events;
+    };
+
+    std::string command;
+    uint64_t started = monotonic_ns();
+    std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::Count)> counters{};
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadEvents>> threads;
+
+    Tracer() = default;
+    ~Tracer() {
+        try {
+            if (const char* file = std::getenv("PROTO_GIT_TRACE")) write_chrome_trace(output_path(file));
+            if (const char* file = std::getenv("PROTO_GIT_METRICS")) write_metrics(output_path(file));
+        } catch (const std::exception& e) {
+            std::cerr << "trace: " << e.what() << '\n';
+        }
+    }
+
+    static std::string output_path(std::string file) {
+        size_t p = file.find("%p");
+        if (p != std::string::npos) file.replace(p, 2, std::to_string(getpid()));
+        return file;
+    }
+
+    static std::string quoted(const std::string& s) {
+        std::string out = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') out.push_back('\\');
+            if (static_cast<unsigned char>(c) >= 0x20) out.push_back(c);
+        }
+        return out + "\"";
+    }
+
+    // "X" events in microseconds, then the counters as one "C" event at the end
+    void write_chrome_trace(const std::string& file) {
+        std::ofstream out(file, std::ios::trunc);
+        if (!out.is_open()) throw std::runtime_error("cannot write " + file);
+        out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+        int pid = getpid();
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":" << quoted(command) << "}}";
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& t : threads) {
+            for (const Event& e : t->events) {
+                out << ",\n{\"name\":" << quoted(e.name) << ",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << t->tid
+                    << ",\"ts\":" << (e.start - started) / 1e3 << ",\"dur\":" << e.duration / 1e3 << "}";
+            }
+        }
+        out << ",\n{\"name\":\"counters\",\"ph\":\"C\",\"pid\":" << pid << ",\"ts\":" << (monotonic_ns() - started) / 1e3
+            << ",\"args\":{";
+        for (size_t i = 0; i < counters.size(); i++) out << (i ? "," : "") << quoted(COUNTER_NAMES[i]) << ":" << counters[i];
+        out << "}}\n],\"displayTimeUnit\":\"ms\"}\n";
+    }
 
+    // {"command", "wall_ns", "spans": {name: {count, total_ns, max_ns}}, "counters": {name: n}}
+    void write_metrics(const std::string& file) {
+        struct Total {
+            uint64_t count = 0, total = 0, max = 0;
+        };
+        std::map<std::string, Total> totals;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& t : threads) {
+                for (const Event& e : t->events) {
+                    Total& total = totals[e.name];
+                    total.count++;
+                    total.total += e.duration;
+                    total.max = std::max(total.max, e.duration);
+                }
+            }
+        }
+        std::ofstream out(file, std::ios::trunc);
+        if (!out.is_open()) throw std::runtime_error("cannot write " + file);
+        out << "{\"command\":" << quoted(command) << ",\"wall_ns\":" << monotonic_ns() - started << ",\"spans\":{";
+        bool first = true;
+        for (const auto& [name, t] : totals) {
+            out << (first ? "" : ",") << quoted(name) << ":{\"count\":" << t.count << ",\"total_ns\":" << t.total
+                << ",\"max_ns\":" << t.max << "}";
+            first = false;
+        }
+        out << "},\"counters\":{";
+        for (size_t i = 0; i < counters.size(); i++) out << (i ? "," : "") << quoted(COUNTER_NAMES[i]) << ":" << counters[i];
+        out << "}}\n";
+    }
+};
+
+// times the enclosing scope under name, which must outlive the process (a literal)
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name) : name(TRACING ? name : nullptr), start(TRACING ? monotonic_ns() : 0) {}
+    ~TraceSpan() {
+        if (name) Tracer::get().record(name, start, monotonic_ns() - start);
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    uint64_t start;
+};
+
+inline void trace_count(Counter c, uint64_t n = 1) {
+    if (TRACING) Tracer::get().add(c, n);
+}
 
 // get timestamp in git format
 std::string get_git_timestamp() {
@@ -18,15 +333,16 @@ std::string get_git_timestamp() {
 }
 
 // construct commit body
-std::string build_commit_content(std::string tree_sha, std::string parent_sha, std::string message) {
+std::string build_commit_content(const ObjectId& tree_sha, const std::optional<ObjectId>& parent_sha,
+                                 const std::string& message) {
     std::stringstream ss;
     
     // 1. Point to the tree
     ss << "tree " << tree_sha << "\n";
     
     // 2. Point to the parent (if it exists)
-    if (!parent_sha.empty()) {
-        ss << "parent " << parent_sha << "\n";
+    if (parent_sha) {
+        ss << "parent " << *parent_sha << "\n";
     }
     
     // 3. Author and Committer info
@@ -42,184 +358,8174 @@ std::string build_commit_content(std::string tree_sha, std::string parent_sha, s
     return ss.str();
 }
 
-// Hashing -> compressing -> storing function
-std::string store_git_object(const std::string& content, const std::string& type) {
-    // 1. Add Header: "commit <size>\0"
-    std::string header = type + " " + std::to_string(content.size()) + '\0';
-    std::vector<char> full_data(header.begin(), header.end());
-    full_data.insert(full_data.end(), content.begin(), content.end());
-
-    // 2. SHA-1 Hash
-    unsigned char hash[20];
-    SHA1(reinterpret_cast<const unsigned char*>(full_data.data()), full_data.size(), hash);
-    
-    std::ostringstream ss;
-    for(int i = 0; i < 20; i++) ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
-    std::string sha = ss.str();
+// work-stealing thread pool
+// every worker owns a deque: it pushes and pops its own tasks at the back (depth-first,
+// cache friendly) and steals from the front of other workers' deques when it runs dry
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t thread_count) {
+        if (thread_count == 0) thread_count = 1;
+        for (size_t i = 0; i < thread_count; i++) {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for (size_t i = 0; i < thread_count; i++) {
+            workers.emplace_back([this, i] { worker_loop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    // index of the calling worker, in [0, size()); only meaningful on a pool thread
+    static size_t current_worker() { return current_index; }
+
+    // tasks submitted from a worker go to that worker's own deque, others are spread round-robin
+    void submit(std::function<void()> task) {
+        size_t index = (current_pool == this) ? current_index
+                                              : next_queue.fetch_add(1) % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            pending++;
+        }
+        idle_cv.notify_one();
+    }
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+    size_t pending = 0; // queued tasks, guarded by idle_mutex
+    bool stopping = false;
+    std::atomic<size_t> next_queue{0};
+
+    static thread_local ThreadPool* current_pool;
+    static thread_local size_t current_index;
+
+    bool try_pop(size_t index, std::function<void()>& task) {
+        // 1. Own queue, newest first
+        {
+            WorkerQueue& own = *queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        // 2. Steal the oldest task from a sibling
+        for (size_t k = 1; k < queues.size(); k++) {
+            WorkerQueue& victim = *queues[(index + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop(size_t index) {
+        current_pool = this;
+        current_index = index;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(idle_mutex);
+                idle_cv.wait(lock, [this] { return stopping || pending > 0; });
+                if (pending == 0) return; // stopping and drained
+                pending--;
+            }
+            // a task is reserved for us, but another worker may hold it briefly in its hands
+            std::function<void()> task;
+            while (!try_pop(index, task)) std::this_thread::yield();
+            task();
+        }
+    }
+};
+
+thread_local ThreadPool* ThreadPool::current_pool = nullptr;
+thread_local size_t ThreadPool::current_index = 0;
+
+// one worker per core
+size_t default_jobs() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// a whole-string decimal option value, e.g. the <n> of --window=<n>; false for anything else
+// (empty, a sign, trailing junk, out of range), so callers print their usage instead of throwing
+template <typename T>
+bool parse_number(const std::string& text, T& value) {
+    const char* end = text.data() + text.size();
+    auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    return ec == std::errc() && ptr == end && !text.empty();
+}
+
+// -j argument; 0 means one per core, and more than four threads per core is refused
+// rather than spawning (or trying to spawn) that many workers
+bool parse_jobs(const std::string& arg, size_t& jobs) {
+    size_t value = 0;
+    if (!parse_number(arg, value) || value > 4 * default_jobs()) return false;
+    jobs = value == 0 ? default_jobs() : value;
+    return true;
+}
+
+// big-endian 32-bit fields, as used by the index and pack formats
+void put_be32(std::string& out, uint32_t v) {
+    out.push_back(static_cast<char>(v >> 24));
+    out.push_back(static_cast<char>(v >> 16));
+    out.push_back(static_cast<char>(v >> 8));
+    out.push_back(static_cast<char>(v));
+}
+
+uint32_t get_be32(const unsigned char* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+// SHA-1 backends
+// on x86-64 with the SHA extensions, blocks go through the sha1rnds4/sha1msg instructions; without
+// them (or with PROTO_GIT_SHA1=openssl) hashing falls back to OpenSSL's EVP interface. batches of
+// independent messages can also be hashed eight at a time in the 32-bit lanes of AVX2 registers
+enum class Sha1Backend { OpenSSL, ShaNi };
+
+#if defined(__x86_64__)
+bool cpu_has_sha_ni() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+    return (ebx & (1u << 29)) && __builtin_cpu_supports("sse4.1");
+}
+
+bool cpu_has_avx2() { return __builtin_cpu_supports("avx2"); }
+
+// one group of four rounds; G is the group number (0-19). the message schedule for group G+4 is
+// built up over groups G+1 (sha1msg1), G+2 (xor) and G+3 (sha1msg2)
+template <int G>
+__attribute__((target("sha,sse4.1"), always_inline)) inline void sha1_shani_group(
+    __m128i& abcd, __m128i (&e)[2], __m128i (&m)[4], const uint8_t* block, __m128i byte_swap) {
+    __m128i& w = m[G % 4];
+    if constexpr (G < 4) {
+        w = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * G)), byte_swap);
+    }
+    if constexpr (G == 0) e[0] = _mm_add_epi32(e[0], w);
+    else e[G % 2] = _mm_sha1nexte_epu32(e[G % 2], w);
+    e[(G + 1) % 2] = abcd;
+    if constexpr (G >= 3 && G <= 18) m[(G + 1) % 4] = _mm_sha1msg2_epu32(m[(G + 1) % 4], w);
+    abcd = _mm_sha1rnds4_epu32(abcd, e[G % 2], G / 5);
+    if constexpr (G >= 1 && G <= 16) m[(G + 3) % 4] = _mm_sha1msg1_epu32(m[(G + 3) % 4], w);
+    if constexpr (G >= 2 && G <= 17) m[(G + 2) % 4] = _mm_xor_si128(m[(G + 2) % 4], w);
+}
+
+template <int... G>
+__attribute__((target("sha,sse4.1"), always_inline)) inline void sha1_shani_rounds(
+    __m128i& abcd, __m128i (&e)[2], __m128i (&m)[4], const uint8_t* block, __m128i byte_swap,
+    std::integer_sequence<int, G...>) {
+    (sha1_shani_group<G>(abcd, e, m, block, byte_swap), ...);
+}
+
+__attribute__((target("sha,sse4.1")))
+void sha1_blocks_shani(uint32_t state[5], const uint8_t* data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+    __m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abcd_save = abcd, e0_save = e0;
+        __m128i e[2] = {e0, _mm_setzero_si128()};
+        __m128i m[4];
+        sha1_shani_rounds(abcd, e, m, data, byte_swap, std::make_integer_sequence<int, 20>());
+        e0 = _mm_sha1nexte_epu32(e[0], e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+}
+
+__attribute__((target("avx2"), always_inline)) inline __m256i rol_x8(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+// one block in each of eight lanes; state[i] holds word i of all eight states, blocks[lane] is
+// that lane's 64-byte block
+__attribute__((target("avx2")))
+void sha1_block_x8(__m256i state[5], const uint8_t (*blocks)[64]) {
+    const __m256i byte_swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                               3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i lane_offsets = _mm256_setr_epi32(0, 64, 128, 192, 256, 320, 384, 448);
+    const int* base = reinterpret_cast<const int*>(blocks);
+
+    __m256i w[16];
+    for (int t = 0; t < 16; t++) {
+        w[t] = _mm256_shuffle_epi8(_mm256_i32gather_epi32(base + t, lane_offsets, 1), byte_swap);
+    }
+
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int t = 0; t < 80; t++) {
+        if (t >= 16) {
+            w[t & 15] = rol_x8(_mm256_xor_si256(_mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]),
+                                                _mm256_xor_si256(w[(t - 14) & 15], w[t & 15])), 1);
+        }
+        __m256i f, k;
+        if (t < 20) {
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+            k = _mm256_set1_epi32(0x5A827999);
+        } else if (t < 40) {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32(0x6ED9EBA1);
+        } else if (t < 60) {
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(_mm256_or_si256(b, c), d));
+            k = _mm256_set1_epi32(static_cast<int>(0x8F1BBCDC));
+        } else {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32(static_cast<int>(0xCA62C1D6));
+        }
+        __m256i temp = _mm256_add_epi32(_mm256_add_epi32(rol_x8(a, 5), f),
+                                        _mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15]));
+        e = d;
+        d = c;
+        c = rol_x8(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e);
+}
+#else
+bool cpu_has_sha_ni() { return false; }
+bool cpu_has_avx2() { return false; }
+#endif
+
+// $PROTO_GIT_SHA1 (openssl | shani) or the fastest one the CPU supports
+Sha1Backend sha1_backend() {
+    static const Sha1Backend backend = [] {
+        const char* env = std::getenv("PROTO_GIT_SHA1");
+        if (env && std::string(env) == "openssl") return Sha1Backend::OpenSSL;
+        return cpu_has_sha_ni() ? Sha1Backend::ShaNi : Sha1Backend::OpenSSL;
+    }();
+    return backend;
+}
+
+// incremental SHA-1, so a header and its content can be hashed without concatenating them
+class Sha1Stream {
+public:
+    explicit Sha1Stream(Sha1Backend backend = sha1_backend()) {
+        if (backend == Sha1Backend::OpenSSL) {
+            ctx = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(ctx, EVP_sha1(), nullptr);
+        }
+    }
+    ~Sha1Stream() {
+        if (ctx) EVP_MD_CTX_free(ctx);
+    }
+    Sha1Stream(const Sha1Stream&) = delete;
+    Sha1Stream& operator=(const Sha1Stream&) = delete;
+
+    void update(const void* data, size_t size) {
+        if (size == 0) return; // an empty file's buffer may be null, which memcpy must not see
+        if (ctx) {
+            EVP_DigestUpdate(ctx, data, size);
+            return;
+        }
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        total += size;
+        if (buffered > 0) {
+            size_t take = std::min(size, sizeof(buffer) - buffered);
+            memcpy(buffer + buffered, p, take);
+            buffered += take;
+            p += take;
+            size -= take;
+            if (buffered < sizeof(buffer)) return;
+            compress(buffer, 1);
+            buffered = 0;
+        }
+        if (size >= 64) {
+            compress(p, size / 64);
+            p += size & ~size_t(63);
+            size &= 63;
+        }
+        memcpy(buffer, p, size);
+        buffered = size;
+    }
+    void update(const std::string& s) { update(s.data(), s.size()); }
+
+    ObjectId digest() {
+        ObjectId id;
+        if (ctx) {
+            EVP_DigestFinal_ex(ctx, id.bytes.data(), nullptr);
+            return id;
+        }
+        // 0x80, zeros up to 56 mod 64, then the length in bits as a big-endian 64-bit number
+        uint64_t bits = total * 8;
+        buffer[buffered++] = 0x80;
+        if (buffered > 56) {
+            memset(buffer + buffered, 0, sizeof(buffer) - buffered);
+            compress(buffer, 1);
+            buffered = 0;
+        }
+        memset(buffer + buffered, 0, 56 - buffered);
+        for (int i = 0; i < 8; i++) buffer[56 + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        compress(buffer, 1);
+        for (int i = 0; i < 20; i++) id.bytes[i] = static_cast<uint8_t>(state[i / 4] >> (24 - 8 * (i % 4)));
+        return id;
+    }
+
+private:
+    EVP_MD_CTX* ctx = nullptr;
+    uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint8_t buffer[64];
+    size_t buffered = 0;
+    uint64_t total = 0;
+
+    void compress(const uint8_t* data, size_t blocks) {
+#if defined(__x86_64__)
+        sha1_blocks_shani(state, data, blocks);
+#else
+        (void)data;
+        (void)blocks;
+        throw std::runtime_error("SHA-NI backend is not available on this platform");
+#endif
+    }
+};
+
+// one message of a batch: a header and a body, hashed as if concatenated
+struct Sha1Message {
+    const void* head;
+    size_t head_size;
+    const void* body;
+    size_t body_size;
+};
+
+#if defined(__x86_64__)
+// the padded block stream of one message, one 64-byte block at a time
+class Sha1Padder {
+public:
+    void reset(const Sha1Message& m) {
+        msg = m;
+        total = m.head_size + m.body_size;
+        blocks = (total + 8) / 64 + 1;
+        next_block = 0;
+    }
+
+    // copies the next block into out; returns true when it was the last one
+    bool next(uint8_t* out) {
+        size_t pos = next_block * 64;
+        size_t filled = 0;
+        if (pos < msg.head_size) {
+            size_t n = std::min<size_t>(64, msg.head_size - pos);
+            memcpy(out, static_cast<const uint8_t*>(msg.head) + pos, n);
+            filled = n;
+        }
+        if (filled < 64 && pos + filled < total) {
+            size_t body_pos = pos + filled - msg.head_size;
+            size_t n = std::min<size_t>(64 - filled, msg.body_size - body_pos);
+            memcpy(out + filled, static_cast<const uint8_t*>(msg.body) + body_pos, n);
+            filled += n;
+        }
+        if (filled < 64) {
+            memset(out + filled, 0, 64 - filled);
+            if (pos + filled == total) out[filled] = 0x80; // the message ends inside this block
+        }
+        bool last = ++next_block == blocks;
+        if (last) {
+            uint64_t bits = uint64_t(total) * 8;
+            for (int i = 0; i < 8; i++) out[56 + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        }
+        return last;
+    }
+
+private:
+    Sha1Message msg{};
+    size_t total = 0;
+    size_t blocks = 0;
+    size_t next_block = 0;
+};
+
+// multi-buffer SHA-1: eight messages advance in lockstep, one block each per step. a lane that
+// finishes its message picks up the next one, so lanes stay busy until the batch runs dry
+__attribute__((target("avx2")))
+void sha1_batch_x8(const Sha1Message* messages, size_t count, ObjectId* out) {
+    static const uint32_t IV[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    alignas(32) uint8_t blocks[8][64];
+    alignas(32) uint32_t lanes[5][8];
+    Sha1Padder padders[8];
+    size_t job[8];
+    bool active[8] = {false};
+    bool last[8] = {false};
+    size_t next_job = 0;
+
+    while (true) {
+        // 1. Refill idle lanes and gather the next block of every active one
+        size_t busy = 0;
+        for (int l = 0; l < 8; l++) {
+            if (!active[l] && next_job < count) {
+                job[l] = next_job;
+                padders[l].reset(messages[next_job++]);
+                for (int i = 0; i < 5; i++) lanes[i][l] = IV[i];
+                active[l] = true;
+            }
+            if (active[l]) {
+                last[l] = padders[l].next(blocks[l]);
+                busy++;
+            }
+        }
+        if (busy == 0) return;
+
+        // 2. Compress all eight lanes at once (idle lanes churn on stale data, harmlessly)
+        __m256i state[5];
+        for (int i = 0; i < 5; i++) state[i] = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes[i]));
+        sha1_block_x8(state, blocks);
+        for (int i = 0; i < 5; i++) _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[i]), state[i]);
+
+        // 3. Emit finished digests
+        for (int l = 0; l < 8; l++) {
+            if (!active[l] || !last[l]) continue;
+            for (int i = 0; i < 20; i++) out[job[l]].bytes[i] = static_cast<uint8_t>(lanes[i / 4][l] >> (24 - 8 * (i % 4)));
+            active[l] = false;
+        }
+    }
+}
+#endif
+
+// ids for a batch of messages: multi-buffer AVX2 when the CPU lacks SHA-NI (a single SHA-NI
+// stream is as fast from 1 KiB objects up and needs no batch to fill), otherwise one stream each
+void sha1_batch(const Sha1Message* messages, size_t count, ObjectId* out) {
+#if defined(__x86_64__)
+    static const bool multi_buffer = [] {
+        const char* env = std::getenv("PROTO_GIT_SHA1");
+        return !(env && std::string(env) == "openssl") && !cpu_has_sha_ni() && cpu_has_avx2();
+    }();
+    if (multi_buffer && count >= 4) {
+        sha1_batch_x8(messages, count, out);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++) {
+        Sha1Stream sha;
+        sha.update(messages[i].head, messages[i].head_size);
+        sha.update(messages[i].body, messages[i].body_size);
+        out[i] = sha.digest();
+    }
+}
+
+// deterministic filler for benchmarks (xorshift64)
+void fill_pseudo_random(char* data, size_t size, uint64_t seed) {
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = static_cast<char>(x);
+    }
+}
+
+// runs fn over and over until at least min_seconds have passed; returns {rounds, seconds}
+std::pair<size_t, double> time_rounds(const std::function<void()>& fn, double min_seconds) {
+    size_t rounds = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        fn();
+        rounds++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < min_seconds);
+    return {rounds, elapsed};
+}
+
+// bench sha1: count distinct blobs of size bytes through every SHA-1 path this build has;
+// prints ns per object and MB/s, and fails if any path disagrees on an id
+void bench_sha1(size_t size, size_t count) {
+    std::vector<char> data(size * count);
+    fill_pseudo_random(data.data(), data.size(), 1);
+    std::string header = "blob " + std::to_string(size) + '\0';
+    std::vector<Sha1Message> messages(count);
+    for (size_t i = 0; i < count; i++) messages[i] = {header.data(), header.size(), data.data() + i * size, size};
+
+    std::vector<ObjectId> reference;
+    auto run = [&](const std::string& name, const std::function<void(std::vector<ObjectId>&)>& hash_all) {
+        std::vector<ObjectId> ids(count);
+        hash_all(ids); // warm-up, and the ids to check
+        auto [rounds, elapsed] = time_rounds([&] { hash_all(ids); }, 0.5);
+        if (reference.empty()) reference = ids; // the first path is the baseline
+        else if (ids != reference) throw std::runtime_error("bench: " + name + " produced different ids");
+        double objects = double(count) * rounds;
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << elapsed * 1e9 / objects << " ns/object" << std::setw(10)
+                  << objects * (size + header.size()) / elapsed / 1e6 << " MB/s\n";
+    };
+
+    std::cout << count << " blobs of " << size << " bytes\n";
+    run("SHA1() on header+content", [&](std::vector<ObjectId>& ids) {
+        std::string buf;
+        for (size_t i = 0; i < count; i++) {
+            buf.assign(header);
+            buf.append(data.data() + i * size, size);
+            SHA1(reinterpret_cast<const unsigned char*>(buf.data()), buf.size(), ids[i].bytes.data());
+        }
+    });
+    auto stream_with = [&](Sha1Backend backend) {
+        return [&, backend](std::vector<ObjectId>& ids) {
+            for (size_t i = 0; i < count; i++) {
+                Sha1Stream sha(backend);
+                sha.update(header);
+                sha.update(data.data() + i * size, size);
+                ids[i] = sha.digest();
+            }
+        };
+    };
+    run("EVP stream", stream_with(Sha1Backend::OpenSSL));
+    if (cpu_has_sha_ni()) run("SHA-NI stream", stream_with(Sha1Backend::ShaNi));
+#if defined(__x86_64__)
+    if (cpu_has_avx2()) {
+        run("AVX2 x8 multi-buffer", [&](std::vector<ObjectId>& ids) { sha1_batch_x8(messages.data(), count, ids.data()); });
+    }
+#endif
+    run("sha1_batch (dispatched)", [&](std::vector<ObjectId>& ids) { sha1_batch(messages.data(), count, ids.data()); });
+}
+
+// writes every byte or throws
+void write_all(int fd, const char* data, size_t size, const std::string& what) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("Failed to write " + what + ": " + strerror(errno));
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        trace_count(Counter::BytesWritten, static_cast<size_t>(n));
+    }
+}
+
+// ---- batched file I/O ----
+// the object store and checkout touch thousands of small files. where the kernel has io_uring,
+// each step of a batch (the opens, then the reads or writes, then the closes; renames; fsyncs) is
+// queued in the submission ring and handed over with one io_uring_enter rather than a syscall per
+// file, keeping up to IO_RING_DEPTH operations in flight. the ring is driven with the raw syscalls
+// and <linux/io_uring.h>, so liburing is not needed. it is opt-in (PROTO_GIT_IO=uring): with a
+// cold cache or slow storage the queue depth pays off several times over, but with everything
+// cached the kernel hands opens and stats to its worker threads and plain syscalls are quicker.
+// otherwise (and on other platforms, old kernels or under seccomp) the same batches run as
+// ordinary blocking calls
+
+// starts writeback of a file's dirty pages without waiting for it or flushing the disk cache, as
+// git's core.fsyncMethod=batch does; the flush that follows (one fsync) then finds them on their
+// way. where sync_file_range doesn't exist it is a plain fsync
+int start_writeout(int fd) {
+    int r = sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    if (r != 0 && errno == ENOSYS) r = fsync(fd);
+    return r;
+}
+
+// one operation of a batch. result is what the syscall returns (an fd, a byte count, 0) or -errno
+struct IoOp {
+    enum Kind : uint8_t { Open, Read, Write, Close, Rename, Fsync, Stat, Writeout };
+    Kind kind;
+    int fd = -1;
+    const char* path = nullptr;
+    const char* new_path = nullptr; // Rename
+    char* buf = nullptr;            // Read, Write
+    size_t len = 0;
+    uint64_t offset = 0;
+    int flags = 0;                  // Open
+    mode_t mode = 0;                // Open
+    struct statx* stx = nullptr;    // Stat
+    int64_t result = 0;
+};
+
+const unsigned IO_RING_DEPTH = 256;
+
+class IoEngine {
+public:
+    // per thread: a ring has a single submitter. once the thread's engine is destroyed (at exit,
+    // when static destructors such as the object writer's final flush may still do I/O) a shared
+    // blocking engine, never destroyed, stands in
+    static IoEngine& get() {
+        static thread_local bool gone = false;
+        struct Holder {
+            IoEngine engine;
+            ~Holder() { gone = true; }
+        };
+        if (gone) {
+            static IoEngine* blocking = new IoEngine(false);
+            return *blocking;
+        }
+        thread_local Holder holder;
+        return holder.engine;
+    }
+
+    // whether this process uses io_uring, decided once
+    static bool uring_enabled() {
+        static const bool enabled = [] {
+#ifdef PROTO_GIT_IO_URING
+            if (!uring_requested()) return false;
+            IoEngine probe;
+            return probe.ring_fd >= 0;
+#else
+            return false;
+#endif
+        }();
+        return enabled;
+    }
+
+    // runs every op of a batch; they may complete in any order, so an op that needs another's
+    // result (a read of an opened fd) goes in a later batch
+    void run(std::vector<IoOp>& ops) {
+        if (ops.empty()) return;
+        trace_count(Counter::IoBatches);
+        trace_count(Counter::IoOps, ops.size());
+#ifdef PROTO_GIT_IO_URING
+        if (uring_enabled() && ring_fd >= 0) {
+            TraceSpan span("io-uring");
+            run_uring(ops);
+            return;
+        }
+#endif
+        for (IoOp& op : ops) run_blocking(op);
+    }
+
+    ~IoEngine() {
+#ifdef PROTO_GIT_IO_URING
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sq_ring) munmap(sq_ring, sq_ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+#endif
+    }
+
+private:
+    explicit IoEngine(bool use_ring = uring_requested()) {
+#ifdef PROTO_GIT_IO_URING
+        if (use_ring) setup();
+#else
+        (void)use_ring;
+#endif
+    }
+
+    static bool uring_requested() {
+        const char* env = std::getenv("PROTO_GIT_IO");
+        return env && std::string(env) == "uring";
+    }
+    IoEngine(const IoEngine&) = delete;
+    IoEngine& operator=(const IoEngine&) = delete;
+
+    static void run_blocking(IoOp& op) {
+        int64_t r = -1;
+        switch (op.kind) {
+        case IoOp::Open: r = open(op.path, op.flags, op.mode); break;
+        case IoOp::Read: r = pread(op.fd, op.buf, op.len, static_cast<off_t>(op.offset)); break;
+        case IoOp::Write: r = pwrite(op.fd, op.buf, op.len, static_cast<off_t>(op.offset)); break;
+        case IoOp::Close: r = close(op.fd); break;
+        case IoOp::Rename: r = rename(op.path, op.new_path); break;
+        case IoOp::Fsync: r = fsync(op.fd); break;
+        case IoOp::Stat: r = statx(AT_FDCWD, op.path, 0, STATX_BASIC_STATS, op.stx); break;
+        case IoOp::Writeout: r = start_writeout(op.fd); break;
+        }
+        op.result = r < 0 ? -errno : r;
+    }
+
+#ifdef PROTO_GIT_IO_URING
+    int ring_fd = -1;
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned sq_entries = 0, cq_entries = 0;
+
+    // ring and its three mappings; any failure (or a kernel without one of our opcodes) leaves
+    // ring_fd at -1 and the engine blocking
+    void setup() {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = static_cast<int>(syscall(__NR_io_uring_setup, IO_RING_DEPTH, &params));
+        if (fd < 0) return;
+        ring_fd = fd;
+        sq_entries = params.sq_entries;
+        cq_entries = params.cq_entries;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) return fail();
+        cq_ring = single ? sq_ring
+                         : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) return fail();
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) return fail();
+        sqes = static_cast<io_uring_sqe*>(s);
+
+        auto* sq = static_cast<char*>(sq_ring);
+        auto* cq = static_cast<char*>(cq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // the probe lists what this kernel supports; openat, close and statx need 5.6, renameat 5.11
+        std::vector<char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) return fail();
+        for (int op : {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_RENAMEAT,
+                       IORING_OP_FSYNC, IORING_OP_STATX, IORING_OP_SYNC_FILE_RANGE}) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return fail();
+        }
+    }
+
+    void fail() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sq_ring && sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+        ring_fd = -1;
+        sq_ring = cq_ring = nullptr;
+        sqes = nullptr;
+    }
+
+    static void prepare(io_uring_sqe& sqe, const IoOp& op, uint64_t user_data) {
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.user_data = user_data;
+        switch (op.kind) {
+        case IoOp::Open:
+            sqe.opcode = IORING_OP_OPENAT;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = reinterpret_cast<uintptr_t>(op.path);
+            sqe.len = op.mode;
+            sqe.open_flags = static_cast<uint32_t>(op.flags);
+            break;
+        case IoOp::Read:
+        case IoOp::Write:
+            sqe.opcode = op.kind == IoOp::Read ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe.fd = op.fd;
+            sqe.addr = reinterpret_cast<uintptr_t>(op.buf);
+            sqe.len = static_cast<uint32_t>(op.len);
+            sqe.off = op.offset;
+            break;
+        case IoOp::Close:
+            sqe.opcode = IORING_OP_CLOSE;
+            sqe.fd = op.fd;
+            break;
+        case IoOp::Rename:
+            sqe.opcode = IORING_OP_RENAMEAT;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = reinterpret_cast<uintptr_t>(op.path);
+            sqe.len = static_cast<uint32_t>(AT_FDCWD);
+            sqe.addr2 = reinterpret_cast<uintptr_t>(op.new_path);
+            break;
+        case IoOp::Fsync:
+            sqe.opcode = IORING_OP_FSYNC;
+            sqe.fd = op.fd;
+            break;
+        case IoOp::Stat:
+            sqe.opcode = IORING_OP_STATX;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = reinterpret_cast<uintptr_t>(op.path);
+            sqe.len = STATX_BASIC_STATS;
+            sqe.addr2 = reinterpret_cast<uintptr_t>(op.stx);
+            break;
+        case IoOp::Writeout:
+            sqe.opcode = IORING_OP_SYNC_FILE_RANGE;
+            sqe.fd = op.fd;
+            sqe.sync_range_flags = SYNC_FILE_RANGE_WRITE;
+            break;
+        }
+    }
+
+    // keeps the submission ring as full as the batch allows and reaps whatever has completed
+    void run_uring(std::vector<IoOp>& ops) {
+        size_t next = 0, done = 0, in_flight = 0;
+        while (done < ops.size()) {
+            // 1. Queue as many as fit (the completion ring must have room for all of them)
+            unsigned tail = *sq_tail;
+            unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            while (next < ops.size() && tail - head < sq_entries && in_flight < cq_entries) {
+                unsigned index = tail & *sq_mask;
+                prepare(sqes[index], ops[next], next);
+                sq_array[index] = index;
+                tail++;
+                next++;
+                in_flight++;
+            }
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+            // 2. Submit, and wait for all of them once nothing is left to queue
+            unsigned to_submit = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            unsigned wait = next == ops.size() ? static_cast<unsigned>(in_flight) : 1;
+            long r = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+            }
+
+            // 3. Reap
+            unsigned cq_at = *cq_head;
+            unsigned cq_end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; cq_at != cq_end; cq_at++) {
+                const io_uring_cqe& cqe = cqes[cq_at & *cq_mask];
+                ops[cqe.user_data].result = cqe.res;
+                in_flight--;
+                done++;
+            }
+            __atomic_store_n(cq_head, cq_at, __ATOMIC_RELEASE);
+        }
+    }
+#endif
+};
+
+// whole small files, through the engine: statx (unless the sizes are known), then open, read and
+// close as three more batches. each read asks for one byte more than the size, so a file that grew
+// since its stat is noticed. contents[i] is the file, or nullopt when any step failed for it, its
+// size changed, or it is larger than max_size (callers take their one-file path for those)
+void read_small_files(const std::vector<std::string>& paths, size_t max_size, std::vector<std::optional<std::vector<char>>>& contents,
+                      const std::vector<uint64_t>* known_sizes = nullptr) {
+    IoEngine& engine = IoEngine::get();
+    contents.assign(paths.size(), std::nullopt);
+    std::vector<uint64_t> sizes(paths.size(), UINT64_MAX);
+    std::vector<IoOp> ops;
+    if (known_sizes) {
+        sizes = *known_sizes;
+    } else {
+        std::vector<struct statx> stats(paths.size());
+        ops.assign(paths.size(), IoOp{IoOp::Stat});
+        for (size_t i = 0; i < paths.size(); i++) {
+            ops[i].path = paths[i].c_str();
+            ops[i].stx = &stats[i];
+        }
+        engine.run(ops);
+        for (size_t i = 0; i < paths.size(); i++) {
+            if (ops[i].result == 0) sizes[i] = stats[i].stx_size;
+        }
+    }
+
+    std::vector<size_t> chosen;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (sizes[i] <= max_size) chosen.push_back(i);
+    }
+    ops.assign(chosen.size(), IoOp{IoOp::Open});
+    for (size_t k = 0; k < chosen.size(); k++) {
+        ops[k].path = paths[chosen[k]].c_str();
+        ops[k].flags = O_RDONLY | O_CLOEXEC;
+    }
+    engine.run(ops);
+
+    std::vector<int> fds(chosen.size());
+    std::vector<IoOp> reads, closes;
+    std::vector<size_t> read_owner;
+    for (size_t k = 0; k < chosen.size(); k++) {
+        fds[k] = static_cast<int>(ops[k].result);
+        if (fds[k] < 0) continue;
+        size_t i = chosen[k];
+        contents[i].emplace(sizes[i] + 1);
+        IoOp read{IoOp::Read};
+        read.fd = fds[k];
+        read.buf = contents[i]->data();
+        read.len = contents[i]->size();
+        reads.push_back(read);
+        read_owner.push_back(i);
+        IoOp closing{IoOp::Close};
+        closing.fd = fds[k];
+        closes.push_back(closing);
+    }
+    engine.run(reads);
+    for (size_t r = 0; r < reads.size(); r++) {
+        std::optional<std::vector<char>>& content = contents[read_owner[r]];
+        if (reads[r].result != static_cast<int64_t>(reads[r].len) - 1) content.reset(); // changed under us
+        else content->pop_back();
+    }
+    engine.run(closes);
+}
+
+// small in-memory files written in three batches (open, write, close), with a writeout batch
+// (start_writeout) before the closes when asked; throws on the first failure
+struct FileWrite {
+    std::string path;
+    const char* data;
+    size_t size;
+    int flags; // besides O_WRONLY | O_CLOEXEC
+    mode_t mode;
+};
+
+void write_small_files(const std::vector<FileWrite>& files, bool writeout = false) {
+    IoEngine& engine = IoEngine::get();
+    std::vector<IoOp> opens(files.size(), IoOp{IoOp::Open});
+    for (size_t i = 0; i < files.size(); i++) {
+        opens[i].path = files[i].path.c_str();
+        opens[i].flags = O_WRONLY | O_CLOEXEC | files[i].flags;
+        opens[i].mode = files[i].mode;
+    }
+    engine.run(opens);
+
+    std::vector<IoOp> writes, closes;
+    std::string error;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (opens[i].result < 0) {
+            if (error.empty()) error = "Failed to create " + files[i].path + ": " + strerror(static_cast<int>(-opens[i].result));
+            continue;
+        }
+        IoOp write{IoOp::Write};
+        write.fd = static_cast<int>(opens[i].result);
+        write.buf = const_cast<char*>(files[i].data);
+        write.len = files[i].size;
+        writes.push_back(write);
+        IoOp closing{IoOp::Close};
+        closing.fd = write.fd;
+        closes.push_back(closing);
+    }
+    engine.run(writes);
+    for (IoOp& w : writes) {
+        // a short write (or a failed one) is finished, or reported, the blocking way
+        if (w.result == static_cast<int64_t>(w.len)) {
+            trace_count(Counter::BytesWritten, w.len);
+            continue;
+        }
+        size_t written = w.result > 0 ? static_cast<size_t>(w.result) : 0;
+        try {
+            if (w.result < 0 && w.result != -EINTR && w.result != -EAGAIN) {
+                throw std::runtime_error(std::string("Failed to write: ") + strerror(static_cast<int>(-w.result)));
+            }
+            if (lseek(w.fd, static_cast<off_t>(written), SEEK_SET) < 0) throw std::runtime_error("lseek failed");
+            write_all(w.fd, w.buf + written, w.len - written, "file");
+        } catch (const std::exception& e) {
+            if (error.empty()) error = e.what();
+        }
+    }
+    if (writeout && error.empty()) {
+        std::vector<IoOp> syncs = closes;
+        for (IoOp& op : syncs) op.kind = IoOp::Writeout;
+        engine.run(syncs);
+        for (const IoOp& op : syncs) {
+            if (op.result < 0 && error.empty()) error = std::string("Failed to sync a written file: ") + strerror(static_cast<int>(-op.result));
+        }
+    }
+    engine.run(closes);
+    for (const IoOp& c : closes) {
+        if (c.result < 0 && error.empty()) error = std::string("Failed to close a written file: ") + strerror(static_cast<int>(-c.result));
+    }
+    if (!error.empty()) throw std::runtime_error(error);
+}
+
+// ---- compression engine ----
+// every object is deflated at compression_level() (PROTO_GIT_COMPRESSION, -1..9 as in zlib and
+// core.compression) unless a sample of it looks already compressed (JPEG, zip, .tar.gz...): that
+// content is stored at level 0, which is still valid zlib but costs a copy instead of a deflate.
+// whole in-memory buffers go through libdeflate when libdeflate.so.0 can be loaded at run time;
+// files too big for memory are streamed through zlib.
+
+enum class DeflateBackend { Zlib, Libdeflate };
+
+// below this size deflate is cheap whatever the content, and the sample is too small to trust
+const size_t ENTROPY_MIN_SIZE = 1024;
+// bits per byte above which deflate is not expected to gain anything
+const double INCOMPRESSIBLE_ENTROPY = 7.5;
+
+int compression_level() {
+    static const int level = [] {
+        const char* env = std::getenv("PROTO_GIT_COMPRESSION");
+        if (!env || !*env) return Z_DEFAULT_COMPRESSION;
+        int l = 0;
+        if (!parse_number(std::string(env), l) || l < -1 || l > 9) {
+            // read once per process, so this warns once
+            std::cerr << "warning: ignoring PROTO_GIT_COMPRESSION=" << env << " (expected -1..9)\n";
+            return Z_DEFAULT_COMPRESSION;
+        }
+        return l;
+    }();
+    return level;
+}
+
+// Shannon entropy in bits per byte over four 4 KiB slices spread across the data (or all of it)
+double sample_entropy(const char* data, size_t size) {
+    const size_t SLICE = 4096, SLICES = 4;
+    uint32_t counts[256] = {};
+    auto count = [&](const char* p, size_t n) {
+        for (size_t i = 0; i < n; i++) counts[static_cast<uint8_t>(p[i])]++;
+    };
+    size_t sampled;
+    if (size <= SLICE * SLICES) {
+        count(data, size);
+        sampled = size;
+    } else {
+        for (size_t s = 0; s < SLICES; s++) count(data + (size - SLICE) * s / (SLICES - 1), SLICE);
+        sampled = SLICE * SLICES;
+    }
+    if (sampled == 0) return 0;
+    double bits = 0;
+    for (uint32_t c : counts) {
+        if (c == 0) continue;
+        double p = double(c) / sampled;
+        bits -= p * std::log2(p);
+    }
+    return bits;
+}
+
+// the level to deflate this content at
+int choose_level(const char* data, size_t size, int level = compression_level()) {
+    if (level != 0 && size >= ENTROPY_MIN_SIZE && sample_entropy(data, size) >= INCOMPRESSIBLE_ENTROPY) return 0;
+    return level;
+}
+
+// libdeflate, bound at run time so the build does not need its headers.
+// compressors are expensive to set up, so each thread keeps one per level
+class Libdeflate {
+public:
+    static const Libdeflate* get() {
+        static const Libdeflate* lib = [] () -> const Libdeflate* {
+            static Libdeflate l;
+            return l.loaded ? &l : nullptr;
+        }();
+        return lib;
+    }
+
+    // zlib stream of data at level 1..12; returns the compressed size, 0 if out is too small
+    size_t compress(int level, const char* data, size_t size, char* out, size_t out_size) const {
+        struct Compressors {
+            const Libdeflate* lib;
+            std::array<void*, 13> at{};
+            ~Compressors() {
+                for (void* c : at) if (c) lib->free_compressor(c);
+            }
+        };
+        thread_local Compressors compressors{this};
+        void*& c = compressors.at[level];
+        if (!c) c = alloc_compressor(level);
+        if (!c) throw std::runtime_error("libdeflate: cannot allocate a level " + std::to_string(level) + " compressor");
+        return zlib_compress(c, data, size, out, out_size);
+    }
+
+    size_t bound(size_t size) const { return zlib_compress_bound(nullptr, size); }
+
+private:
+    void* (*alloc_compressor)(int) = nullptr;
+    void (*free_compressor)(void*) = nullptr;
+    size_t (*zlib_compress)(void*, const void*, size_t, void*, size_t) = nullptr;
+    size_t (*zlib_compress_bound)(void*, size_t) = nullptr;
+    bool loaded = false;
+
+    Libdeflate() {
+        void* handle = dlopen("libdeflate.so.0", RTLD_NOW | RTLD_LOCAL);
+        if (!handle) return;
+        alloc_compressor = reinterpret_cast<decltype(alloc_compressor)>(dlsym(handle, "libdeflate_alloc_compressor"));
+        free_compressor = reinterpret_cast<decltype(free_compressor)>(dlsym(handle, "libdeflate_free_compressor"));
+        zlib_compress = reinterpret_cast<decltype(zlib_compress)>(dlsym(handle, "libdeflate_zlib_compress"));
+        zlib_compress_bound = reinterpret_cast<decltype(zlib_compress_bound)>(dlsym(handle, "libdeflate_zlib_compress_bound"));
+        loaded = alloc_compressor && free_compressor && zlib_compress && zlib_compress_bound;
+    }
+};
+
+// PROTO_GIT_DEFLATE=zlib forces zlib; otherwise libdeflate when it can be loaded
+DeflateBackend deflate_backend() {
+    static const DeflateBackend backend = [] {
+        const char* env = std::getenv("PROTO_GIT_DEFLATE");
+        if (env && std::string(env) == "zlib") return DeflateBackend::Zlib;
+        return Libdeflate::get() ? DeflateBackend::Libdeflate : DeflateBackend::Zlib;
+    }();
+    return backend;
+}
+
+// one-shot zlib stream of data at level, into out (resized to fit)
+void compress_buffer(const char* data, size_t size, int level, std::vector<char>& out,
+                     DeflateBackend backend = deflate_backend()) {
+    trace_count(Counter::BytesDeflated, size);
+    // 1. Level 0 is a copy into stored blocks, which zlib does as well as anything
+    if (backend == DeflateBackend::Libdeflate && level != 0) {
+        const Libdeflate* lib = Libdeflate::get();
+        out.resize(lib->bound(size));
+        size_t n = lib->compress(level < 0 ? 6 : level, data, size, out.data(), out.size());
+        if (n == 0) throw std::runtime_error("libdeflate: compression failed");
+        out.resize(n);
+        return;
+    }
+    // 2. zlib
+    uLongf n = compressBound(size);
+    out.resize(n);
+    if (compress2(reinterpret_cast<Bytef*>(out.data()), &n, reinterpret_cast<const Bytef*>(data), size, level) != Z_OK) {
+        throw std::runtime_error("zlib: compression failed");
+    }
+    out.resize(n);
+}
+
+// deterministic source-like text for benchmarks: lines of words from a small vocabulary
+void fill_pseudo_text(char* data, size_t size, uint64_t seed) {
+    static const char* const words[] = {
+        "int", "return", "const", "std::string", "if", "else", "for", "size_t", "data", "size",
+        "object", "tree", "blob", "commit", "=", "==", "(", ")", "{", "}", ";", "->", "auto", "void",
+    };
+    const size_t n_words = sizeof(words) / sizeof(words[0]);
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    size_t i = 0, column = 0;
+    while (i < size) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        const char* w = words[x % n_words];
+        for (; *w && i < size; w++, column++) data[i++] = *w;
+        if (i < size) data[i++] = column > 60 + (x >> 32) % 20 ? '\n' : ' ';
+        if (column > 60) column = 0;
+    }
+}
+
+// bench compress: count objects of size bytes of text, random and alternating (mixed) content
+// through each backend and level; prints MB/s of input and the compressed/original ratio, and
+// fails if any output does not inflate back to its input
+void bench_compress(size_t size, size_t count) {
+    std::vector<char> text(size * count), random(size * count), mixed(size * count);
+    fill_pseudo_text(text.data(), text.size(), 1);
+    fill_pseudo_random(random.data(), random.size(), 2);
+    for (size_t i = 0; i < count; i++) {
+        memcpy(mixed.data() + i * size, (i % 2 ? random : text).data() + i * size, size);
+    }
+
+    struct Setting {
+        std::string name;
+        DeflateBackend backend;
+        int level;
+        bool adaptive;
+    };
+    std::vector<Setting> settings;
+    for (int level : {0, 1, 6, 9}) settings.push_back({"zlib -" + std::to_string(level), DeflateBackend::Zlib, level, false});
+    if (Libdeflate::get()) {
+        for (int level : {1, 6, 9, 12}) {
+            settings.push_back({"libdeflate -" + std::to_string(level), DeflateBackend::Libdeflate, level, false});
+        }
+    }
+    settings.push_back({"adaptive (default)", deflate_backend(), compression_level(), true});
+
+    std::cout << count << " objects of " << size << " bytes\n" << std::left << std::setw(22) << "setting";
+    for (const char* name : {"text", "random", "mixed"}) std::cout << std::right << std::setw(24) << name;
+    std::cout << '\n';
+    for (const Setting& s : settings) {
+        std::cout << std::left << std::setw(22) << s.name << std::right << std::fixed;
+        for (const std::vector<char>* input : {&text, &random, &mixed}) {
+            std::vector<char> out, check(size);
+            auto compress_all = [&]() {
+                size_t total = 0;
+                for (size_t i = 0; i < count; i++) {
+                    const char* p = input->data() + i * size;
+                    compress_buffer(p, size, s.adaptive ? choose_level(p, size, s.level) : s.level, out, s.backend);
+                    total += out.size();
+                }
+                return total;
+            };
+            // 1. Round trip of every object once
+            for (size_t i = 0; i < count; i++) {
+                const char* p = input->data() + i * size;
+                compress_buffer(p, size, s.adaptive ? choose_level(p, size, s.level) : s.level, out, s.backend);
+                uLongf n = size;
+                if (uncompress(reinterpret_cast<Bytef*>(check.data()), &n, reinterpret_cast<const Bytef*>(out.data()), out.size()) != Z_OK ||
+                    n != size || memcmp(check.data(), p, size) != 0) {
+                    throw std::runtime_error("bench: " + s.name + " does not round-trip");
+                }
+            }
+            // 2. Timed passes
+            size_t compressed = 0;
+            auto [rounds, elapsed] = time_rounds([&] { compressed = compress_all(); }, 0.3);
+            std::cout << std::setprecision(1) << std::setw(10) << double(input->size()) * rounds / elapsed / 1e6
+                      << " MB/s" << std::setprecision(3) << std::setw(9) << double(compressed) / input->size();
+        }
+        std::cout << '\n';
+    }
+}
+
+// incremental zlib deflate straight into a file descriptor
+class DeflateSink {
+public:
+    DeflateSink(int fd, std::string what, int level = compression_level())
+        : fd(fd), what(std::move(what)), out(64 * 1024) {
+        memset(&zs, 0, sizeof(zs));
+        deflateInit(&zs, level);
+    }
+    ~DeflateSink() { deflateEnd(&zs); }
+    DeflateSink(const DeflateSink&) = delete;
+    DeflateSink& operator=(const DeflateSink&) = delete;
+
+    void feed(const void* data, size_t len, int flush = Z_NO_FLUSH) {
+        trace_count(Counter::BytesDeflated, len);
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(data));
+        zs.avail_in = static_cast<uInt>(len);
+        int ret;
+        do {
+            zs.next_out = reinterpret_cast<Bytef*>(out.data());
+            zs.avail_out = static_cast<uInt>(out.size());
+            ret = deflate(&zs, flush);
+            if (ret == Z_STREAM_ERROR) throw std::runtime_error("Compression failed for " + what);
+            write_all(fd, out.data(), out.size() - zs.avail_out, what);
+        } while (zs.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    }
+    void feed(const std::string& s) { feed(s.data(), s.size()); }
+    void finish() { feed(nullptr, 0, Z_FINISH); }
+
+private:
+    z_stream zs;
+    int fd;
+    std::string what;
+    std::vector<char> out;
+};
+
+// files are read (and streamed) in chunks of this size
+const size_t BLOB_CHUNK_SIZE = 64 * 1024;
+
+bool packed_object_exists(const std::filesystem::path& objects_dir, const ObjectId& id); // after PackSet
+
+// object writer
+// the one header -> SHA-1 -> zlib -> disk pipeline behind every object this tool stores.
+// an object that already exists is recognised from its id and never compressed or written again.
+// new objects go to a temp file whose writeback starts at once, and stay pending until the batch is
+// flushed: like git's core.fsyncMethod=batch, one fsync of a dummy file then makes the whole batch
+// durable, the files are renamed into place and the fan-out dirs are synced
+class ObjectWriter {
+public:
+    explicit ObjectWriter(std::filesystem::path dir) : objects_dir(std::move(dir)) {}
+    ~ObjectWriter() {
+        try { flush(); } catch (const std::exception& e) { std::cerr << e.what() << '\n'; }
+    }
+    ObjectWriter(const ObjectWriter&) = delete;
+    ObjectWriter& operator=(const ObjectWriter&) = delete;
+
+    std::atomic<size_t> objects_written{0};
+    std::atomic<size_t> objects_skipped{0};
+
+    // in-memory object of the given type; returns its id
+    ObjectId write(const std::string& type, const char* data, size_t size) {
+        std::string header = type + " " + std::to_string(size) + '\0';
+        ObjectId id;
+        {
+            TraceSpan span("sha1");
+            Sha1Stream sha;
+            sha.update(header);
+            sha.update(data, size);
+            id = sha.digest();
+            trace_count(Counter::BytesHashed, size);
+        }
+        store(id, header, data, size);
+        return id;
+    }
+
+    // several in-memory objects of one type, hashed together as a batch (see sha1_batch)
+    std::vector<ObjectId> write_batch(const std::string& type, const std::vector<std::pair<const char*, size_t>>& objects) {
+        std::vector<std::string> headers;
+        headers.reserve(objects.size());
+        std::vector<Sha1Message> messages;
+        for (const auto& [data, size] : objects) {
+            headers.push_back(type + " " + std::to_string(size) + '\0');
+            messages.push_back({headers.back().data(), headers.back().size(), data, size});
+        }
+        std::vector<ObjectId> ids(objects.size());
+        {
+            TraceSpan span("sha1-batch");
+            sha1_batch(messages.data(), messages.size(), ids.data());
+            for (const auto& m : messages) trace_count(Counter::BytesHashed, m.body_size);
+        }
+        for (size_t i = 0; i < objects.size(); i++) store(ids[i], headers[i], objects[i].first, objects[i].second);
+        return ids;
+    }
+
+    // file content as a blob, streamed in chunks so memory stays flat for any file size
+    ObjectId write_file(const std::filesystem::path& file) {
+        std::ifstream in(file, std::ios::binary);
+        if (!in.is_open()) {
+            throw std::runtime_error("Failed to open file: " + file.string());
+        }
+        uint64_t size = std::filesystem::file_size(file);
+        std::vector<char> buf(BLOB_CHUNK_SIZE);
+
+        // 1. Small files are read once and take the in-memory path
+        if (size <= buf.size()) {
+            {
+                TraceSpan span("read");
+                in.read(buf.data(), buf.size());
+            }
+            if (static_cast<uint64_t>(in.gcount()) != size) {
+                throw std::runtime_error("File changed while hashing: " + file.string());
+            }
+            return write("blob", buf.data(), size);
+        }
+
+        // 2. Hash-only pass, so an existing blob costs a read and no deflate
+        std::string header = "blob " + std::to_string(size) + '\0';
+        ObjectId id;
+        {
+            TraceSpan span("read+sha1");
+            id = hash_stream(in, header, size, file, nullptr);
+        }
+        if (exists(id)) {
+            objects_skipped++;
+            trace_count(Counter::ObjectsSkipped);
+            return id;
+        }
+
+        // 3. The first chunk decides the level, so an already-compressed asset is stored, not deflated
+        in.clear();
+        in.seekg(0);
+        in.read(buf.data(), buf.size());
+        int level = choose_level(buf.data(), static_cast<size_t>(in.gcount()));
+
+        // 4. Deflate pass into a temp object; rehashing catches edits between the two passes
+        in.clear();
+        in.seekg(0);
+        TraceSpan span("read+sha1+deflate+write");
+        int fd;
+        std::string tmp = create_temp(fd);
+        try {
+            DeflateSink sink(fd, tmp, level);
+            sink.feed(header);
+            if (hash_stream(in, header, size, file, &sink) != id) {
+                throw std::runtime_error("File changed while hashing: " + file.string());
+            }
+            sink.finish();
+        } catch (...) {
+            close(fd);
+            std::filesystem::remove(tmp);
+            throw;
+        }
+        commit(fd, tmp, id);
+        return id;
+    }
+
+    // publishes every pending object
+    void flush() {
+        std::vector<PendingObject> batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batch.swap(pending);
+        }
+        if (batch.empty()) return;
+        TraceSpan span("flush");
+        IoEngine& engine = IoEngine::get();
+
+        // 1. Objects kept in memory become temp files in one batch of opens, writes and closes
+        std::vector<FileWrite> deferred;
+        for (auto& p : batch) {
+            if (!p.tmp.empty()) continue;
+            p.tmp = (objects_dir / ("tmp_obj_" + std::to_string(getpid()) + "_" + std::to_string(temp_counter++))).string();
+            deferred.push_back({p.tmp, p.data.data(), p.data.size(), O_CREAT | O_EXCL, 0644});
+        }
+        if (!deferred.empty()) {
+            try {
+                write_small_files(deferred, true);
+            } catch (...) {
+                for (const auto& f : deferred) unlink(f.path.c_str());
+                throw;
+            }
+        }
+
+        // 2. One fsync for the whole batch instead of one per object: the objects' writeback is
+        // under way, and fsyncing a dummy file on the same filesystem flushes the journal and the
+        // disk cache behind all of them (syncfs would wait for every other file on the disk too)
+        {
+            int fd;
+            std::string dummy = create_temp(fd);
+            int r = fsync(fd);
+            int saved = errno;
+            close(fd);
+            unlink(dummy.c_str());
+            if (r != 0) throw std::runtime_error("Failed to sync " + objects_dir.string() + ": " + strerror(saved));
+        }
+
+        // 3. Rename into .git/objects/xx/xxxx..., all renames in one batch
+        std::set<std::string> touched;
+        std::vector<std::string> targets;
+        targets.reserve(batch.size());
+        for (const auto& p : batch) {
+            std::string path = p.id.loose_path();
+            std::string dir = path.substr(0, 2);
+            ensure_fanout(dir);
+            targets.push_back((objects_dir / path).string());
+            touched.insert(dir);
+        }
+        std::vector<IoOp> ops(batch.size(), IoOp{IoOp::Rename});
+        for (size_t i = 0; i < batch.size(); i++) {
+            ops[i].path = batch[i].tmp.c_str();
+            ops[i].new_path = targets[i].c_str();
+        }
+        engine.run(ops);
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (ops[i].result < 0) {
+                throw std::runtime_error("Failed to rename " + batch[i].tmp + " to " + targets[i] + ": " +
+                                         strerror(static_cast<int>(-ops[i].result)));
+            }
+        }
+
+        // 4. Make the new directory entries durable (open, fsync and close, a batch each)
+        std::vector<std::string> dirs;
+        for (const auto& dir : touched) dirs.push_back((objects_dir / dir).string());
+        ops.assign(dirs.size(), IoOp{IoOp::Open});
+        for (size_t i = 0; i < dirs.size(); i++) {
+            ops[i].path = dirs[i].c_str();
+            ops[i].flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+        }
+        engine.run(ops);
+        std::vector<IoOp> syncs, closes;
+        std::string error;
+        for (size_t i = 0; i < dirs.size(); i++) {
+            if (ops[i].result < 0) {
+                if (error.empty()) error = "Failed to open " + dirs[i] + ": " + strerror(static_cast<int>(-ops[i].result));
+                continue;
+            }
+            IoOp op{IoOp::Fsync};
+            op.fd = static_cast<int>(ops[i].result);
+            syncs.push_back(op);
+            op.kind = IoOp::Close;
+            closes.push_back(op);
+        }
+        engine.run(syncs);
+        engine.run(closes);
+        for (const IoOp& op : syncs) {
+            if (op.result < 0 && error.empty()) error = "Failed to sync " + objects_dir.string() + ": " + strerror(static_cast<int>(-op.result));
+        }
+        if (!error.empty()) throw std::runtime_error(error);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& p : batch) pending_ids.erase(p.id);
+    }
+
+private:
+    struct PendingObject {
+        ObjectId id;
+        std::string tmp;          // empty while the object is only in memory
+        std::vector<char> data;   // compressed object, when tmp is empty
+    };
+
+    static const size_t BATCH_SIZE = 512;
+    // with io_uring, compressed objects up to this size wait in memory and are written by flush
+    static const size_t DEFERRED_WRITE_MAX = 64 * 1024;
+
+    std::filesystem::path objects_dir;
+    std::mutex mutex;
+    std::set<std::string> fanout_dirs;        // xx/ directories known to exist
+    std::vector<PendingObject> pending;       // written, waiting for sync + rename
+    std::set<ObjectId> pending_ids;
+    std::atomic<uint64_t> temp_counter{0};
+
+    bool exists(const ObjectId& id) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pending_ids.count(id)) return true;
+        }
+        return packed_object_exists(objects_dir, id) || access((objects_dir / id.loose_path()).c_str(), F_OK) == 0;
+    }
+
+    void ensure_fanout(const std::string& dir) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (fanout_dirs.count(dir)) return;
+        }
+        std::filesystem::create_directories(objects_dir / dir);
+        std::lock_guard<std::mutex> lock(mutex);
+        fanout_dirs.insert(dir);
+    }
+
+    // compresses a hashed in-memory object into a pending temp file unless it already exists
+    void store(const ObjectId& id, const std::string& header, const char* data, size_t size) {
+        if (exists(id)) {
+            objects_skipped++;
+            trace_count(Counter::ObjectsSkipped);
+            return;
+        }
+        // 1. One contiguous buffer, so the whole object is deflated in a single call
+        thread_local std::vector<char> object, compressed;
+        {
+            TraceSpan span("deflate");
+            object.assign(header.begin(), header.end());
+            object.insert(object.end(), data, data + size);
+            compress_buffer(object.data(), object.size(), choose_level(data, size), compressed);
+        }
+
+        // 2. Batched I/O: kept in memory until flush writes the whole batch
+        if (compressed.size() <= DEFERRED_WRITE_MAX && IoEngine::uring_enabled()) {
+            objects_written++;
+            trace_count(Counter::ObjectsWritten);
+            enqueue({id, std::string(), compressed});
+            return;
+        }
+
+        // 3. Otherwise into a pending temp file
+        TraceSpan span("object-write");
+        int fd;
+        std::string tmp = create_temp(fd);
+        try {
+            write_all(fd, compressed.data(), compressed.size(), tmp);
+        } catch (...) {
+            close(fd);
+            std::filesystem::remove(tmp);
+            throw;
+        }
+        commit(fd, tmp, id);
+    }
+
+    // temp file inside .git/objects so the final rename never crosses filesystems
+    std::string create_temp(int& fd) {
+        std::string tmp = (objects_dir / "tmp_obj_XXXXXX").string();
+        fd = mkstemp(tmp.data());
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create temp object in " + objects_dir.string() + ": " + strerror(errno));
+        }
+        return tmp;
+    }
+
+    void commit(int fd, const std::string& tmp, const ObjectId& id) {
+        // mkstemp creates 0600; give the object the usual 0644
+        fchmod(fd, 0644);
+        if (start_writeout(fd) != 0) {
+            std::string error = strerror(errno);
+            close(fd);
+            std::filesystem::remove(tmp);
+            throw std::runtime_error("Failed to sync " + tmp + ": " + error);
+        }
+        if (close(fd) != 0) {
+            std::filesystem::remove(tmp);
+            throw std::runtime_error("Failed to write " + tmp + ": " + strerror(errno));
+        }
+        objects_written++;
+        trace_count(Counter::ObjectsWritten);
+        enqueue({id, tmp, {}});
+    }
+
+    void enqueue(PendingObject&& object) {
+        bool full;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!pending_ids.insert(object.id).second) {
+                // another thread got there first with the same content
+                if (!object.tmp.empty()) std::filesystem::remove(object.tmp);
+                return;
+            }
+            pending.push_back(std::move(object));
+            full = pending.size() >= BATCH_SIZE;
+        }
+        if (full) flush();
+    }
+
+    // reads exactly size bytes after rewinding, hashing them (and deflating them into sink if given)
+    ObjectId hash_stream(std::ifstream& in, const std::string& header, uint64_t size,
+                            const std::filesystem::path& file, DeflateSink* sink) {
+        Sha1Stream sha;
+        sha.update(header);
+        std::vector<char> buf(BLOB_CHUNK_SIZE);
+        uint64_t total = 0;
+        while (in) {
+            in.read(buf.data(), buf.size());
+            size_t got = static_cast<size_t>(in.gcount());
+            if (got == 0) break;
+            total += got;
+            trace_count(Counter::BytesHashed, got);
+            sha.update(buf.data(), got);
+            if (sink) sink->feed(buf.data(), got);
+        }
+        if (total != size) {
+            throw std::runtime_error("File changed while hashing: " + file.string());
+        }
+        return sha.digest();
+    }
+};
+
+// process-wide writer for .git/objects
+ObjectWriter& object_writer() {
+    static ObjectWriter writer(".git/objects");
+    return writer;
+}
+
+// loose object reader
+// inflates objects in fixed-size chunks with one z_stream and one set of buffers reused from
+// object to object, so the output size never has to be guessed and nothing is re-allocated
+class LooseObjectReader {
+public:
+    explicit LooseObjectReader(std::filesystem::path dir = ".git/objects")
+        : objects_dir(std::move(dir)), in(BLOB_CHUNK_SIZE), out(BLOB_CHUNK_SIZE) {
+        memset(&zs, 0, sizeof(zs));
+        inflateInit(&zs);
+    }
+    ~LooseObjectReader() { inflateEnd(&zs); }
+    LooseObjectReader(const LooseObjectReader&) = delete;
+    LooseObjectReader& operator=(const LooseObjectReader&) = delete;
+
+    // on_header(type, size) is called once; when it returns true the content follows in chunks
+    // through on_data, otherwise the rest of the object is never inflated.
+    // returns false when the object does not exist, throws when it is corrupt
+    bool stream(const ObjectId& id,
+                const std::function<bool(const std::string&, size_t)>& on_header,
+                const std::function<void(const char*, size_t)>& on_data) {
+        // a preloaded object is inflated straight from memory, once
+        std::vector<char> buffered;
+        auto it = preloaded.find(id);
+        int fd = -1;
+        if (it != preloaded.end()) {
+            buffered.swap(it->second);
+            preloaded.erase(it);
+        } else {
+            fd = open((objects_dir / id.loose_path()).c_str(), O_RDONLY);
+            if (fd < 0) return false;
+        }
+        trace_count(Counter::InflateCalls);
+        bool fed = false;
+
+        try {
+            inflateReset(&zs);
+            zs.avail_in = 0;
+            std::string header;
+            bool header_done = false;
+            size_t size = 0, seen = 0;
+            int ret = Z_OK;
+
+            while (ret != Z_STREAM_END) {
+                // 1. Refill the input buffer from the file
+                if (zs.avail_in == 0 && fd < 0) {
+                    if (fed) throw std::runtime_error("Corrupt object " + id.hex() + ": truncated");
+                    zs.next_in = reinterpret_cast<Bytef*>(buffered.data());
+                    zs.avail_in = static_cast<uInt>(buffered.size());
+                    fed = true;
+                } else if (zs.avail_in == 0) {
+                    ssize_t n = ::read(fd, in.data(), in.size());
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) throw std::runtime_error("Corrupt object " + id.hex() + ": truncated");
+                    zs.next_in = reinterpret_cast<Bytef*>(in.data());
+                    zs.avail_in = static_cast<uInt>(n);
+                }
+
+                // 2. Inflate one output chunk
+                zs.next_out = reinterpret_cast<Bytef*>(out.data());
+                zs.avail_out = static_cast<uInt>(out.size());
+                ret = inflate(&zs, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    throw std::runtime_error("Corrupt object " + id.hex() + ": inflate failed");
+                }
+                const char* p = out.data();
+                size_t produced = out.size() - zs.avail_out;
+                trace_count(Counter::BytesInflated, produced);
+
+                // 3. The "<type> <size>\0" header comes first
+                if (!header_done) {
+                    const char* nul = static_cast<const char*>(memchr(p, '\0', produced));
+                    size_t take = nul ? static_cast<size_t>(nul - p) : produced;
+                    header.append(p, take);
+                    if (!nul) {
+                        if (header.size() > 64) throw std::runtime_error("Corrupt object " + id.hex() + ": bad header");
+                        continue;
+                    }
+                    size_t space = header.find(' ');
+                    if (space == std::string::npos) throw std::runtime_error("Corrupt object " + id.hex() + ": bad header");
+                    if (!parse_number(header.substr(space + 1), size)) {
+                        throw std::runtime_error("Corrupt object " + id.hex() + ": bad header");
+                    }
+                    header_done = true;
+                    if (!on_header(header.substr(0, space), size)) break;
+                    p += take + 1;
+                    produced -= take + 1;
+                }
+
+                // 4. Everything after it is content
+                if (produced > 0) {
+                    seen += produced;
+                    if (seen > size) throw std::runtime_error("Corrupt object " + id.hex() + ": size mismatch");
+                    on_data(p, produced);
+                }
+                if (ret == Z_STREAM_END && seen != size) {
+                    throw std::runtime_error("Corrupt object " + id.hex() + ": size mismatch");
+                }
+            }
+            // the stream ended before the header's NUL
+            if (!header_done) throw std::runtime_error("Corrupt object " + id.hex() + ": bad header");
+        } catch (...) {
+            if (fd >= 0) close(fd);
+            throw;
+        }
+        if (fd >= 0) close(fd);
+        return true;
+    }
+
+    // reads the loose files of ids in a few batched rounds (see read_small_files), so that the
+    // stream() calls which follow inflate from memory; drops whatever an earlier preload left
+    void preload(const std::vector<ObjectId>& ids) {
+        preloaded.clear();
+        std::vector<std::string> paths;
+        paths.reserve(ids.size());
+        for (const ObjectId& id : ids) paths.push_back((objects_dir / id.loose_path()).string());
+        std::vector<std::optional<std::vector<char>>> contents;
+        {
+            TraceSpan span("object-preload");
+            read_small_files(paths, PRELOAD_MAX, contents);
+        }
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (contents[i]) preloaded[ids[i]] = std::move(*contents[i]);
+        }
+    }
+
+    // whole object content; content keeps its capacity between calls
+    bool read(const ObjectId& id, std::string& type, std::vector<char>& content) {
+        content.clear();
+        return stream(id,
+                      [&](const std::string& t, size_t size) {
+                          type = t;
+                          content.reserve(size);
+                          return true;
+                      },
+                      [&](const char* data, size_t n) { content.insert(content.end(), data, data + n); });
+    }
+
+private:
+    // larger loose objects are streamed from their file as before
+    static const size_t PRELOAD_MAX = 1024 * 1024;
+
+    std::filesystem::path objects_dir;
+    z_stream zs;
+    std::vector<char> in;
+    std::vector<char> out;
+    std::unordered_map<ObjectId, std::vector<char>> preloaded;
+};
+
+// inflates one zlib stream starting at data, handing the output to on_data in chunks of out.size();
+// zlib stops at the end of the stream on its own, so avail may run past it.
+// returns the number of compressed bytes consumed
+size_t inflate_from_memory(z_stream& zs, const unsigned char* data, size_t avail, std::vector<char>& out,
+                           const std::function<void(const char*, size_t)>& on_data) {
+    trace_count(Counter::InflateCalls);
+    inflateReset(&zs);
+    zs.next_in = const_cast<Bytef*>(data);
+    zs.avail_in = static_cast<uInt>(std::min<size_t>(avail, UINT32_MAX));
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        zs.next_out = reinterpret_cast<Bytef*>(out.data());
+        zs.avail_out = static_cast<uInt>(out.size());
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            throw std::runtime_error("Corrupt pack data: inflate failed");
+        }
+        on_data(out.data(), out.size() - zs.avail_out);
+    }
+    trace_count(Counter::BytesInflated, zs.total_out);
+    return zs.total_in;
+}
+
+// read-only memory map of a whole file
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() {
+        if (data && size) munmap(const_cast<unsigned char*>(data), size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::filesystem::path& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) return false;
+        data = static_cast<const unsigned char*>(p);
+        size = static_cast<size_t>(st.st_size);
+        return true;
+    }
+
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+};
+
+// pack object types
+enum PackObjectType { OBJ_COMMIT = 1, OBJ_TREE = 2, OBJ_BLOB = 3, OBJ_TAG = 4, OBJ_OFS_DELTA = 6, OBJ_REF_DELTA = 7 };
+
+std::string pack_type_name(int type) {
+    switch (type) {
+        case OBJ_COMMIT: return "commit";
+        case OBJ_TREE: return "tree";
+        case OBJ_BLOB: return "blob";
+        case OBJ_TAG: return "tag";
+        default: throw std::runtime_error("Corrupt pack data: unknown object type " + std::to_string(type));
+    }
+}
+
+int pack_type_code(const std::string& name) {
+    if (name == "commit") return OBJ_COMMIT;
+    if (name == "tree") return OBJ_TREE;
+    if (name == "blob") return OBJ_BLOB;
+    if (name == "tag") return OBJ_TAG;
+    throw std::runtime_error("Unknown object type " + name);
+}
+
+// pack entry header: type and size, 4 bits in the first byte and 7 in each continuation byte
+void append_pack_entry_header(std::string& out, int type, uint64_t size) {
+    unsigned char byte = static_cast<unsigned char>((type << 4) | (size & 0x0F));
+    size >>= 4;
+    while (size) {
+        out.push_back(static_cast<char>(byte | 0x80));
+        byte = size & 0x7F;
+        size >>= 7;
+    }
+    out.push_back(static_cast<char>(byte));
+}
+
+// Parse the Variable Length Integer -> the object header
+// type lives in bits 4-6 of the first byte, the size starts in its low 4 bits and continues
+// 7 bits at a time while the MSB is set. returns the header length
+size_t parse_pack_object_header(const unsigned char* p, size_t avail, int& type, uint64_t& size) {
+    if (avail == 0) throw std::runtime_error("Corrupt pack data: truncated object header");
+    size_t i = 0;
+    uint8_t byte = p[i++];
+    type = (byte >> 4) & 0x07;
+    size = byte & 0x0F;
+    int shift = 4;
+    while (byte & 0x80) {
+        if (i >= avail || shift > 57) throw std::runtime_error("Corrupt pack data: bad object header");
+        byte = p[i++];
+        size |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        shift += 7;
+    }
+    return i;
+}
+
+// delta base cache
+// LRU of inflated (and already delta-resolved) objects keyed by pack offset, bounded by a byte
+// budget, so walking many objects that share a delta chain reconstructs each base only once
+class DeltaBaseCache {
+public:
+    struct Object {
+        int type;
+        std::shared_ptr<const std::vector<char>> data;
+    };
+
+    explicit DeltaBaseCache(size_t budget) : budget(budget) {}
+
+    bool get(uint64_t offset, Object& out) {
+        auto it = index.find(offset);
+        if (it == index.end()) return false;
+        lru.splice(lru.begin(), lru, it->second); // most recently used goes first
+        out = it->second->second;
+        return true;
+    }
+
+    void put(uint64_t offset, const Object& obj) {
+        size_t size = obj.data->size();
+        if (size > budget || index.count(offset)) return;
+        lru.emplace_front(offset, obj);
+        index[offset] = lru.begin();
+        used += size;
+        while (used > budget) {
+            used -= lru.back().second.data->size();
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+private:
+    size_t budget;
+    size_t used = 0;
+    std::list<std::pair<uint64_t, Object>> lru;
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, Object>>::iterator> index;
+};
+
+// byte budget for the delta base cache: $PROTO_GIT_DELTA_BASE_CACHE_MB, 96 MiB by default
+// (0 turns it off). a malformed value keeps the default; a huge one is capped instead of overflowing
+size_t delta_base_cache_limit() {
+    const char* env = std::getenv("PROTO_GIT_DELTA_BASE_CACHE_MB");
+    size_t mb = 96;
+    if (env && !parse_number(std::string(env), mb)) mb = 96;
+    return std::min(mb, SIZE_MAX >> 20) << 20;
+}
+
+// reads a delta size varint (7 bits per byte, little-endian, MSB = more)
+uint64_t read_delta_varint(const unsigned char*& p, const unsigned char* end) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (true) {
+        if (p >= end || shift > 63) throw std::runtime_error("Corrupt delta: bad size");
+        unsigned char byte = *p++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) return value;
+    }
+}
+
+// applies git's delta instructions to base: copy (MSB set: offset/size bytes selected by the low
+// 7 bits) or insert (the next n literal bytes)
+void apply_delta(const std::vector<char>& base, const std::vector<char>& delta, std::vector<char>& out) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(delta.data());
+    const unsigned char* end = p + delta.size();
+
+    if (read_delta_varint(p, end) != base.size()) throw std::runtime_error("Corrupt delta: base size mismatch");
+    uint64_t result_size = read_delta_varint(p, end);
+    out.clear();
+    out.reserve(result_size);
+
+    while (p < end) {
+        unsigned char op = *p++;
+        if (op & 0x80) {
+            uint64_t offset = 0, size = 0;
+            for (int i = 0; i < 4; i++) {
+                if (op & (1 << i)) {
+                    if (p >= end) throw std::runtime_error("Corrupt delta: truncated copy");
+                    offset |= static_cast<uint64_t>(*p++) << (8 * i);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                if (op & (0x10 << i)) {
+                    if (p >= end) throw std::runtime_error("Corrupt delta: truncated copy");
+                    size |= static_cast<uint64_t>(*p++) << (8 * i);
+                }
+            }
+            if (size == 0) size = 0x10000;
+            if (offset + size > base.size()) throw std::runtime_error("Corrupt delta: copy out of range");
+            out.insert(out.end(), base.begin() + offset, base.begin() + offset + size);
+        } else if (op != 0) {
+            if (static_cast<size_t>(end - p) < op) throw std::runtime_error("Corrupt delta: truncated insert");
+            out.insert(out.end(), p, p + op);
+            p += op;
+        } else {
+            throw std::runtime_error("Corrupt delta: reserved opcode");
+        }
+    }
+    if (out.size() != result_size) throw std::runtime_error("Corrupt delta: result size mismatch");
+}
+
+// raw pack data -> full objects, following OFS_DELTA/REF_DELTA chains down to their base and
+// applying the deltas back up, with every reconstructed base kept in the delta base cache.
+// REF_DELTA bases are located through find_ref, which returns false for an unknown id
+class PackResolver {
+public:
+    PackResolver(const unsigned char* data, size_t size,
+                 std::function<bool(const ObjectId&, uint64_t&)> find_ref)
+        : data(data), end(size - 20), find_ref(std::move(find_ref)),
+          cache(delta_base_cache_limit()), out(BLOB_CHUNK_SIZE) {
+        memset(&zs, 0, sizeof(zs));
+        inflateInit(&zs);
+    }
+    ~PackResolver() { inflateEnd(&zs); }
+    PackResolver(const PackResolver&) = delete;
+    PackResolver& operator=(const PackResolver&) = delete;
+
+    // one object entry: header, delta base reference (if any) and where the zlib data starts
+    struct Entry {
+        int type;
+        uint64_t size;
+        size_t data_offset;
+        uint64_t base_offset = 0;      // OFS_DELTA
+        ObjectId base_id;              // REF_DELTA
+    };
+
+    Entry parse_entry(uint64_t offset) const {
+        if (offset < 12 || offset >= end) throw std::runtime_error("Corrupt pack: offset out of range");
+        Entry e;
+        size_t pos = offset + parse_pack_object_header(data + offset, end - offset, e.type, e.size);
+        if (e.type == OBJ_OFS_DELTA) {
+            // big-endian base distance, each continuation byte adds an implicit +1
+            if (pos >= end) throw std::runtime_error("Corrupt pack: truncated delta offset");
+            unsigned char c = data[pos++];
+            uint64_t distance = c & 0x7F;
+            while (c & 0x80) {
+                if (pos >= end) throw std::runtime_error("Corrupt pack: truncated delta offset");
+                c = data[pos++];
+                distance = ((distance + 1) << 7) | (c & 0x7F);
+            }
+            if (distance == 0 || distance > offset) throw std::runtime_error("Corrupt pack: bad delta offset");
+            e.base_offset = offset - distance;
+        } else if (e.type == OBJ_REF_DELTA) {
+            if (pos + 20 > end) throw std::runtime_error("Corrupt pack: truncated delta base");
+            e.base_id = ObjectId::from_raw(data + pos);
+            pos += 20;
+        }
+        e.data_offset = pos;
+        return e;
+    }
+
+    // inflates the zlib data of an entry into out; returns the compressed length
+    size_t inflate_entry(const Entry& e, std::vector<char>& content) {
+        content.clear();
+        content.reserve(e.size);
+        size_t used = inflate_from_memory(zs, data + e.data_offset, end - e.data_offset, out,
+                                          [&](const char* d, size_t n) { content.insert(content.end(), d, d + n); });
+        if (content.size() != e.size) throw std::runtime_error("Corrupt pack: size mismatch");
+        return used;
+    }
+
+    // size of the object at offset without reconstructing it: for a delta, the result size that
+    // follows the base size at the start of the delta data, so only a few bytes get inflated
+    uint64_t object_size(uint64_t offset) {
+        Entry e = parse_entry(offset);
+        if (e.type != OBJ_OFS_DELTA && e.type != OBJ_REF_DELTA) return e.size;
+        unsigned char head[20]; // two varints of at most 10 bytes each
+        inflateReset(&zs);
+        zs.next_in = const_cast<Bytef*>(data + e.data_offset);
+        zs.avail_in = static_cast<uInt>(std::min<size_t>(end - e.data_offset, UINT32_MAX));
+        zs.next_out = head;
+        zs.avail_out = sizeof(head);
+        int ret = inflate(&zs, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            throw std::runtime_error("Corrupt pack data: inflate failed");
+        }
+        const unsigned char* p = head;
+        const unsigned char* stop = head + (sizeof(head) - zs.avail_out);
+        read_delta_varint(p, stop);
+        return read_delta_varint(p, stop);
+    }
+
+    // full object at offset; false when the chain needs a REF_DELTA base find_ref doesn't know
+    bool read_at(uint64_t offset, DeltaBaseCache::Object& result) {
+        // 1. Walk down the chain until a cached or non-delta object
+        std::vector<std::pair<uint64_t, Entry>> chain;
+        DeltaBaseCache::Object base;
+        uint64_t cur = offset;
+        while (!cache.get(cur, base)) {
+            Entry e = parse_entry(cur);
+            if (e.type == OBJ_OFS_DELTA) {
+                chain.emplace_back(cur, e);
+                cur = e.base_offset;
+            } else if (e.type == OBJ_REF_DELTA) {
+                chain.emplace_back(cur, e);
+                if (!find_ref(e.base_id, cur)) return false;
+            } else {
+                auto content = std::make_shared<std::vector<char>>();
+                inflate_entry(e, *content);
+                base = {e.type, content};
+                pack_type_name(e.type); // rejects unknown types
+                if (!chain.empty()) cache.put(cur, base);
+                break;
+            }
+            if (chain.size() > 10000) throw std::runtime_error("Corrupt pack: delta chain too deep");
+        }
+
+        // 2. Apply the deltas back up, keeping each intermediate result as a future base
+        std::vector<char> delta;
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            inflate_entry(it->second, delta);
+            auto content = std::make_shared<std::vector<char>>();
+            apply_delta(*base.data, delta, *content);
+            base = {base.type, content};
+            cache.put(it->first, base);
+        }
+        result = base;
+        return true;
+    }
+
+private:
+    const unsigned char* data;
+    size_t end; // start of the trailing checksum
+    std::function<bool(const ObjectId&, uint64_t&)> find_ref;
+    DeltaBaseCache cache;
+    z_stream zs;
+    std::vector<char> out;
+};
+
+// pack file with its v2 .idx, both memory mapped
+// an id is found by binary search inside its first-byte fanout bucket, so no scan of the pack
+class PackFile {
+public:
+    uint32_t object_count = 0;
+
+    bool open(const std::filesystem::path& pack_path) {
+        std::filesystem::path idx_path = pack_path;
+        idx_path.replace_extension(".idx");
+        if (!pack.open(pack_path) || !idx.open(idx_path)) return false;
+
+        // header: \377tOc, version 2, 256 cumulative fanout counts
+        static const unsigned char magic[4] = {0xff, 't', 'O', 'c'};
+        if (idx.size < 8 + 256 * 4 + 40 || memcmp(idx.data, magic, 4) != 0 || get_be32(idx.data + 4) != 2) {
+            return false;
+        }
+        fanout = idx.data + 8;
+        object_count = get_be32(fanout + 255 * 4);
+        ids = fanout + 256 * 4;
+        offsets32 = ids + size_t(object_count) * 20 + size_t(object_count) * 4;
+        offsets64 = offsets32 + size_t(object_count) * 4;
+        if (offsets64 + 40 > idx.data + idx.size) return false;
+        if (pack.size < 32 || memcmp(pack.data, "PACK", 4) != 0) return false;
+
+        resolver = std::make_unique<PackResolver>(pack.data, pack.size,
+            [this](const ObjectId& id, uint64_t& offset) { return find(id, offset); });
+        return true;
+    }
+
+    // pack offset of an id
+    bool find(const ObjectId& id, uint64_t& offset) const {
+        uint8_t first = id.bytes[0];
+        uint32_t lo = first == 0 ? 0 : get_be32(fanout + (first - 1) * 4);
+        uint32_t hi = get_be32(fanout + first * 4);
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(ids + size_t(mid) * 20, id.data(), 20);
+            if (cmp == 0) {
+                offset = offset_at(mid);
+                return true;
+            }
+            if (cmp < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return false;
+    }
+
+    // raw access for copying entries into another pack without inflating them: the entry header at
+    // an offset, the pack bytes, where the entry's compressed data ends and which id lives there
+    PackResolver::Entry entry(uint64_t offset) const { return resolver->parse_entry(offset); }
+    const unsigned char* bytes() const { return pack.data; }
+
+    uint64_t entry_end(uint64_t offset) {
+        auto it = std::upper_bound(reverse_index().begin(), reverse_index().end(), std::make_pair(offset, UINT32_MAX));
+        return it == reverse_index().end() ? pack.size - 20 : it->first;
+    }
+
+    bool id_at(uint64_t offset, ObjectId& id) {
+        auto it = std::lower_bound(reverse_index().begin(), reverse_index().end(), std::make_pair(offset, uint32_t(0)));
+        if (it == reverse_index().end() || it->first != offset) return false;
+        id = ObjectId::from_raw(ids + size_t(it->second) * 20);
+        return true;
+    }
+
+    // same contract as LooseObjectReader::stream, for the object at a pack offset
+    void stream(uint64_t offset,
+                const std::function<bool(const std::string&, size_t)>& on_header,
+                const std::function<void(const char*, size_t)>& on_data) {
+        DeltaBaseCache::Object obj;
+        if (!resolver->read_at(offset, obj)) {
+            throw std::runtime_error("Corrupt pack: delta base missing");
+        }
+        if (!on_header(pack_type_name(obj.type), obj.data->size())) return;
+        on_data(obj.data->data(), obj.data->size());
+    }
+
+    uint64_t object_size(uint64_t offset) { return resolver->object_size(offset); }
+
+private:
+    MappedFile pack;
+    MappedFile idx;
+    const unsigned char* fanout = nullptr;
+    const unsigned char* ids = nullptr;
+    const unsigned char* offsets32 = nullptr;
+    const unsigned char* offsets64 = nullptr;
+    std::unique_ptr<PackResolver> resolver;
+    std::vector<std::pair<uint64_t, uint32_t>> by_offset; // (offset, idx position), built on first use
+
+    uint64_t offset_at(uint32_t i) const {
+        uint32_t off = get_be32(offsets32 + size_t(i) * 4);
+        // MSB set: the low 31 bits index the table of 64-bit offsets
+        if (!(off & 0x80000000u)) return off;
+        const unsigned char* p = offsets64 + size_t(off & 0x7fffffffu) * 8;
+        return (uint64_t(get_be32(p)) << 32) | get_be32(p + 4);
+    }
+
+    const std::vector<std::pair<uint64_t, uint32_t>>& reverse_index() {
+        if (by_offset.empty() && object_count > 0) {
+            by_offset.reserve(object_count);
+            for (uint32_t i = 0; i < object_count; i++) by_offset.emplace_back(offset_at(i), i);
+            std::sort(by_offset.begin(), by_offset.end());
+        }
+        return by_offset;
+    }
+};
+
+// every pack under .git/objects/pack, opened on first use
+class PackSet {
+public:
+    explicit PackSet(std::filesystem::path dir = ".git/objects/pack") : pack_dir(std::move(dir)) {}
+
+    // same contract as LooseObjectReader::stream
+    bool stream(const ObjectId& id,
+                const std::function<bool(const std::string&, size_t)>& on_header,
+                const std::function<void(const char*, size_t)>& on_data) {
+        load();
+        for (auto& p : packs) {
+            uint64_t offset;
+            if (p->find(id, offset)) {
+                p->stream(offset, on_header, on_data);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool read(const ObjectId& id, std::string& type, std::vector<char>& content) {
+        content.clear();
+        return stream(id,
+                      [&](const std::string& t, size_t size) {
+                          type = t;
+                          content.reserve(size);
+                          return true;
+                      },
+                      [&](const char* data, size_t n) { content.insert(content.end(), data, data + n); });
+    }
+
+    bool contains(const ObjectId& id) {
+        uint64_t offset;
+        return locate(id, offset) != nullptr;
+    }
+
+    // the first pack holding id, and the offset there
+    PackFile* locate(const ObjectId& id, uint64_t& offset) {
+        load();
+        for (auto& p : packs) {
+            if (p->find(id, offset)) return p.get();
+        }
+        return nullptr;
+    }
+
+    // opens packs written since the first lookup (a lazy fetch adds one)
+    void rescan() {
+        loaded = false;
+        load();
+    }
+
+private:
+    std::filesystem::path pack_dir;
+    bool loaded = false;
+    std::vector<std::unique_ptr<PackFile>> packs;
+    std::set<std::filesystem::path> opened;
+
+    void load() {
+        if (loaded) return;
+        loaded = true;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(pack_dir, ec)) {
+            if (entry.path().extension() != ".pack" || opened.count(entry.path())) continue;
+            auto p = std::make_unique<PackFile>();
+            if (p->open(entry.path())) {
+                opened.insert(entry.path());
+                packs.push_back(std::move(p));
+            }
+        }
+    }
+};
+
+// the object writer's skip-existing check for packed objects: one PackSet per objects dir,
+// shared by the writer's threads
+bool packed_object_exists(const std::filesystem::path& objects_dir, const ObjectId& id) {
+    static std::mutex mutex;
+    static std::map<std::filesystem::path, std::unique_ptr<PackSet>> sets;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<PackSet>& packs = sets[objects_dir];
+    if (!packs) packs = std::make_unique<PackSet>(objects_dir / "pack");
+    return packs->contains(id);
+}
+
+// one object of a pack as recorded in its .idx
+struct PackIndexEntry {
+    ObjectId id;
+    uint32_t crc;
+    uint64_t offset;
+    bool resolved;
+};
+
+// id of an object from its type and full content
+ObjectId compute_object_id(int type, const std::vector<char>& content) {
+    Sha1Stream sha;
+    sha.update(pack_type_name(type) + " " + std::to_string(content.size()) + '\0');
+    sha.update(content.data(), content.size());
+    return sha.digest();
+}
+
+// resolves every delta entry of a complete, mapped pack in pack order through the base cache;
+// a REF_DELTA whose base is itself a not yet resolved delta waits for the next round. with
+// allow_missing, deltas whose base is not in the pack (a thin pack) are left unresolved and
+// counted instead of being an error
+size_t resolve_pack_deltas(const MappedFile& pack, std::vector<PackIndexEntry>& entries, bool allow_missing = false) {
+    std::unordered_map<ObjectId, uint64_t> known; // id -> offset, for REF_DELTA bases
+    size_t deltas = 0;
+    for (const auto& e : entries) {
+        if (e.resolved) known[e.id] = e.offset;
+        else deltas++;
+    }
+    if (deltas == 0) return 0;
+
+    PackResolver resolver(pack.data, pack.size, [&known](const ObjectId& id, uint64_t& offset) {
+        auto it = known.find(id);
+        if (it == known.end()) return false;
+        offset = it->second;
+        return true;
+    });
+
+    while (deltas > 0) {
+        size_t progress = 0;
+        for (auto& e : entries) {
+            if (e.resolved) continue;
+            DeltaBaseCache::Object obj;
+            if (!resolver.read_at(e.offset, obj)) continue;
+            e.id = compute_object_id(obj.type, *obj.data);
+            known[e.id] = e.offset;
+            e.resolved = true;
+            progress++;
+        }
+        if (progress == 0) {
+            if (allow_missing) return deltas;
+            throw std::runtime_error("index-pack: " + std::to_string(deltas) + " deltas with missing bases");
+        }
+        deltas -= progress;
+    }
+    return 0;
+}
+
+// parallel resolution of a complete, mapped pack (entries in pack order, none hashed yet)
+// every whole object is inflated and hashed as a task of its own; once an object's id is known the
+// deltas based on it, by offset or by id, become ready and are resolved against its content on the
+// pool as well. a base's content lives exactly as long as some child still needs it. returns
+// the deltas left unresolved, like resolve_pack_deltas
+size_t resolve_pack_parallel(const MappedFile& pack, std::vector<PackIndexEntry>& entries, ThreadPool& pool,
+                             bool allow_missing = false) {
+    // one resolver (z_stream + buffers) per worker
+    std::vector<std::unique_ptr<PackResolver>> resolvers;
+    for (size_t i = 0; i < pool.size(); i++) {
+        resolvers.push_back(std::make_unique<PackResolver>(pack.data, pack.size,
+            [](const ObjectId&, uint64_t&) { return false; }));
+    }
+
+    // 1. Dependency lists: deltas hang off their base, by pack offset or by id
+    std::vector<std::vector<uint32_t>> children(entries.size());
+    std::unordered_map<ObjectId, std::vector<uint32_t>> ref_children;
+    std::vector<uint32_t> roots;
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        PackResolver::Entry e = resolvers[0]->parse_entry(entries[i].offset);
+        if (e.type == OBJ_OFS_DELTA) {
+            auto it = std::lower_bound(entries.begin(), entries.end(), e.base_offset,
+                                       [](const PackIndexEntry& x, uint64_t off) { return x.offset < off; });
+            if (it == entries.end() || it->offset != e.base_offset) {
+                throw std::runtime_error("Corrupt pack: delta base is not an object");
+            }
+            children[it - entries.begin()].push_back(i);
+        } else if (e.type == OBJ_REF_DELTA) {
+            ref_children[e.base_id].push_back(i);
+        } else {
+            roots.push_back(i);
+        }
+    }
+
+    // 2. Resolve, counting tasks in flight so the end is known even if some bases never show up
+    std::mutex mutex;
+    std::condition_variable idle;
+    size_t in_flight = 0;
+    std::exception_ptr error;
+    std::function<void(uint32_t, DeltaBaseCache::Object)> resolve;
+
+    auto submit = [&](uint32_t i, DeltaBaseCache::Object base) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight++;
+        }
+        pool.submit([&resolve, i, base] { resolve(i, base); });
+    };
+
+    resolve = [&](uint32_t i, DeltaBaseCache::Object base) {
+        try {
+            PackResolver& r = *resolvers[ThreadPool::current_worker()];
+            PackResolver::Entry e = r.parse_entry(entries[i].offset);
+            DeltaBaseCache::Object obj;
+            auto content = std::make_shared<std::vector<char>>();
+            if (!base.data) {
+                r.inflate_entry(e, *content);
+                obj = {e.type, content};
+            } else {
+                std::vector<char> delta;
+                r.inflate_entry(e, delta);
+                apply_delta(*base.data, delta, *content);
+                obj = {base.type, content};
+                base = {}; // drop our hold on the parent as early as possible
+            }
+            entries[i].id = compute_object_id(obj.type, *content);
+            entries[i].resolved = true;
+
+            std::vector<uint32_t> ready = children[i];
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = ref_children.find(entries[i].id);
+                if (it != ref_children.end()) {
+                    ready.insert(ready.end(), it->second.begin(), it->second.end());
+                    ref_children.erase(it);
+                }
+            }
+            for (uint32_t child : ready) submit(child, obj);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--in_flight == 0) idle.notify_all();
+    };
+
+    for (uint32_t i : roots) submit(i, {});
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&] { return in_flight == 0; });
+    }
+    if (error) std::rethrow_exception(error);
+
+    size_t missing = std::count_if(entries.begin(), entries.end(), [](const PackIndexEntry& e) { return !e.resolved; });
+    if (missing && !allow_missing) {
+        throw std::runtime_error("index-pack: " + std::to_string(missing) + " deltas with missing bases");
+    }
+    return missing;
+}
+
+// lays out a v2 .idx (magic, version, fanout, ids, CRCs, offsets, pack + idx checksums)
+// and writes it atomically
+void write_pack_idx(std::vector<PackIndexEntry>& entries, const unsigned char* pack_checksum,
+                    const std::filesystem::path& idx_path) {
+    std::sort(entries.begin(), entries.end(),
+              [](const PackIndexEntry& a, const PackIndexEntry& b) { return a.id < b.id; });
+
+    std::string idx("\377tOc", 4);
+    put_be32(idx, 2);
+    uint32_t fan[256] = {0};
+    for (const auto& e : entries) fan[e.id.bytes[0]]++;
+    for (int b = 1; b < 256; b++) fan[b] += fan[b - 1];
+    for (int b = 0; b < 256; b++) put_be32(idx, fan[b]);
+    for (const auto& e : entries) idx.append(reinterpret_cast<const char*>(e.id.data()), 20);
+    for (const auto& e : entries) put_be32(idx, e.crc);
+    std::string large;
+    uint32_t large_count = 0;
+    for (const auto& e : entries) {
+        if (e.offset < 0x80000000u) {
+            put_be32(idx, static_cast<uint32_t>(e.offset));
+        } else {
+            put_be32(idx, 0x80000000u | large_count++);
+            put_be32(large, static_cast<uint32_t>(e.offset >> 32));
+            put_be32(large, static_cast<uint32_t>(e.offset));
+        }
+    }
+    idx += large;
+    idx.append(reinterpret_cast<const char*>(pack_checksum), 20);
+    unsigned char idx_checksum[20];
+    SHA1(reinterpret_cast<const unsigned char*>(idx.data()), idx.size(), idx_checksum);
+    idx.append(reinterpret_cast<const char*>(idx_checksum), 20);
+
+    std::filesystem::path tmp = idx_path.string() + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        f.write(idx.data(), idx.size());
+        if (!f) throw std::runtime_error("Failed to write " + tmp.string());
+    }
+    std::filesystem::rename(tmp, idx_path);
+}
+
+// streaming pack indexer
+// takes a pack as a byte stream in slices of any size (a file read in chunks, or data straight off
+// the network), optionally spooling it to disk. while the bytes go by it tracks every object's
+// offset and CRC32 and hashes whole objects through a streaming inflate, so nothing but the
+// current slice is held in memory. deltas need random access and are resolved in finish()
+class PackIndexer {
+public:
+    // with a spool_dir the pack is written there as it arrives and named pack-<checksum>.pack.
+    // with jobs > 1 the stream is only split into objects here; inflating, hashing and delta
+    // resolution then run on that many threads in finish()
+    explicit PackIndexer(std::filesystem::path spool_dir = {}, size_t jobs = 1)
+        : spool_dir(std::move(spool_dir)), jobs(jobs), out(BLOB_CHUNK_SIZE) {
+        memset(&zs, 0, sizeof(zs));
+        inflateInit(&zs);
+        if (!this->spool_dir.empty()) {
+            std::filesystem::create_directories(this->spool_dir);
+            spool_path = (this->spool_dir / "tmp_pack_XXXXXX").string();
+            spool_fd = mkstemp(spool_path.data());
+            if (spool_fd < 0) throw std::runtime_error("Failed to create " + spool_path + ": " + strerror(errno));
+        }
+    }
+    ~PackIndexer() {
+        inflateEnd(&zs);
+        if (spool_fd >= 0) {
+            close(spool_fd);
+            std::filesystem::remove(spool_path);
+        }
+    }
+    PackIndexer(const PackIndexer&) = delete;
+    PackIndexer& operator=(const PackIndexer&) = delete;
+
+    void feed(const unsigned char* data, size_t n) {
+        if (spool_fd >= 0) write_all(spool_fd, reinterpret_cast<const char*>(data), n, spool_path);
+
+        while (n > 0) {
+            switch (state) {
+            case State::PackHeader: {
+                size_t take = std::min(n, 12 - header.size());
+                header.append(reinterpret_cast<const char*>(data), take);
+                consume(data, n, take);
+                if (header.size() < 12) break;
+                const unsigned char* h = reinterpret_cast<const unsigned char*>(header.data());
+                if (memcmp(h, "PACK", 4) != 0) throw std::runtime_error("Not a pack file");
+                uint32_t version = get_be32(h + 4);
+                if (version != 2 && version != 3) {
+                    throw std::runtime_error("Unsupported pack version " + std::to_string(version));
+                }
+                remaining = get_be32(h + 8);
+                entries.reserve(remaining);
+                header.clear();
+                state = remaining ? State::ObjectHeader : State::Trailer;
+                break;
+            }
+            case State::ObjectHeader: {
+                // a byte at a time until the type/size varint and any delta base reference are complete
+                if (header.empty()) {
+                    object_offset = offset;
+                    object_crc = crc32(0L, Z_NULL, 0);
+                }
+                header.push_back(static_cast<char>(*data));
+                consume(data, n, 1);
+                if (header_complete()) start_object();
+                else if (header.size() > 64) throw std::runtime_error("Corrupt pack data: bad object header");
+                break;
+            }
+            case State::ObjectData: {
+                zs.next_in = const_cast<Bytef*>(data);
+                zs.avail_in = static_cast<uInt>(std::min<size_t>(n, UINT32_MAX));
+                uInt before = zs.avail_in;
+                int ret = Z_OK;
+                while (zs.avail_in > 0 && ret != Z_STREAM_END) {
+                    zs.next_out = reinterpret_cast<Bytef*>(out.data());
+                    zs.avail_out = static_cast<uInt>(out.size());
+                    ret = inflate(&zs, Z_NO_FLUSH);
+                    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                        throw std::runtime_error("Corrupt pack data: inflate failed");
+                    }
+                    size_t produced = out.size() - zs.avail_out;
+                    inflated += produced;
+                    if (object_sha) object_sha->update(out.data(), produced);
+                    if (ret == Z_BUF_ERROR && produced == 0) break;
+                }
+                consume(data, n, before - zs.avail_in);
+                if (ret == Z_STREAM_END) finish_object();
+                break;
+            }
+            case State::Trailer: {
+                size_t take = std::min(n, 20 - trailer.size());
+                trailer.append(reinterpret_cast<const char*>(data), take);
+                data += take;
+                n -= take;
+                if (trailer.size() == 20) state = State::Done;
+                break;
+            }
+            case State::Done:
+                throw std::runtime_error("Corrupt pack data: garbage after the trailer");
+            }
+        }
+    }
+
+    // thin packs: the full content of a delta base the pack refers to but doesn't hold, from the
+    // local object store. when set, finish() appends such bases to the pack as whole objects so it
+    // stands on its own, like git's index-pack --fix-thin
+    std::function<bool(const ObjectId&, int& type, std::vector<char>& content)> thin_base;
+
+    // verifies the trailer, resolves deltas and writes the .idx; returns the pack checksum.
+    // pack_path names an existing pack when not spooling
+    std::string finish(std::filesystem::path pack_path = {}) {
+        if (state != State::Done) throw std::runtime_error("Corrupt pack data: truncated");
+        ObjectId checksum;
+        EVP_DigestFinal_ex(pack_sha.get(), checksum.bytes.data(), nullptr);
+        if (memcmp(checksum.data(), trailer.data(), 20) != 0) throw std::runtime_error("Pack checksum mismatch");
+
+        bool spooling = spool_fd >= 0;
+        if (spooling) {
+            fsync(spool_fd);
+            close(spool_fd);
+            spool_fd = -1;
+            pack_path = spool_path;
+        }
+
+        try {
+            size_t unresolved;
+            {
+                MappedFile pack;
+                if (!pack.open(pack_path)) throw std::runtime_error("Failed to open pack: " + pack_path.string());
+                if (jobs > 1) {
+                    ThreadPool pool(jobs);
+                    unresolved = resolve_pack_parallel(pack, entries, pool, thin_base != nullptr);
+                } else {
+                    unresolved = resolve_pack_deltas(pack, entries, thin_base != nullptr);
+                }
+            }
+            if (unresolved) checksum = complete_thin_pack(pack_path);
+        } catch (...) {
+            if (spooling) std::filesystem::remove(spool_path);
+            throw;
+        }
+
+        std::string hex = checksum.hex();
+        if (spooling) {
+            pack_path = spool_dir / ("pack-" + hex + ".pack");
+            fchmod_path(spool_path);
+            std::filesystem::rename(spool_path, pack_path);
+        }
+
+        // the idx goes last: a pack only becomes visible to readers once its idx exists
+        std::filesystem::path idx_path = pack_path;
+        idx_path.replace_extension(".idx");
+        write_pack_idx(entries, checksum.data(), idx_path);
+        return hex;
+    }
+
+    size_t object_count() const { return entries.size(); }
+    size_t thin_bases_added() const { return appended; }
+
+private:
+    enum class State { PackHeader, ObjectHeader, ObjectData, Trailer, Done };
+
+    std::filesystem::path spool_dir;
+    size_t jobs;
+    std::string spool_path;
+    int spool_fd = -1;
+
+    State state = State::PackHeader;
+    std::string header;   // pack header, then the current object's header
+    std::string trailer;
+    uint64_t offset = 0;  // bytes of the pack seen so far
+    uint32_t remaining = 0;
+    std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX*)> pack_sha{new_sha1_ctx(), EVP_MD_CTX_free};
+
+    uint64_t object_offset = 0;
+    uLong object_crc = 0;
+    uint64_t object_size = 0;
+    uint64_t inflated = 0;
+    std::unique_ptr<Sha1Stream> object_sha; // only for whole objects
+    int object_type = 0;
+
+    z_stream zs;
+    std::vector<char> out;
+    std::vector<PackIndexEntry> entries;
+    size_t appended = 0; // bases added by complete_thin_pack
+
+    static EVP_MD_CTX* new_sha1_ctx() {
+        EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha1(), nullptr);
+        return ctx;
+    }
+
+    static void fchmod_path(const std::string& path) {
+        std::filesystem::permissions(path, std::filesystem::perms::owner_read | std::filesystem::perms::group_read |
+                                           std::filesystem::perms::others_read);
+    }
+
+    // appends the REF_DELTA bases the pack lacks, then rewrites the object count and the trailer
+    // and resolves the remaining deltas. returns the new checksum
+    ObjectId complete_thin_pack(const std::filesystem::path& pack_path) {
+        TraceSpan span("complete-thin-pack");
+        // 1. Bases referred to by id that no resolved entry has
+        std::vector<ObjectId> bases;
+        uint64_t end;
+        {
+            MappedFile pack;
+            if (!pack.open(pack_path)) throw std::runtime_error("Failed to open pack: " + pack_path.string());
+            end = pack.size - 20;
+            std::unordered_set<ObjectId> present, wanted;
+            for (const auto& e : entries) {
+                if (e.resolved) present.insert(e.id);
+            }
+            for (const auto& e : entries) {
+                if (e.resolved) continue;
+                int type;
+                uint64_t size;
+                size_t n = parse_pack_object_header(pack.data + e.offset, end - e.offset, type, size);
+                if (type != OBJ_REF_DELTA) continue;
+                ObjectId base = ObjectId::from_raw(pack.data + e.offset + n);
+                if (!present.count(base) && wanted.insert(base).second) bases.push_back(base);
+            }
+        }
+
+        // 2. Each as a whole object where the trailer was
+        size_t appended_from = entries.size();
+        std::string tail;
+        std::vector<char> content, compressed;
+        for (const ObjectId& base : bases) {
+            int type;
+            if (!thin_base(base, type, content)) continue; // maybe in the pack behind another missing base
+            std::string entry;
+            append_pack_entry_header(entry, type, content.size());
+            compress_buffer(content.data(), content.size(), choose_level(content.data(), content.size()), compressed);
+            entry.append(compressed.data(), compressed.size());
+            PackIndexEntry e;
+            e.id = base;
+            e.offset = end + tail.size();
+            e.crc = static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef*>(entry.data()), static_cast<uInt>(entry.size())));
+            e.resolved = true;
+            entries.push_back(e);
+            tail += entry;
+        }
+        appended = entries.size() - appended_from;
+
+        int fd = open(pack_path.c_str(), O_RDWR);
+        if (fd < 0) throw std::runtime_error("Failed to open " + pack_path.string() + ": " + strerror(errno));
+        std::string count;
+        put_be32(count, static_cast<uint32_t>(entries.size()));
+        bool ok = ftruncate(fd, static_cast<off_t>(end)) == 0 &&
+                  pwrite(fd, tail.data(), tail.size(), static_cast<off_t>(end)) == static_cast<ssize_t>(tail.size()) &&
+                  pwrite(fd, count.data(), 4, 8) == 4;
+        ObjectId checksum;
+        if (ok) {
+            MappedFile pack;
+            ok = pack.open(pack_path);
+            if (ok) {
+                Sha1Stream sha;
+                sha.update(pack.data, pack.size);
+                checksum = sha.digest();
+                ok = pwrite(fd, checksum.data(), 20, static_cast<off_t>(pack.size)) == 20 && fsync(fd) == 0;
+            }
+        }
+        close(fd);
+        if (!ok) throw std::runtime_error("Failed to complete thin pack " + pack_path.string());
+
+        // 3. Everything that was waiting for them
+        MappedFile pack;
+        if (!pack.open(pack_path)) throw std::runtime_error("Failed to open pack: " + pack_path.string());
+        resolve_pack_deltas(pack, entries);
+        return checksum;
+    }
+
+    // k bytes of object/pack data taken from the front of the slice
+    void consume(const unsigned char*& data, size_t& n, size_t k) {
+        EVP_DigestUpdate(pack_sha.get(), data, k);
+        if (state == State::ObjectHeader || state == State::ObjectData) {
+            object_crc = crc32(object_crc, data, static_cast<uInt>(k));
+        }
+        data += k;
+        n -= k;
+        offset += k;
+    }
+
+    bool header_complete() const {
+        const unsigned char* h = reinterpret_cast<const unsigned char*>(header.data());
+        size_t i = 0;
+        while (h[i] & 0x80) {
+            if (++i >= header.size()) return false;
+        }
+        size_t len = i + 1;
+        int type = (h[0] >> 4) & 0x07;
+        if (type == OBJ_OFS_DELTA) {
+            size_t j = len;
+            while (true) {
+                if (j >= header.size()) return false;
+                if (!(h[j] & 0x80)) break;
+                j++;
+            }
+        } else if (type == OBJ_REF_DELTA) {
+            return header.size() >= len + 20;
+        }
+        return true;
+    }
+
+    void start_object() {
+        parse_pack_object_header(reinterpret_cast<const unsigned char*>(header.data()), header.size(),
+                                 object_type, object_size);
+        inflated = 0;
+        object_sha.reset();
+        if (jobs <= 1 && object_type != OBJ_OFS_DELTA && object_type != OBJ_REF_DELTA) {
+            object_sha = std::make_unique<Sha1Stream>();
+            object_sha->update(pack_type_name(object_type) + " " + std::to_string(object_size) + '\0');
+        }
+        inflateReset(&zs);
+        header.clear();
+        state = State::ObjectData;
+    }
+
+    void finish_object() {
+        if (inflated != object_size) throw std::runtime_error("Corrupt pack data: size mismatch");
+        PackIndexEntry e;
+        e.offset = object_offset;
+        e.crc = static_cast<uint32_t>(object_crc);
+        e.resolved = object_sha != nullptr;
+        if (e.resolved) e.id = object_sha->digest();
+        entries.push_back(e);
+        state = --remaining ? State::ObjectHeader : State::Trailer;
+    }
+};
+
+// index-pack: builds the v2 .idx for a pack file next to it and returns the pack checksum
+std::string index_pack(const std::filesystem::path& pack_path, size_t jobs = 1) {
+    TraceSpan span("index-pack");
+    std::ifstream in(pack_path, std::ios::binary);
+    if (!in.is_open()) throw std::runtime_error("Failed to open pack: " + pack_path.string());
+
+    PackIndexer indexer({}, jobs);
+    std::vector<char> buf(1024 * 1024);
+    while (in) {
+        in.read(buf.data(), buf.size());
+        if (in.gcount() > 0) {
+            indexer.feed(reinterpret_cast<const unsigned char*>(buf.data()), static_cast<size_t>(in.gcount()));
+        }
+    }
+    return indexer.finish(pack_path);
+}
+
+// Hashing -> compressing -> storing function
+ObjectId store_git_object(const std::string& content, const std::string& type) {
+    return object_writer().write(type, content.data(), content.size());
+}
+
+// git's tree order: names compare bytewise, a subtree's name as if followed by '/'
+int compare_tree_entries(std::string_view a, bool a_tree, std::string_view b, bool b_tree) {
+    size_t n = std::min(a.size(), b.size());
+    if (int c = memcmp(a.data(), b.data(), n)) return c;
+    unsigned char ca = n < a.size() ? a[n] : a_tree ? '/' : '\0';
+    unsigned char cb = n < b.size() ? b[n] : b_tree ? '/' : '\0';
+    return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+// tree struct
+struct TreeEntry {
+    std::string mode;
+    std::string name;
+    ObjectId id;
+    // comparator for sorting, in git's tree order so "a.txt" comes before the directory "a"
+    bool operator<(const TreeEntry& other) const {
+        return compare_tree_entries(name, mode == "40000", other.name, other.mode == "40000") < 0;
+    }
+};
+
+// tree view
+// iterates the "<mode> <name>\0<20-byte id>" entries of an inflated tree in place: mode and name
+// are views into the buffer and the id is read from its raw bytes, so a walk allocates nothing.
+// every entry is bounds-checked before it is handed out; a malformed one throws
+class TreeView {
+public:
+    struct Entry {
+        std::string_view mode;
+        std::string_view name;
+        const uint8_t* raw_id = nullptr;
+
+        ObjectId id() const { return ObjectId::from_raw(raw_id); }
+        bool is_tree() const { return mode == "40000"; }
+        bool is_gitlink() const { return mode == "160000"; }
+        // type of the object the entry points at
+        const char* type() const { return is_tree() ? "tree" : is_gitlink() ? "commit" : "blob"; }
+    };
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Entry;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Entry*;
+        using reference = const Entry&;
+
+        const Entry& operator*() const { return entry; }
+        const Entry* operator->() const { return &entry; }
+        iterator& operator++() {
+            p = next;
+            parse();
+            return *this;
+        }
+        bool operator==(const iterator& other) const { return p == other.p; }
+        bool operator!=(const iterator& other) const { return p != other.p; }
+
+    private:
+        friend class TreeView;
+        const TreeView* view;
+        const char* p;
+        const char* next = nullptr;
+        Entry entry;
+
+        iterator(const TreeView* view, const char* p) : view(view), p(p) { parse(); }
+
+        void parse() {
+            const char* end = view->end_;
+            if (p == end) return;
+            const char* space = static_cast<const char*>(memchr(p, ' ', end - p));
+            if (!space || space == p) view->corrupt(p);
+            const char* nul = static_cast<const char*>(memchr(space + 1, '\0', end - space - 1));
+            if (!nul || static_cast<size_t>(end - nul - 1) < ObjectId::RAW_SIZE) view->corrupt(p);
+            entry.mode = std::string_view(p, space - p);
+            entry.name = std::string_view(space + 1, nul - space - 1);
+            entry.raw_id = reinterpret_cast<const uint8_t*>(nul + 1);
+            next = nul + 1 + ObjectId::RAW_SIZE;
+        }
+    };
+
+    TreeView(const char* data, size_t size, const ObjectId& id = ObjectId()) : begin_(data), end_(data + size), id(id) {}
+    explicit TreeView(const std::vector<char>& data, const ObjectId& id = ObjectId())
+        : TreeView(data.data(), data.size(), id) {}
+
+    iterator begin() const { return iterator(this, begin_); }
+    iterator end() const { return iterator(this, end_); }
+
+private:
+    const char* begin_;
+    const char* end_;
+    ObjectId id; // for error messages
+
+    [[noreturn]] void corrupt(const char* at) const {
+        throw std::runtime_error("Corrupt tree " + id.hex() + " at offset " + std::to_string(at - begin_));
+    }
+};
+
+// function to hash a file as blob and return its id
+ObjectId hash_file_as_blob(const std::filesystem::path& filePath) {
+    return object_writer().write_file(filePath);
+}
+
+// several files as blobs, ids in the same order; small files are read up front and hashed as
+// batches, larger ones are streamed one at a time. with io_uring each batch is read with
+// read_small_files (a stat, open, read and close round for all of it); a file that round could
+// not read whole takes the streaming path, which reports why; so does a file whose size changed
+// since it was taken. sizes, when the caller has just stat'ed the files, saves stat'ing them again
+std::vector<ObjectId> hash_files_as_blobs(const std::vector<std::filesystem::path>& files, const std::vector<uint64_t>* sizes = nullptr) {
+    const size_t BATCH = 64;
+    std::vector<ObjectId> ids(files.size());
+    std::vector<size_t> small;
+    std::vector<std::vector<char>> contents;
+
+    auto flush_small = [&]() {
+        std::vector<std::pair<const char*, size_t>> objects;
+        for (const auto& c : contents) objects.emplace_back(c.data(), c.size());
+        std::vector<ObjectId> batch = object_writer().write_batch("blob", objects);
+        for (size_t i = 0; i < small.size(); i++) ids[small[i]] = batch[i];
+        small.clear();
+        contents.clear();
+    };
+
+    if (IoEngine::uring_enabled()) {
+        std::vector<std::string> paths;
+        std::vector<uint64_t> batch_sizes;
+        std::vector<std::optional<std::vector<char>>> read;
+        for (size_t begin = 0; begin < files.size(); begin += BATCH) {
+            size_t end = std::min(begin + BATCH, files.size());
+            paths.clear();
+            for (size_t i = begin; i < end; i++) paths.push_back(files[i].string());
+            if (sizes) batch_sizes.assign(sizes->begin() + begin, sizes->begin() + end);
+            {
+                TraceSpan span("read");
+                read_small_files(paths, BLOB_CHUNK_SIZE, read, sizes ? &batch_sizes : nullptr);
+            }
+            for (size_t i = begin; i < end; i++) {
+                if (!read[i - begin]) {
+                    ids[i] = hash_file_as_blob(files[i]);
+                    continue;
+                }
+                small.push_back(i);
+                contents.push_back(std::move(*read[i - begin]));
+            }
+            if (!small.empty()) flush_small();
+        }
+        return ids;
+    }
+
+    for (size_t i = 0; i < files.size(); i++) {
+        uint64_t size = sizes ? (*sizes)[i] : std::filesystem::file_size(files[i]);
+        if (size > BLOB_CHUNK_SIZE) {
+            ids[i] = hash_file_as_blob(files[i]);
+            continue;
+        }
+        std::ifstream in(files[i], std::ios::binary);
+        if (!in.is_open()) throw std::runtime_error("Failed to open file: " + files[i].string());
+        std::vector<char> content(size);
+        in.read(content.data(), size);
+        if (static_cast<uint64_t>(in.gcount()) != size || in.peek() != std::ifstream::traits_type::eof()) {
+            // it changed since its size was taken: the streaming path reads it afresh
+            ids[i] = hash_file_as_blob(files[i]);
+            continue;
+        }
+        small.push_back(i);
+        contents.push_back(std::move(content));
+        if (small.size() == BATCH) flush_small();
+    }
+    if (!small.empty()) flush_small();
+    return ids;
+}
+
+// sort tree entries, build the tree object and store it; returns its id
+ObjectId write_tree_object(std::vector<TreeEntry>& entries) {
+    // 1. Sort entries in git's tree order
+    std::sort(entries.begin(), entries.end());
+
+    // 2. Construct the binary buffer
+    std::vector<char> tree_content;
+    for (const auto& e : entries) {
+        std::string line = e.mode + " " + e.name + '\0';
+        tree_content.insert(tree_content.end(), line.begin(), line.end());
+        tree_content.insert(tree_content.end(), e.id.bytes.begin(), e.id.bytes.end());
+    }
+
+    // 3. Hash, compress and store through the shared object writer
+    return object_writer().write("tree", tree_content.data(), tree_content.size());
+}
+
+// stat-cache index (.git/index)
+// same layout as git's index v2: a "DIRC" header, one entry per file with its stat data and
+// blob id, a TREE extension with the cached subtree ids, and a trailing SHA-1 of everything above
+struct IndexEntry {
+    std::string path; // relative to the work tree, '/' separated
+    uint32_t ctime_sec = 0, ctime_nsec = 0;
+    uint32_t mtime_sec = 0, mtime_nsec = 0;
+    uint32_t dev = 0, ino = 0, mode = 0, uid = 0, gid = 0, size = 0;
+    ObjectId sha; // blob id
+};
+
+struct CachedTree {
+    int entry_count = 0;   // files anywhere below this directory
+    int subtree_count = 0; // direct sub-directories
+    ObjectId sha;          // tree id
+};
+
+class Index {
+public:
+    std::map<std::string, IndexEntry> entries; // by path, which is also git's on-disk order
+    std::map<std::string, CachedTree> trees;   // by directory path, "" is the root
+    // mtime of the index file when it was loaded; files modified at or after it are "racy"
+    // (they may have changed again within the same timestamp tick) and never trusted
+    int64_t timestamp_ns = 0;
+    // trailing SHA-1 of the file as last loaded or saved; identifies this exact index
+    ObjectId checksum;
+
+    // returns false (and stays empty) when the file is missing or corrupt
+    bool load(const std::filesystem::path& file) {
+        TraceSpan span("index-load");
+        entries.clear();
+        trees.clear();
+
+        std::ifstream in(file, std::ios::binary);
+        if (!in.is_open()) return false;
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0) return false;
+        timestamp_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+        if (!parse(data)) {
+            entries.clear();
+            trees.clear();
+            std::cerr << "warning: ignoring corrupt index " << file.string() << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    // written to <file>.lock first and renamed over, so readers never see a torn index
+    void save(const std::filesystem::path& file) {
+        TraceSpan span("index-save");
+        std::string out = "DIRC";
+        put_be32(out, 2);
+        put_be32(out, static_cast<uint32_t>(entries.size()));
+
+        for (const auto& [path, e] : entries) {
+            size_t start = out.size();
+            for (uint32_t v : {e.ctime_sec, e.ctime_nsec, e.mtime_sec, e.mtime_nsec,
+                               e.dev, e.ino, e.mode, e.uid, e.gid, e.size}) {
+                put_be32(out, v);
+            }
+            out.append(reinterpret_cast<const char*>(e.sha.data()), ObjectId::RAW_SIZE);
+            uint16_t flags = static_cast<uint16_t>(std::min<size_t>(path.size(), 0xFFF));
+            out.push_back(static_cast<char>(flags >> 8));
+            out.push_back(static_cast<char>(flags));
+            out += path;
+            // NUL terminated and padded to a multiple of 8 bytes
+            size_t len = out.size() - start;
+            out.append(8 - (len % 8), '\0');
+        }
+
+        if (!trees.empty()) {
+            std::string ext;
+            write_tree_extension(ext, "");
+            out += "TREE";
+            put_be32(out, static_cast<uint32_t>(ext.size()));
+            out += ext;
+        }
+
+        SHA1(reinterpret_cast<const unsigned char*>(out.data()), out.size(), checksum.bytes.data());
+        out.append(reinterpret_cast<const char*>(checksum.data()), ObjectId::RAW_SIZE);
+
+        std::filesystem::path lock = file.string() + ".lock";
+        {
+            std::ofstream f(lock, std::ios::binary | std::ios::trunc);
+            if (!f.is_open()) throw std::runtime_error("Failed to write " + lock.string());
+            f.write(out.data(), out.size());
+            if (!f) throw std::runtime_error("Failed to write " + lock.string());
+        }
+        std::filesystem::rename(lock, file);
+    }
+
+private:
+    static std::string child_path(const std::string& dir, const std::string& name) {
+        return dir.empty() ? name : dir + "/" + name;
+    }
+
+    // pre-order: "<name>\0<entry_count> <subtree_count>\n<20-byte id>" then the children
+    void write_tree_extension(std::string& out, const std::string& dir) const {
+        auto it = trees.find(dir);
+        if (it == trees.end()) return;
+
+        std::vector<std::string> children;
+        std::string prefix = dir.empty() ? "" : dir + "/";
+        for (auto c = trees.lower_bound(prefix); c != trees.end(); ++c) {
+            const std::string& p = c->first;
+            if (p.compare(0, prefix.size(), prefix) != 0) break;
+            if (p.size() > prefix.size() && p.find('/', prefix.size()) == std::string::npos) {
+                children.push_back(p);
+            }
+        }
+
+        std::string name = dir.substr(dir.find_last_of('/') == std::string::npos ? 0 : dir.find_last_of('/') + 1);
+        out += name;
+        out.push_back('\0');
+        out += std::to_string(it->second.entry_count) + " " + std::to_string(children.size()) + "\n";
+        out.append(reinterpret_cast<const char*>(it->second.sha.data()), ObjectId::RAW_SIZE);
+
+        for (const auto& c : children) write_tree_extension(out, c);
+    }
+
+    bool parse(const std::string& data) {
+        const unsigned char* base = reinterpret_cast<const unsigned char*>(data.data());
+        if (data.size() < 12 + 20 || data.compare(0, 4, "DIRC") != 0 || get_be32(base + 4) != 2) return false;
+
+        size_t body = data.size() - 20;
+        unsigned char checksum[20];
+        SHA1(base, body, checksum);
+        if (memcmp(checksum, base + body, 20) != 0) return false;
+        this->checksum = ObjectId::from_raw(checksum);
+
+        uint32_t count = get_be32(base + 8);
+        size_t pos = 12;
+        for (uint32_t i = 0; i < count; i++) {
+            if (pos + 62 > body) return false;
+            IndexEntry e;
+            uint32_t* fields[] = {&e.ctime_sec, &e.ctime_nsec, &e.mtime_sec, &e.mtime_nsec,
+                                  &e.dev, &e.ino, &e.mode, &e.uid, &e.gid, &e.size};
+            for (int f = 0; f < 10; f++) *fields[f] = get_be32(base + pos + 4 * f);
+            e.sha = ObjectId::from_raw(base + pos + 40);
+            size_t name_start = pos + 62;
+            size_t name_end = data.find('\0', name_start);
+            if (name_end == std::string::npos || name_end >= body) return false;
+            e.path = data.substr(name_start, name_end - name_start);
+            size_t len = name_end - pos;
+            pos += len + (8 - (len % 8));
+            entries[e.path] = e;
+        }
+
+        // extensions: 4-byte signature + 4-byte size; unknown ones are skipped
+        while (pos + 8 <= body) {
+            std::string sig = data.substr(pos, 4);
+            size_t size = get_be32(base + pos + 4);
+            pos += 8;
+            if (pos + size > body) return false;
+            if (sig == "TREE") {
+                size_t p = pos;
+                if (!parse_tree_extension(data, p, pos + size, "", true)) return false;
+            }
+            pos += size;
+        }
+        return pos == body;
+    }
+
+    bool parse_tree_extension(const std::string& data, size_t& p, size_t end, const std::string& parent, bool root) {
+        size_t nul = data.find('\0', p);
+        if (nul == std::string::npos || nul >= end) return false;
+        std::string name = data.substr(p, nul - p);
+        size_t nl = data.find('\n', nul);
+        if (nl == std::string::npos || nl >= end) return false;
+
+        CachedTree t;
+        std::istringstream counts(data.substr(nul + 1, nl - nul - 1));
+        if (!(counts >> t.entry_count >> t.subtree_count)) return false;
+        p = nl + 1;
+
+        std::string path = root ? "" : child_path(parent, name);
+        // a negative entry count marks an invalidated tree without an id
+        if (t.entry_count >= 0) {
+            if (p + 20 > end) return false;
+            t.sha = ObjectId::from_raw(data.data() + p);
+            p += 20;
+            trees[path] = t;
+        }
+        for (int i = 0; i < t.subtree_count; i++) {
+            if (!parse_tree_extension(data, p, end, path, false)) return false;
+        }
+        return true;
+    }
+};
+
+// write-tree state backed by the index: the one read from disk and the one being rebuilt
+struct StatCache {
+    std::filesystem::path root;
+    Index old_index;
+    Index new_index;
+    std::mutex mutex; // guards new_index when write-tree runs in parallel
+
+    // with an fsmonitor answer, only directories in dirty (the ones it saw change, and their
+    // ancestors) are walked; everything else keeps what the old index recorded
+    bool monitored = false;
+    std::set<std::string> dirty;
+
+    explicit StatCache(const std::filesystem::path& work_tree) : root(work_tree) {}
+
+    void mark_dirty(std::string dir) {
+        while (dirty.insert(dir).second && !dir.empty()) {
+            size_t slash = dir.rfind('/');
+            dir = slash == std::string::npos ? "" : dir.substr(0, slash);
+        }
+    }
+
+    // copies a directory the fsmonitor saw no change under, with every file and subtree below it,
+    // from the old index into the new one; false when it has to be walked
+    bool reuse_tree(const std::string& rel, ObjectId& sha) {
+        if (!monitored || dirty.count(rel)) return false;
+        auto tree = old_index.trees.find(rel);
+        if (tree == old_index.trees.end()) return false;
+
+        std::string prefix = rel.empty() ? "" : rel + "/";
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto e = old_index.entries.lower_bound(prefix);
+             e != old_index.entries.end() && e->first.compare(0, prefix.size(), prefix) == 0; ++e) {
+            new_index.entries.insert(*e);
+        }
+        new_index.trees.insert(*tree);
+        for (auto t = old_index.trees.lower_bound(prefix);
+             t != old_index.trees.end() && t->first.compare(0, prefix.size(), prefix) == 0; ++t) {
+            new_index.trees.insert(*t);
+        }
+        sha = tree->second.sha;
+        trace_count(Counter::DirsReused);
+        return true;
+    }
+
+    std::string relative(const std::filesystem::path& p) const {
+        std::string rel = p.lexically_relative(root).generic_string();
+        return rel == "." ? "" : rel;
+    }
+
+    // blob id for a file; the content is only read when its stat data differs from the index.
+    // same is set when the id matches what the old index recorded for this path
+    ObjectId hash_file(const std::filesystem::path& p, bool& same) {
+        struct stat st;
+        {
+            TraceSpan span("stat");
+            trace_count(Counter::FilesStatted);
+            if (stat(p.c_str(), &st) != 0) {
+                throw std::runtime_error("Failed to stat file: " + p.string());
+            }
+        }
+        IndexEntry e;
+        if (!stat_entry(p, st, e)) {
+            trace_count(Counter::FilesRehashed);
+            e.sha = hash_file_as_blob(p);
+        }
+        return record(std::move(e), same);
+    }
+
+    // hash_file for several files: one statx batch through the I/O engine, then the files whose
+    // stat data changed are read and hashed together (hash_files_as_blobs). same[i] as for hash_file
+    std::vector<ObjectId> hash_files(const std::vector<std::filesystem::path>& paths, std::vector<bool>& same) {
+        // 1. Stat them all
+        std::vector<std::string> names;
+        names.reserve(paths.size());
+        for (const auto& p : paths) names.push_back(p.string());
+        std::vector<struct statx> stats(paths.size());
+        std::vector<IoOp> ops(paths.size(), IoOp{IoOp::Stat});
+        for (size_t i = 0; i < paths.size(); i++) {
+            ops[i].path = names[i].c_str();
+            ops[i].stx = &stats[i];
+        }
+        {
+            TraceSpan span("stat");
+            trace_count(Counter::FilesStatted, paths.size());
+            IoEngine::get().run(ops);
+        }
+
+        // 2. Compare with the old index
+        std::vector<IndexEntry> entries(paths.size());
+        std::vector<size_t> changed;
+        std::vector<std::filesystem::path> changed_paths;
+        std::vector<uint64_t> changed_sizes;
+        for (size_t i = 0; i < paths.size(); i++) {
+            if (ops[i].result < 0) throw std::runtime_error("Failed to stat file: " + names[i]);
+            const struct statx& sx = stats[i];
+            struct stat st{};
+            st.st_ctim.tv_sec = sx.stx_ctime.tv_sec;
+            st.st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+            st.st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+            st.st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+            st.st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+            st.st_ino = sx.stx_ino;
+            st.st_uid = sx.stx_uid;
+            st.st_gid = sx.stx_gid;
+            st.st_size = static_cast<off_t>(sx.stx_size);
+            if (!stat_entry(paths[i], st, entries[i])) {
+                changed.push_back(i);
+                changed_paths.push_back(paths[i]);
+                changed_sizes.push_back(sx.stx_size);
+            }
+        }
+
+        // 3. Rehash what changed, as a batch
+        trace_count(Counter::FilesRehashed, changed.size());
+        std::vector<ObjectId> rehashed = hash_files_as_blobs(changed_paths, &changed_sizes);
+        for (size_t k = 0; k < changed.size(); k++) entries[changed[k]].sha = rehashed[k];
+
+        std::vector<ObjectId> ids(paths.size());
+        same.assign(paths.size(), false);
+        for (size_t i = 0; i < paths.size(); i++) {
+            bool s = false;
+            ids[i] = record(std::move(entries[i]), s);
+            same[i] = s;
+        }
+        return ids;
+    }
+
+    // fills e from the stat data; true (with e.sha set) when the old index's id still holds
+    bool stat_entry(const std::filesystem::path& p, const struct stat& st, IndexEntry& e) {
+        e.path = relative(p);
+        e.ctime_sec = static_cast<uint32_t>(st.st_ctim.tv_sec);
+        e.ctime_nsec = static_cast<uint32_t>(st.st_ctim.tv_nsec);
+        e.mtime_sec = static_cast<uint32_t>(st.st_mtim.tv_sec);
+        e.mtime_nsec = static_cast<uint32_t>(st.st_mtim.tv_nsec);
+        e.dev = static_cast<uint32_t>(st.st_dev);
+        e.ino = static_cast<uint32_t>(st.st_ino);
+        e.mode = 0100644; // write-tree records every file as a regular blob
+        e.uid = st.st_uid;
+        e.gid = st.st_gid;
+        e.size = static_cast<uint32_t>(st.st_size);
+
+        auto old = old_index.entries.find(e.path);
+        int64_t mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        if (old != old_index.entries.end() && mtime_ns < old_index.timestamp_ns &&
+            old->second.size == e.size && old->second.ino == e.ino && old->second.dev == e.dev &&
+            old->second.mtime_sec == e.mtime_sec && old->second.mtime_nsec == e.mtime_nsec &&
+            old->second.ctime_sec == e.ctime_sec && old->second.ctime_nsec == e.ctime_nsec) {
+            e.sha = old->second.sha;
+            return true;
+        }
+        return false;
+    }
+
+    // adds e (its id known) to the new index
+    ObjectId record(IndexEntry&& e, bool& same) {
+        auto old = old_index.entries.find(e.path);
+        same = old != old_index.entries.end() && old->second.sha == e.sha;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        ObjectId sha = e.sha;
+        new_index.entries[e.path] = std::move(e);
+        return sha;
+    }
+
+    // true when the old index had this directory with the same tree id
+    bool same_tree(const std::string& rel, const ObjectId& sha) const {
+        auto it = old_index.trees.find(rel);
+        return it != old_index.trees.end() && it->second.sha == sha;
+    }
+
+    // tree id for a finished directory; when every child kept its old id and the counts match,
+    // the entry set is unchanged too, so the cached id is reused without rebuilding the object
+    ObjectId finish_tree(const std::string& rel, std::vector<TreeEntry>& entries,
+                            bool unchanged, int entry_count, int subtree_count) {
+        CachedTree t;
+        t.entry_count = entry_count;
+        t.subtree_count = subtree_count;
+
+        auto old = old_index.trees.find(rel);
+        if (unchanged && old != old_index.trees.end() &&
+            old->second.entry_count == entry_count && old->second.subtree_count == subtree_count) {
+            t.sha = old->second.sha;
+        } else {
+            t.sha = write_tree_object(entries);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        new_index.trees[rel] = t;
+        return t.sha;
+    }
+
+    int recorded_entry_count(const std::string& rel) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return new_index.trees[rel].entry_count;
+    }
+};
+
+// recursive write-tree function
+// with a stat cache, unchanged files and subtrees reuse the ids recorded in the index
+ObjectId write_tree_recursive(std::filesystem::path current_path, StatCache* cache = nullptr) {
+    // 0. A directory the fsmonitor saw no change under is not walked at all
+    ObjectId reused;
+    if (cache && cache->reuse_tree(cache->relative(current_path), reused)) return reused;
+
+    std::vector<TreeEntry> entries;
+    bool unchanged = true;
+    int entry_count = 0, subtree_count = 0;
+
+    // 1. The listing first, so reading the directory is timed apart from hashing what is in it
+    std::vector<std::pair<std::filesystem::path, bool>> listing; // path, is a directory
+    {
+        TraceSpan span("readdir");
+        trace_count(Counter::DirsScanned);
+        for (const auto& entry : std::filesystem::directory_iterator(current_path)) {
+            // Skip the .git directory to avoid recursion loops
+            if (entry.path().filename() == ".git") continue;
+            listing.emplace_back(entry.path(), entry.is_directory());
+        }
+    }
+
+    // 2. The directory's files are stat'ed and hashed as one batch
+    std::vector<std::filesystem::path> file_paths;
+    for (const auto& [path, is_directory] : listing) {
+        if (!is_directory) file_paths.push_back(path);
+    }
+    std::vector<bool> file_same;
+    std::vector<ObjectId> file_ids = cache ? cache->hash_files(file_paths, file_same) : hash_files_as_blobs(file_paths);
+    size_t next_file = 0;
+
+    for (const auto& [path, is_directory] : listing) {
+        TreeEntry te;
+        te.name = path.filename().string();
+
+        if (is_directory) {
+            te.mode = "40000"; // Mode for directories
+            // Recursive call returns the id of the sub-tree
+            te.id = write_tree_recursive(path, cache);
+            if (cache) {
+                std::string rel = cache->relative(path);
+                unchanged = unchanged && cache->same_tree(rel, te.id);
+                entry_count += cache->recorded_entry_count(rel);
+                subtree_count++;
+            }
+        } else {
+            te.mode = "100644"; // Mode for regular files
+            if (cache) {
+                unchanged = unchanged && file_same[next_file];
+                entry_count++;
+            }
+            te.id = file_ids[next_file++];
+        }
+        entries.push_back(te);
+    }
+
+    if (cache) {
+        return cache->finish_tree(cache->relative(current_path), entries, unchanged, entry_count, subtree_count);
+    }
+    return write_tree_object(entries);
+}
+
+// parallel write-tree
+// every directory becomes a node; files and sub-directories are hashed as independent tasks
+// and the last child to finish emits the parent's tree object, so no task ever blocks on another
+struct TreeNode {
+    std::filesystem::path path;
+    TreeNode* parent = nullptr;
+    size_t slot = 0;                 // index of this node's entry in parent->entries
+    std::vector<TreeEntry> entries;
+    std::vector<std::unique_ptr<TreeNode>> children;
+    std::atomic<size_t> remaining{0};
+    // stat-cache bookkeeping, filled in by the children as they finish
+    std::atomic<bool> unchanged{true};
+    std::atomic<int> entry_count{0};
+    std::optional<ObjectId> reused; // cached tree id of a directory the fsmonitor saw no change under
+};
+
+struct ParallelTreeBuild {
+    static constexpr size_t FILE_GROUP = 32;
+
+    ThreadPool& pool;
+    StatCache* cache;
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    bool done = false;
+    ObjectId root_hash;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    ParallelTreeBuild(ThreadPool& p, StatCache* c) : pool(p), cache(c) {}
+
+    void fail(std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = e;
+    }
+
+    bool failed() {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        return error != nullptr;
+    }
+
+    // one child of node is finished; the last one writes the tree and reports upwards
+    void child_done(TreeNode* node) {
+        while (node && node->remaining.fetch_sub(1) == 1) {
+            ObjectId hash;
+            bool written = false;
+            if (!failed()) {
+                try {
+                    if (node->reused) {
+                        hash = *node->reused;
+                    } else if (cache) {
+                        hash = cache->finish_tree(cache->relative(node->path), node->entries, node->unchanged,
+                                                  node->entry_count, static_cast<int>(node->children.size()));
+                    } else {
+                        hash = write_tree_object(node->entries);
+                    }
+                    written = true;
+                } catch (...) {
+                    fail(std::current_exception());
+                }
+            }
+            if (!node->parent) {
+                std::lock_guard<std::mutex> lock(done_mutex);
+                root_hash = hash;
+                done = true;
+                done_cv.notify_all();
+                return;
+            }
+            if (written) node->parent->entries[node->slot].id = hash;
+            if (cache) {
+                if (!cache->same_tree(cache->relative(node->path), hash)) node->parent->unchanged = false;
+                node->parent->entry_count += node->entry_count;
+            }
+            node = node->parent;
+        }
+    }
+
+    void scan(TreeNode* node) {
+        ObjectId reused;
+        if (cache && cache->reuse_tree(cache->relative(node->path), reused)) {
+            node->reused = reused;
+            node->entry_count = cache->recorded_entry_count(cache->relative(node->path));
+            node->remaining = 1;
+            child_done(node);
+            return;
+        }
+
+        std::vector<size_t> files;
+        try {
+            TraceSpan span("readdir");
+            trace_count(Counter::DirsScanned);
+            for (const auto& entry : std::filesystem::directory_iterator(node->path)) {
+                std::string name = entry.path().filename().string();
+                if (name == ".git") continue;
+
+                TreeEntry te;
+                te.name = name;
+                if (entry.is_directory()) {
+                    te.mode = "40000";
+                    auto child = std::make_unique<TreeNode>();
+                    child->path = entry.path();
+                    child->parent = node;
+                    child->slot = node->entries.size();
+                    node->children.push_back(std::move(child));
+                } else {
+                    te.mode = "100644";
+                    files.push_back(node->entries.size());
+                }
+                node->entries.push_back(te);
+            }
+        } catch (...) {
+            fail(std::current_exception());
+            node->children.clear();
+            files.clear();
+        }
+
+        // +1 keeps the node alive until every child task has been submitted; files are hashed
+        // FILE_GROUP to a task, so their stats and reads can be batched
+        size_t groups = (files.size() + FILE_GROUP - 1) / FILE_GROUP;
+        node->remaining = node->children.size() + groups + 1;
+
+        for (auto& child : node->children) {
+            TreeNode* c = child.get();
+            pool.submit([this, c] { scan(c); });
+        }
+        for (size_t begin = 0; begin < files.size(); begin += FILE_GROUP) {
+            std::vector<size_t> group(files.begin() + begin, files.begin() + std::min(begin + FILE_GROUP, files.size()));
+            pool.submit([this, node, group = std::move(group)] {
+                if (!failed()) {
+                    try {
+                        std::vector<std::filesystem::path> paths;
+                        for (size_t slot : group) paths.push_back(node->path / node->entries[slot].name);
+                        std::vector<bool> same;
+                        std::vector<ObjectId> hashes = cache ? cache->hash_files(paths, same) : hash_files_as_blobs(paths);
+                        for (size_t k = 0; k < group.size(); k++) {
+                            node->entries[group[k]].id = hashes[k];
+                            if (cache && !same[k]) node->unchanged = false;
+                        }
+                        if (cache) node->entry_count += static_cast<int>(group.size());
+                    } catch (...) {
+                        fail(std::current_exception());
+                    }
+                }
+                child_done(node);
+            });
+        }
+        child_done(node);
+    }
+};
+
+// parallel counterpart of write_tree_recursive; produces the same tree hash
+ObjectId write_tree_parallel(const std::filesystem::path& root, ThreadPool& pool, StatCache* cache = nullptr) {
+    TraceSpan span("walk");
+    ParallelTreeBuild build(pool, cache);
+    TreeNode root_node;
+    root_node.path = root;
+
+    pool.submit([&build, &root_node] { build.scan(&root_node); });
+
+    std::unique_lock<std::mutex> lock(build.done_mutex);
+    build.done_cv.wait(lock, [&build] { return build.done; });
+    if (build.error) std::rethrow_exception(build.error);
+    return build.root_hash;
+}
+
+// fsmonitor
+// a background process that watches every directory of the work tree with inotify and numbers
+// each change. write-tree sends it the token saved with the index and gets back the directories
+// that changed since then, plus a new token; everything else is taken from the index as is.
+// an unknown token (first run, daemon restarted, events lost) gets a "full" answer: walk it all.
+// requests and answers go over a unix socket in .git: "query <token>\n" is answered with
+// "<token>\0full\0" or "<token>\0dirty\0" followed by "<dir>\0" per directory ("" is the root)
+const char* const FSMONITOR_SOCKET = ".git/fsmonitor.sock";
+
+struct FsmonitorAnswer {
+    std::string token;
+    bool full = true;
+    std::vector<std::string> dirty;
+};
+
+class FsmonitorDaemon {
+public:
+    explicit FsmonitorDaemon(std::filesystem::path root) : root(std::move(root)) {
+        instance = std::to_string(getpid()) + "-" +
+                   std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+        start_watching();
+    }
+    ~FsmonitorDaemon() { close(inotify_fd); }
+    FsmonitorDaemon(const FsmonitorDaemon&) = delete;
+    FsmonitorDaemon& operator=(const FsmonitorDaemon&) = delete;
+
+    // serves listen_fd until a "stop" request
+    void run(int listen_fd) {
+        for (;;) {
+            pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {listen_fd, POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("fsmonitor: poll failed: ") + strerror(errno));
+            }
+            if (fds[0].revents & POLLIN) drain();
+            if (fds[1].revents & POLLIN) {
+                int client = accept(listen_fd, nullptr, nullptr);
+                if (client < 0) continue;
+                bool stop = serve(client);
+                close(client);
+                if (stop) return;
+            }
+        }
+    }
+
+private:
+    static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                       IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+    std::filesystem::path root;
+    std::string instance;
+    int inotify_fd = -1;
+    uint64_t seq = 0;       // number of the last change seen
+    uint64_t reset_seq = 0; // tokens older than this get a full answer
+    std::unordered_map<int, std::string> watches;         // watch descriptor -> directory
+    std::unordered_map<std::string, int> watch_of;
+    std::unordered_map<std::string, uint64_t> changed;    // directory -> seq of its last change
+
+    static std::string child_path(const std::string& dir, const std::string& name) {
+        return dir.empty() ? name : dir + "/" + name;
+    }
+
+    // (re)watches the whole tree; anything that happened before is only covered by a full answer
+    void start_watching() {
+        if (inotify_fd >= 0) close(inotify_fd);
+        watches.clear();
+        watch_of.clear();
+        changed.clear();
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) throw std::runtime_error(std::string("fsmonitor: inotify_init1 failed: ") + strerror(errno));
+        watch_tree("", false);
+        reset_seq = ++seq;
+    }
+
+    // watches dir and every directory below it (following symlinks, as write-tree does);
+    // the watch goes in before the listing, so nothing created meanwhile is missed
+    void watch_tree(const std::string& dir, bool mark) {
+        std::filesystem::path path = dir.empty() ? root : root / dir;
+        int wd = inotify_add_watch(inotify_fd, path.c_str(), WATCH_MASK);
+        if (wd < 0) {
+            if (errno == ENOENT || errno == ENOTDIR) return; // gone again
+            // out of watches: this directory would go unnoticed, so no token may be trusted
+            std::cerr << "fsmonitor: cannot watch " << path.string() << ": " << strerror(errno) << '\n';
+            reset_seq = UINT64_MAX;
+            return;
+        }
+        watches[wd] = dir;
+        watch_of[dir] = wd;
+        if (mark) changed[dir] = ++seq;
+
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(path, ec)) {
+            std::string name = entry.path().filename().string();
+            if (name == ".git") continue;
+            if (entry.is_directory(ec)) watch_tree(child_path(dir, name), mark);
+        }
+    }
+
+    void unwatch_tree(const std::string& dir) {
+        std::string prefix = dir + "/";
+        for (auto it = watch_of.begin(); it != watch_of.end();) {
+            if (it->first == dir || it->first.compare(0, prefix.size(), prefix) == 0) {
+                inotify_rm_watch(inotify_fd, it->second);
+                watches.erase(it->second);
+                it = watch_of.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // reads every queued event without blocking
+    void drain() {
+        alignas(inotify_event) char buf[64 * 1024];
+        for (;;) {
+            ssize_t n = read(inotify_fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            for (char* p = buf; p < buf + n;) {
+                const inotify_event* ev = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    // events were dropped: start over
+                    start_watching();
+                    return;
+                }
+                handle(ev);
+            }
+        }
+    }
+
+    void handle(const inotify_event* ev) {
+        auto it = watches.find(ev->wd);
+        if (it == watches.end()) return;
+        std::string dir = it->second;
+        if (ev->mask & IN_IGNORED) {
+            watch_of.erase(dir);
+            watches.erase(it);
+            return;
+        }
+        if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) return; // the parent reports it too
+
+        std::string name = ev->len ? std::string(ev->name) : "";
+        if (name == ".git") return;
+        changed[dir] = ++seq;
+
+        // 1. Directories that appear are watched and reported with everything below them
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+            watch_tree(child_path(dir, name), true);
+        } else if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_DELETE | IN_MOVED_FROM))) {
+            unwatch_tree(child_path(dir, name));
+        }
+    }
+
+    // answers one request; true for "stop"
+    bool serve(int client) {
+        // 1. One request line
+        timeval timeout{5, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string request;
+        char c;
+        while (request.size() < 4096 && recv(client, &c, 1, 0) == 1 && c != '\n') request.push_back(c);
+
+        // 2. Everything that happened before the request was made is in the inotify queue by now
+        drain();
+        std::string token = instance + ":" + std::to_string(seq);
+        std::string reply;
+        if (request == "stop") {
+            unlink(FSMONITOR_SOCKET);
+            reply = "stopped\n";
+        } else if (request == "status") {
+            reply = "watching " + std::to_string(watches.size()) + " directories in " + root.string() +
+                    ", token " + token + "\n";
+        } else if (request.rfind("query ", 0) == 0) {
+            reply = answer(request.substr(6), token);
+        } else {
+            reply = "error: unknown request\n";
+        }
+        send_all(client, reply);
+        return request == "stop";
+    }
+
+    std::string answer(const std::string& since, const std::string& token) {
+        std::string reply = token;
+        reply.push_back('\0');
+        size_t colon = since.rfind(':');
+        uint64_t since_seq = 0;
+        bool known = colon != std::string::npos && since.compare(0, colon, instance) == 0;
+        if (known) since_seq = std::strtoull(since.c_str() + colon + 1, nullptr, 10);
+        if (!known || since_seq < reset_seq || since_seq > seq) {
+            reply.append("full", 4).push_back('\0');
+            return reply;
+        }
+        reply.append("dirty", 5).push_back('\0');
+        for (const auto& [dir, at] : changed) {
+            if (at > since_seq) reply.append(dir).push_back('\0');
+        }
+        return reply;
+    }
+
+    static void send_all(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            sent += static_cast<size_t>(n);
+        }
+    }
+};
+
+// the token write-tree last checked the index against, kept next to the index as
+// "<index checksum> <token>" so that an index rewritten by anything else (git itself included)
+// never inherits it
+const char* const FSMONITOR_TOKEN_FILE = ".git/fsmonitor.token";
+
+std::string load_fsmonitor_token(const Index& index) {
+    std::ifstream in(FSMONITOR_TOKEN_FILE);
+    std::string checksum, token;
+    if (!(in >> checksum >> token) || checksum != index.checksum.hex()) return "";
+    return token;
+}
+
+// written after the index it belongs to, so a crash in between leaves an older token (which
+// reports more directories than needed), never a newer one
+void save_fsmonitor_token(const Index& index, const std::string& token) {
+    if (token.empty()) {
+        unlink(FSMONITOR_TOKEN_FILE);
+        return;
+    }
+    std::string lock = std::string(FSMONITOR_TOKEN_FILE) + ".lock";
+    {
+        std::ofstream out(lock, std::ios::trunc);
+        out << index.checksum << ' ' << token << '\n';
+        if (!out) throw std::runtime_error("Failed to write " + lock);
+    }
+    std::filesystem::rename(lock, FSMONITOR_TOKEN_FILE);
+}
+
+// connected socket to the running daemon, or -1
+int connect_fsmonitor() {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, FSMONITOR_SOCKET, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// sends one request line and reads the reply up to EOF; nullopt when no daemon answers
+std::optional<std::string> fsmonitor_request(const std::string& request) {
+    int fd = connect_fsmonitor();
+    if (fd < 0) return std::nullopt;
+    timeval timeout{10, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string line = request + "\n";
+    if (send(fd, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size())) {
+        close(fd);
+        return std::nullopt;
+    }
+    std::string reply;
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) reply.append(buf, n);
+    close(fd);
+    if (n < 0) return std::nullopt;
+    return reply;
+}
+
+// directories changed since token, according to the daemon; nullopt when none is running
+std::optional<FsmonitorAnswer> query_fsmonitor(const std::string& token) {
+    std::optional<std::string> reply = fsmonitor_request("query " + token);
+    if (!reply) return std::nullopt;
+    std::vector<std::string> fields;
+    size_t start = 0;
+    for (size_t nul; (nul = reply->find('\0', start)) != std::string::npos; start = nul + 1) {
+        fields.push_back(reply->substr(start, nul - start));
+    }
+    if (fields.size() < 2 || (fields[1] != "full" && fields[1] != "dirty")) return std::nullopt;
+    FsmonitorAnswer answer;
+    answer.token = fields[0];
+    answer.full = fields[1] == "full";
+    answer.dirty.assign(fields.begin() + 2, fields.end());
+    return answer;
+}
+
+// binds the daemon's socket in .git; a stale socket left by a dead daemon is replaced
+int listen_fsmonitor() {
+    if (!std::filesystem::is_directory(".git")) throw std::runtime_error("Not a git repository (no .git here)");
+    if (fsmonitor_request("status")) throw std::runtime_error("fsmonitor is already running");
+    unlink(FSMONITOR_SOCKET);
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, FSMONITOR_SOCKET, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        std::string error = strerror(errno);
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("fsmonitor: cannot listen on " + std::string(FSMONITOR_SOCKET) + ": " + error);
+    }
+    return fd;
+}
+
+// fsmonitor--daemon (start | run | stop | status)
+void fsmonitor_daemon(const std::string& action) {
+    if (action == "stop" || action == "status") {
+        std::optional<std::string> reply = fsmonitor_request(action);
+        if (!reply) throw std::runtime_error("fsmonitor is not running");
+        std::cout << *reply;
+        return;
+    }
+    if (action != "start" && action != "run") throw std::runtime_error("Unknown fsmonitor action: " + action);
+
+    // 1. The socket exists before start returns, so the next write-tree already finds the daemon
+    int listen_fd = listen_fsmonitor();
+    if (action == "start") {
+        pid_t pid = fork();
+        if (pid < 0) throw std::runtime_error(std::string("fsmonitor: fork failed: ") + strerror(errno));
+        if (pid > 0) {
+            close(listen_fd);
+            std::cout << "fsmonitor started (pid " << pid << ")\n";
+            return;
+        }
+        // 2. Detached from the terminal; errors go nowhere from here on
+        setsid();
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0) {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            if (null > STDERR_FILENO) close(null);
+        }
+    }
+
+    // 3. Watch and serve
+    try {
+        FsmonitorDaemon daemon(std::filesystem::current_path());
+        daemon.run(listen_fd);
+    } catch (...) {
+        unlink(FSMONITOR_SOCKET);
+        close(listen_fd);
+        if (action == "start") _exit(EXIT_FAILURE);
+        throw;
+    }
+    close(listen_fd);
+    if (action == "start") _exit(EXIT_SUCCESS);
+}
+
+// create the .git directory structure in the current directory
+void init_repository(const std::string& branch = "main") {
+    std::filesystem::create_directory(".git");
+    std::filesystem::create_directory(".git/objects");
+    std::filesystem::create_directory(".git/refs");
+    std::filesystem::create_directories(".git/refs/heads");
+
+    // Create HEAD file
+    std::ofstream headFile(".git/HEAD");
+    if (!headFile.is_open()) throw std::runtime_error("Failed to create .git/HEAD file.");
+    headFile << "ref: refs/heads/" << branch << "\n";
+    headFile.close();
+    if (!headFile) throw std::runtime_error("Failed to write .git/HEAD file.");
+}
+
+// value of a key in .git/config, named as git names it: "section.key" or "section.subsection.key"
+// with section and key in lower case. the last assignment wins
+std::optional<std::string> read_config(const std::string& name, const std::filesystem::path& git_dir = ".git") {
+    auto lower = [](std::string s) {
+        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+        return s;
+    };
+    auto trim = [](const std::string& s) {
+        size_t begin = s.find_first_not_of(" \t\r");
+        if (begin == std::string::npos) return std::string();
+        return s.substr(begin, s.find_last_not_of(" \t\r") - begin + 1);
+    };
+
+    std::ifstream file(git_dir / "config");
+    std::optional<std::string> value;
+    std::string line, section;
+    while (std::getline(file, line)) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';') continue;
+        // 1. [section] or [section "subsection"]
+        if (line[0] == '[') {
+            size_t close = line.rfind(']');
+            std::string header = line.substr(1, close == std::string::npos ? std::string::npos : close - 1);
+            size_t quote = header.find('"');
+            if (quote == std::string::npos) {
+                section = lower(trim(header));
+            } else {
+                std::string sub = header.substr(quote + 1);
+                if (!sub.empty() && sub.back() == '"') sub.pop_back();
+                section = lower(trim(header.substr(0, quote))) + "." + sub;
+            }
+            continue;
+        }
+        // 2. key = value (a bare key means true)
+        size_t eq = line.find('=');
+        std::string key = lower(trim(line.substr(0, eq)));
+        if (section + "." + key != name) continue;
+        value = eq == std::string::npos ? "true" : trim(line.substr(eq + 1));
+    }
+    return value;
+}
+
+// a shallow clone's cut-off commits, one hex id per line: their parents were never fetched
+const std::filesystem::path SHALLOW_FILE = ".git/shallow";
+
+std::unordered_set<ObjectId> read_shallow(const std::filesystem::path& file = SHALLOW_FILE) {
+    std::unordered_set<ObjectId> shallow;
+    std::ifstream in(file);
+    std::string line;
+    ObjectId id;
+    while (std::getline(in, line)) {
+        if (ObjectId::parse(line, id)) shallow.insert(id);
+    }
+    return shallow;
+}
+
+// byte budget for the object cache: $PROTO_GIT_OBJECT_CACHE_MB, 32 MiB by default, read like
+// delta_base_cache_limit
+size_t object_cache_limit() {
+    const char* env = std::getenv("PROTO_GIT_OBJECT_CACHE_MB");
+    size_t mb = 32;
+    if (env && !parse_number(std::string(env), mb)) mb = 32;
+    return std::min(mb, SIZE_MAX >> 20) << 20;
+}
+
+// object database
+// one lookup across loose objects and every pack. read() hands out an immutable, shared view of
+// the inflated object and keeps recently read objects in a size-bounded LRU, so walks that come
+// back to the same trees and commits don't inflate them again. stream() is meant for blobs of any
+// size and only serves from the cache, never fills it. keeps inflate state: one per thread
+class ObjectDatabase {
+public:
+    // typed view of an inflated object; empty when the object was not found
+    struct Object {
+        std::string type;
+        std::shared_ptr<const std::vector<char>> data;
+
+        explicit operator bool() const { return data != nullptr; }
+        const char* bytes() const { return data->data(); }
+        size_t size() const { return data->size(); }
+    };
+
+    explicit ObjectDatabase(const std::filesystem::path& objects_dir = ".git/objects",
+                            size_t cache_budget = object_cache_limit())
+        : objects_dir(objects_dir), loose(objects_dir), packs(objects_dir / "pack"), budget(cache_budget) {}
+
+    // throws when the object is corrupt
+    Object read(const ObjectId& id) {
+        auto it = index.find(id);
+        if (it != index.end()) {
+            cache_hits++;
+            trace_count(Counter::CacheHits);
+            lru.splice(lru.begin(), lru, it->second); // most recently used goes first
+            return it->second->second;
+        }
+        cache_misses++;
+        trace_count(Counter::CacheMisses);
+
+        TraceSpan span("object-read");
+        Object obj;
+        auto content = std::make_shared<std::vector<char>>();
+        if (!loose.read(id, obj.type, *content) && !packs.read(id, obj.type, *content) &&
+            !(fetch_lazily(id) && packs.read(id, obj.type, *content))) {
+            return {};
+        }
+        obj.data = content;
+        put(id, obj);
+        return obj;
+    }
+
+    // read() that insists on the object existing with the given type
+    Object read(const ObjectId& id, const std::string& expected_type) {
+        Object obj = read(id);
+        if (!obj) throw std::runtime_error("Object " + id.hex() + " not found");
+        if (obj.type != expected_type) {
+            throw std::runtime_error("Object " + id.hex() + " is a " + obj.type + ", not a " + expected_type);
+        }
+        return obj;
+    }
+
+    // same contract as LooseObjectReader::stream
+    bool stream(const ObjectId& id,
+                const std::function<bool(const std::string&, size_t)>& on_header,
+                const std::function<void(const char*, size_t)>& on_data) {
+        auto it = index.find(id);
+        if (it != index.end()) {
+            cache_hits++;
+            trace_count(Counter::CacheHits);
+            const Object& obj = it->second->second;
+            if (on_header(obj.type, obj.size())) on_data(obj.bytes(), obj.size());
+            return true;
+        }
+        TraceSpan span("object-stream");
+        return loose.stream(id, on_header, on_data) || packs.stream(id, on_header, on_data) ||
+               (fetch_lazily(id) && packs.stream(id, on_header, on_data));
+    }
+
+    bool contains(const ObjectId& id) { return index.count(id) || has_loose(id) || packs.contains(id); }
+
+    // an object's size without inflating more of it than its header (a packed delta: a few bytes)
+    std::optional<uint64_t> size(const ObjectId& id) {
+        uint64_t offset;
+        if (PackFile* pack = packs.locate(id, offset)) return pack->object_size(offset);
+        std::optional<uint64_t> result;
+        auto header = [&result](const std::string&, size_t n) {
+            result = n;
+            return false;
+        };
+        loose.stream(id, header, [](const char*, size_t) {});
+        return result;
+    }
+
+    // partial clones: downloads ids (none of which are here) into a new pack, see enable_lazy_fetch.
+    // when set, read() and stream() call it for an object they can't find and then look again
+    std::function<void(const std::vector<ObjectId>&)> fetch_missing;
+
+    // fetches whichever of ids are missing up front, PREFETCH_BATCH to a round trip, so a walk that
+    // knows what it will read doesn't pay one round trip per object
+    static constexpr size_t PREFETCH_BATCH = 50000;
+
+    void prefetch(const std::vector<ObjectId>& ids) {
+        if (!fetch_missing) return;
+        std::vector<ObjectId> missing;
+        std::unordered_set<ObjectId> seen;
+        for (const ObjectId& id : ids) {
+            if (!contains(id) && seen.insert(id).second) missing.push_back(id);
+        }
+        for (size_t begin = 0; begin < missing.size(); begin += PREFETCH_BATCH) {
+            size_t end = std::min(begin + PREFETCH_BATCH, missing.size());
+            try {
+                fetch_missing(std::vector<ObjectId>(missing.begin() + begin, missing.begin() + end));
+            } catch (const std::exception& e) {
+                // e.g. one id the remote doesn't know; each object then gets its own try when read
+                std::cerr << "warning: prefetch of " << end - begin << " objects failed: " << e.what() << '\n';
+            }
+        }
+        if (!missing.empty()) packs.rescan();
+    }
+
+    // with io_uring, reads the loose files among ids that aren't cached in batches ahead of the
+    // read() calls for them (cat-file --batch, checkout); a no-op for blocking I/O, which gains nothing
+    void preload(const std::vector<ObjectId>& ids) {
+        if (!IoEngine::uring_enabled()) return;
+        std::vector<ObjectId> wanted;
+        std::unordered_set<ObjectId> seen;
+        for (const ObjectId& id : ids) {
+            if (!index.count(id) && !packs.contains(id) && seen.insert(id).second) wanted.push_back(id);
+        }
+        loose.preload(wanted);
+    }
+
+    bool has_loose(const ObjectId& id) const { return access((objects_dir / id.loose_path()).c_str(), F_OK) == 0; }
+
+    PackFile* find_packed(const ObjectId& id, uint64_t& offset) { return packs.locate(id, offset); }
+
+    size_t hits() const { return cache_hits; }
+    size_t misses() const { return cache_misses; }
+
+private:
+    std::filesystem::path objects_dir;
+    LooseObjectReader loose;
+    PackSet packs;
+
+    size_t budget;
+    size_t used = 0;
+    size_t cache_hits = 0;
+    size_t cache_misses = 0;
+    std::list<std::pair<ObjectId, Object>> lru;
+    std::unordered_map<ObjectId, std::list<std::pair<ObjectId, Object>>::iterator> index;
+
+    // an object the remote can't provide is reported like any missing object, after a warning
+    bool fetch_lazily(const ObjectId& id) {
+        if (!fetch_missing) return false;
+        try {
+            fetch_missing({id});
+        } catch (const std::exception& e) {
+            std::cerr << "warning: could not fetch " << id.hex() << ": " << e.what() << '\n';
+            return false;
+        }
+        packs.rescan();
+        return true;
+    }
+
+    void put(const ObjectId& id, const Object& obj) {
+        if (obj.size() > budget) return;
+        lru.emplace_front(id, obj);
+        index[id] = lru.begin();
+        used += obj.size();
+        while (used > budget) {
+            used -= lru.back().second.size();
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+};
+
+// ---- pack-objects / gc ----
+
+// git's delta encoder
+// the base is indexed in 16-byte blocks; the target is scanned with a rolling hash over the same
+// window, and a block match is extended forwards (and backwards over pending literals) into a copy.
+// everything else becomes inserts. gives up with an empty result once the delta reaches max_size
+const size_t DELTA_BLOCK = 16;
+
+std::vector<char> create_delta(const std::vector<char>& base, const std::vector<char>& target, size_t max_size) {
+    std::vector<char> delta;
+    if (base.size() < DELTA_BLOCK || target.size() < DELTA_BLOCK || base.size() > 0xFFFFFFFFu) return delta;
+
+    const uint32_t MUL = 257;
+    uint32_t drop = 1; // MUL^(DELTA_BLOCK - 1), to roll the oldest byte out
+    for (size_t i = 1; i < DELTA_BLOCK; i++) drop *= MUL;
+    auto block_hash = [&](const unsigned char* p) {
+        uint32_t h = 0;
+        for (size_t i = 0; i < DELTA_BLOCK; i++) h = h * MUL + p[i];
+        return h;
+    };
+
+    // 1. Index the base: bucket heads plus a chain through earlier blocks with the same bucket
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(base.data());
+    const unsigned char* t = reinterpret_cast<const unsigned char*>(target.data());
+    size_t blocks = base.size() / DELTA_BLOCK;
+    size_t buckets = 16;
+    while (buckets < blocks) buckets <<= 1;
+    std::vector<int32_t> head(buckets, -1), next(blocks, -1);
+    for (size_t i = 0; i < blocks; i++) {
+        uint32_t slot = block_hash(b + i * DELTA_BLOCK) & (buckets - 1);
+        next[i] = head[slot];
+        head[slot] = static_cast<int32_t>(i);
+    }
+
+    // 2. Header: base and result sizes as varints
+    auto put_varint = [&delta](uint64_t v) {
+        while (v >= 0x80) {
+            delta.push_back(static_cast<char>((v & 0x7F) | 0x80));
+            v >>= 7;
+        }
+        delta.push_back(static_cast<char>(v));
+    };
+    put_varint(base.size());
+    put_varint(target.size());
+
+    auto flush_insert = [&](size_t from, size_t to) {
+        while (from < to) {
+            size_t n = std::min<size_t>(to - from, 127);
+            delta.push_back(static_cast<char>(n));
+            delta.insert(delta.end(), target.begin() + from, target.begin() + from + n);
+            from += n;
+        }
+    };
+    auto emit_copy = [&](size_t offset, size_t size) {
+        while (size > 0) {
+            size_t n = std::min<size_t>(size, 0x10000);
+            unsigned char op = 0x80;
+            char args[7];
+            int count = 0;
+            for (int i = 0; i < 4; i++) {
+                unsigned char byte = (offset >> (8 * i)) & 0xFF;
+                if (byte) { op |= 1 << i; args[count++] = static_cast<char>(byte); }
+            }
+            if (n != 0x10000) { // a size of zero encodes 0x10000
+                for (int i = 0; i < 3; i++) {
+                    unsigned char byte = (n >> (8 * i)) & 0xFF;
+                    if (byte) { op |= 0x10 << i; args[count++] = static_cast<char>(byte); }
+                }
+            }
+            delta.push_back(static_cast<char>(op));
+            delta.insert(delta.end(), args, args + count);
+            offset += n;
+            size -= n;
+        }
+    };
+
+    // 3. Scan the target
+    size_t pos = 0, literal = 0;
+    uint32_t h = block_hash(t);
+    while (pos + DELTA_BLOCK <= target.size()) {
+        size_t best_len = 0, best_off = 0;
+        int chain = 0;
+        for (int32_t i = head[h & (buckets - 1)]; i >= 0 && chain < 64; i = next[i], chain++) {
+            size_t off = static_cast<size_t>(i) * DELTA_BLOCK;
+            if (memcmp(b + off, t + pos, DELTA_BLOCK) != 0) continue;
+            size_t len = DELTA_BLOCK;
+            while (off + len < base.size() && pos + len < target.size() && b[off + len] == t[pos + len]) len++;
+            if (len > best_len) { best_len = len; best_off = off; }
+        }
+
+        if (best_len == 0) {
+            if (pos + DELTA_BLOCK < target.size()) h = (h - t[pos] * drop) * MUL + t[pos + DELTA_BLOCK];
+            pos++;
+            continue;
+        }
+        while (best_off > 0 && pos > literal && b[best_off - 1] == t[pos - 1]) {
+            best_off--;
+            pos--;
+            best_len++;
+        }
+        flush_insert(literal, pos);
+        emit_copy(best_off, best_len);
+        pos += best_len;
+        literal = pos;
+        if (delta.size() >= max_size) return {};
+        if (pos + DELTA_BLOCK <= target.size()) h = block_hash(t + pos);
+    }
+    flush_insert(literal, target.size());
+    if (delta.size() >= max_size) return {};
+    return delta;
+}
+
+// git's path hash for delta ordering: mostly the last characters, so files with the same
+// suffix (and the same name in different directories) sort next to each other
+uint32_t pack_name_hash(const std::string& name) {
+    uint32_t hash = 0;
+    for (unsigned char c : name) {
+        if (isspace(c)) continue;
+        hash = (hash >> 2) + (static_cast<uint32_t>(c) << 24);
+    }
+    return hash;
+}
+
+// one object headed for a pack
+struct PackCandidate {
+    ObjectId id;
+    int type = 0;
+    uint32_t name_hash = 0;
+    size_t size = 0;
+    int base = -1;           // index of the delta base in the candidate list, -1 = stored whole
+    int depth = 0;           // length of the delta chain below this object
+    std::vector<char> delta; // delta against base
+};
+
+// every object id under refs/, packed-refs and HEAD
+std::vector<ObjectId> list_ref_tips() {
+    std::vector<ObjectId> tips;
+    auto add = [&tips](std::string hex) {
+        while (!hex.empty() && isspace(static_cast<unsigned char>(hex.back()))) hex.pop_back();
+        ObjectId id;
+        if (ObjectId::parse(hex, id)) tips.push_back(id);
+    };
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(".git/refs", ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file()) continue;
+        std::ifstream f(it->path());
+        std::string line;
+        if (std::getline(f, line)) add(line);
+    }
+    std::ifstream packed(".git/packed-refs");
+    std::string line;
+    while (std::getline(packed, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        add(line.substr(0, 40 + (line[0] == '^')).substr(line[0] == '^'));
+    }
+    std::ifstream head(".git/HEAD");
+    if (std::getline(head, line)) add(line); // a detached HEAD; a symref is covered by refs/
+    return tips;
+}
+
+// every object reachable from the ref tips, with the path it was reached by for the name hash.
+// with only_loose, objects that are already in a pack are walked through but not returned. the
+// walk stops at a shallow clone's cut-off commits, and a partial clone's missing objects are
+// promised by its remote rather than lost
+std::vector<PackCandidate> enumerate_reachable(ObjectDatabase& db, bool only_loose) {
+    TraceSpan span("enumerate-reachable");
+    std::vector<PackCandidate> found;
+    std::set<ObjectId> seen;
+    std::unordered_set<ObjectId> shallow = read_shallow();
+    bool promisor = read_config("extensions.partialclone").has_value();
+    std::vector<std::pair<ObjectId, std::string>> pending; // id, path
+    for (auto& tip : list_ref_tips()) pending.emplace_back(tip, "");
+
+    while (!pending.empty()) {
+        auto [id, path] = pending.back();
+        pending.pop_back();
+        if (!seen.insert(id).second) continue;
+
+        ObjectDatabase::Object obj = db.read(id);
+        if (!obj && promisor) continue;
+        if (!obj) throw std::runtime_error("gc: missing object " + id.hex() + (path.empty() ? "" : " (" + path + ")"));
+        const std::string& type = obj.type;
+        const std::vector<char>& content = *obj.data;
+
+        if (type == "commit" || type == "tag") {
+            std::istringstream lines(std::string(content.begin(), content.end()));
+            std::string line;
+            bool cut = shallow.count(id);
+            while (std::getline(lines, line) && !line.empty()) {
+                if (line.rfind("parent ", 0) == 0 && cut) continue;
+                if (line.rfind("tree ", 0) == 0 || line.rfind("parent ", 0) == 0 || line.rfind("object ", 0) == 0) {
+                    pending.emplace_back(ObjectId::from_hex(line.substr(line.find(' ') + 1)), "");
+                }
+            }
+        } else if (type == "tree") {
+            for (const TreeView::Entry& e : TreeView(content, id)) {
+                // gitlinks (160000) point into another repository
+                if (e.is_gitlink()) continue;
+                std::string child = path;
+                if (!child.empty()) child += '/';
+                child += e.name;
+                pending.emplace_back(e.id(), std::move(child));
+            }
+        }
+
+        if (only_loose && !db.has_loose(id)) continue;
+        PackCandidate c;
+        c.id = id;
+        c.type = type == "commit" ? OBJ_COMMIT : type == "tree" ? OBJ_TREE : type == "blob" ? OBJ_BLOB : OBJ_TAG;
+        c.name_hash = pack_name_hash(path);
+        c.size = content.size();
+        found.push_back(std::move(c));
+    }
+    return found;
+}
+
+// delta search
+// candidates are visited ordered by type, name hash and size (largest first), and each is tried
+// against the previous `window` objects of the same type as a delta base. the smallest delta that
+// beats half the object's size wins, as long as the chain stays within max_depth
+void find_deltas(ObjectDatabase& db, std::vector<PackCandidate>& objects,
+                 size_t window, int max_depth) {
+    TraceSpan span("find-deltas");
+    std::vector<size_t> order(objects.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&objects](size_t a, size_t b) {
+        const auto& x = objects[a];
+        const auto& y = objects[b];
+        if (x.type != y.type) return x.type < y.type;
+        if (x.name_hash != y.name_hash) return x.name_hash < y.name_hash;
+        return x.size > y.size;
+    });
+
+    const size_t BIG_FILE_THRESHOLD = 512 * 1024 * 1024; // like core.bigFileThreshold: never deltified
+    std::deque<std::pair<size_t, ObjectDatabase::Object>> recent; // candidate index, content
+    for (size_t idx : order) {
+        PackCandidate& target = objects[idx];
+        if (window == 0 || target.size < 64 || target.size > BIG_FILE_THRESHOLD) continue;
+
+        ObjectDatabase::Object content = db.read(target.id);
+        if (!content) throw std::runtime_error("gc: missing object " + target.id.hex());
+
+        for (auto& [base_idx, base] : recent) {
+            const PackCandidate& candidate = objects[base_idx];
+            if (candidate.type != target.type || candidate.depth >= max_depth) continue;
+            size_t limit = target.delta.empty() ? target.size / 2 : target.delta.size();
+            // a base much smaller than the target can't produce a small enough delta
+            if (base.size() + limit < target.size) continue;
+            std::vector<char> delta = create_delta(*base.data, *content.data, limit);
+            if (delta.empty()) continue;
+            target.delta = std::move(delta);
+            target.base = static_cast<int>(base_idx);
+            target.depth = candidate.depth + 1;
+        }
+
+        recent.emplace_back(idx, std::move(content));
+        if (recent.size() > window) recent.pop_front();
+    }
+}
+
+// OFS_DELTA base: big-endian base-128 distance back to the base, with the +1 per extra byte of git's encoding
+void append_ofs_distance(std::string& out, uint64_t distance) {
+    unsigned char buf[10];
+    size_t p = sizeof(buf) - 1;
+    buf[p] = distance & 0x7F;
+    while (distance >>= 7) buf[--p] = 0x80 | (--distance & 0x7F);
+    out.append(reinterpret_cast<const char*>(buf + p), sizeof(buf) - p);
+}
+
+// writes objects (in list order, each delta right after its base is out) as a v2 pack with
+// OFS_DELTA entries to <base_name>-<checksum>.pack plus its .idx; returns the checksum
+std::string write_pack(ObjectDatabase& db, std::vector<PackCandidate>& objects,
+                       const std::string& base_name) {
+    TraceSpan span("write-pack");
+    std::filesystem::path dir = std::filesystem::path(base_name).parent_path();
+    if (!dir.empty()) std::filesystem::create_directories(dir);
+    std::string tmp_path = (dir.empty() ? std::string("tmp_pack_XXXXXX") : (dir / "tmp_pack_XXXXXX").string());
+    int fd = mkstemp(tmp_path.data());
+    if (fd < 0) throw std::runtime_error("Failed to create " + tmp_path + ": " + strerror(errno));
+    fchmod(fd, 0444);
+
+    Sha1Stream sha;
+    uint64_t offset = 0;
+    auto emit = [&](const std::string& bytes) {
+        sha.update(bytes);
+        write_all(fd, bytes.data(), bytes.size(), tmp_path);
+        offset += bytes.size();
+    };
+
+    std::vector<PackIndexEntry> entries;
+    std::vector<uint64_t> offsets(objects.size(), 0);
+    std::vector<bool> written(objects.size(), false);
+    try {
+        // 1. Header
+        std::string header("PACK", 4);
+        put_be32(header, 2);
+        put_be32(header, static_cast<uint32_t>(objects.size()));
+        emit(header);
+
+        // 2. Objects, each base before the deltas that point back at it
+        std::vector<char> compressed;
+        auto write_one = [&](size_t i) {
+            PackCandidate& obj = objects[i];
+            int type = obj.type;
+            ObjectDatabase::Object whole;
+            std::vector<char> delta;
+            if (obj.base >= 0) {
+                delta.swap(obj.delta);
+                type = OBJ_OFS_DELTA;
+            } else {
+                whole = db.read(obj.id);
+                if (!whole) throw std::runtime_error("gc: missing object " + obj.id.hex());
+            }
+            const std::vector<char>& content = whole ? *whole.data : delta;
+
+            std::string entry;
+            append_pack_entry_header(entry, type, content.size());
+            if (type == OBJ_OFS_DELTA) append_ofs_distance(entry, offset - offsets[obj.base]);
+
+            compress_buffer(content.data(), content.size(), choose_level(content.data(), content.size()), compressed);
+            entry.append(compressed.data(), compressed.size());
+
+            PackIndexEntry e;
+            e.id = obj.id;
+            e.crc = crc32(0, reinterpret_cast<const Bytef*>(entry.data()), entry.size());
+            e.offset = offset;
+            e.resolved = true;
+            entries.push_back(e);
+            offsets[i] = offset;
+            written[i] = true;
+            emit(entry);
+        };
+        for (size_t i = 0; i < objects.size(); i++) {
+            // walk down to the first unwritten base of the chain and write upwards from there
+            std::vector<size_t> chain;
+            for (size_t j = i; !written[j]; j = objects[j].base) {
+                chain.push_back(j);
+                if (objects[j].base < 0) break;
+            }
+            for (auto it = chain.rbegin(); it != chain.rend(); ++it) write_one(*it);
+        }
+
+        // 3. Trailer, then make the pack durable before anything can depend on it
+        ObjectId checksum = sha.digest();
+        write_all(fd, reinterpret_cast<const char*>(checksum.data()), ObjectId::RAW_SIZE, tmp_path);
+        if (fsync(fd) != 0) throw std::runtime_error("Failed to sync " + tmp_path + ": " + strerror(errno));
+        close(fd);
+        fd = -1;
+
+        std::string hex = checksum.hex();
+        std::filesystem::rename(tmp_path, base_name + "-" + hex + ".pack");
+        write_pack_idx(entries, checksum.data(), base_name + "-" + hex + ".idx");
+        return hex;
+    } catch (...) {
+        if (fd >= 0) close(fd);
+        std::filesystem::remove(tmp_path);
+        throw;
+    }
+}
+
+// removes every loose object that a pack now holds, then the fanout directories left empty;
+// returns the number of objects removed
+size_t prune_packed(PackSet& packs) {
+    TraceSpan span("prune-packed");
+    size_t pruned = 0;
+    std::error_code ec;
+    for (const auto& dir : std::filesystem::directory_iterator(".git/objects", ec)) {
+        std::string prefix = dir.path().filename().string();
+        if (prefix.size() != 2 || !dir.is_directory()) continue;
+        std::vector<std::filesystem::path> files;
+        for (const auto& file : std::filesystem::directory_iterator(dir.path(), ec)) files.push_back(file.path());
+        for (const auto& file : files) {
+            ObjectId id;
+            if (!ObjectId::parse(prefix + file.filename().string(), id) || !packs.contains(id)) continue;
+            if (std::filesystem::remove(file, ec)) pruned++;
+        }
+        std::filesystem::remove(dir.path(), ec); // only succeeds once empty
+    }
+    return pruned;
+}
+
+// gc: packs every reachable loose object into one new pack under .git/objects/pack, then prunes
+// the loose copies of everything a pack holds
+void gc(size_t window, int max_depth) {
+    ObjectDatabase db;
+    std::vector<PackCandidate> objects = enumerate_reachable(db, true);
+    if (!objects.empty()) {
+        find_deltas(db, objects, window, max_depth);
+        size_t deltas = std::count_if(objects.begin(), objects.end(), [](const PackCandidate& c) { return c.base >= 0; });
+        std::string checksum = write_pack(db, objects, ".git/objects/pack/pack");
+        std::cout << "Packed " << objects.size() << " objects (" << deltas << " deltas) into pack-"
+                  << checksum << ".pack\n";
+    }
+    PackSet updated; // sees the new pack
+    std::cout << "Pruned " << prune_packed(updated) << " loose objects\n";
+}
+
+// ---- commit-graph / history ----
+
+// revisions: a full object id, HEAD, or a ref name as git resolves it (refs/heads/x, heads/x or x,
+// loose or in packed-refs). annotated tags are peeled to what they point at
+std::optional<ObjectId> read_ref(const std::string& name, const std::filesystem::path& git_dir = ".git") {
+    std::string target = name;
+    for (int depth = 0; depth < 5; depth++) { // symrefs (HEAD -> refs/heads/main), a few levels at most
+        std::ifstream f(git_dir / target);
+        std::string line;
+        if (!std::getline(f, line)) break;
+        if (line.rfind("ref: ", 0) == 0) {
+            target = line.substr(5);
+            continue;
+        }
+        ObjectId id;
+        if (ObjectId::parse(line.substr(0, ObjectId::HEX_SIZE), id)) return id;
+        return std::nullopt;
+    }
+    std::ifstream packed(git_dir / "packed-refs");
+    std::string line;
+    while (std::getline(packed, line)) {
+        if (line.size() > ObjectId::HEX_SIZE + 1 && line.compare(ObjectId::HEX_SIZE + 1, std::string::npos, target) == 0) {
+            return ObjectId::from_hex(line.substr(0, ObjectId::HEX_SIZE));
+        }
+    }
+    return std::nullopt;
+}
+
+// git check-ref-format's rules for a full ref name (refs/...): '/'-separated components, none empty,
+// starting with '.' or ending in ".lock"; no "..", "@{", control characters, space or any of
+// ~^:?*[\; not ending in '.' or '/'. a name from a server is checked before it becomes a path
+bool check_ref_format(const std::string& name) {
+    if (name.empty() || name == "@" || name.find('/') == std::string::npos || name.back() == '.' ||
+        name.find("..") != std::string::npos || name.find("@{") != std::string::npos) {
+        return false;
+    }
+    for (unsigned char c : name) {
+        if (c < 0x20 || c == 0x7f || strchr(" ~^:?*[\\", c)) return false;
+    }
+    std::istringstream components(name);
+    std::string component;
+    size_t count = 0;
+    while (std::getline(components, component, '/')) {
+        count++;
+        if (component.empty() || component[0] == '.') return false;
+        if (component.size() >= 5 && component.compare(component.size() - 5, 5, ".lock") == 0) return false;
+    }
+    return name.back() != '/' && count >= 2;
+}
+
+// points a ref (refs/..., checked with check_ref_format) at id the way git does: through
+// <ref>.lock, created exclusively so a concurrent writer fails instead of being overwritten,
+// then renamed over the ref
+void write_ref(const std::string& name, const ObjectId& id, const std::filesystem::path& git_dir = ".git") {
+    if (!check_ref_format(name)) throw std::runtime_error("Refusing to write ref with bad name '" + name + "'");
+    std::filesystem::path ref = git_dir / name;
+    std::filesystem::create_directories(ref.parent_path());
+    std::string lock = ref.string() + ".lock";
+    int fd = open(lock.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) throw std::runtime_error("Unable to create " + lock + ": " + strerror(errno));
+    try {
+        std::string line = id.hex() + "\n";
+        write_all(fd, line.data(), line.size(), lock);
+    } catch (...) {
+        close(fd);
+        unlink(lock.c_str());
+        throw;
+    }
+    if (close(fd) != 0 || rename(lock.c_str(), ref.c_str()) != 0) {
+        std::string error = strerror(errno);
+        unlink(lock.c_str());
+        throw std::runtime_error("Failed to update " + ref.string() + ": " + error);
+    }
+}
+
+ObjectId resolve_commit(ObjectDatabase& db, const std::string& name) {
+    ObjectId id;
+    bool found = ObjectId::parse(name, id);
+    for (const char* prefix : {"", "refs/", "refs/tags/", "refs/heads/", "refs/remotes/"}) {
+        if (found) break;
+        if (auto ref = read_ref(std::string(prefix) + name)) {
+            id = *ref;
+            found = true;
+        }
+    }
+    if (!found) throw std::runtime_error("Unknown revision '" + name + "'");
+    for (;;) {
+        ObjectDatabase::Object obj = db.read(id);
+        if (!obj) throw std::runtime_error("Object " + id.hex() + " not found");
+        if (obj.type == "commit") return id;
+        if (obj.type != "tag" || obj.size() < 7 + ObjectId::HEX_SIZE || memcmp(obj.bytes(), "object ", 7) != 0) {
+            throw std::runtime_error(name + " is a " + obj.type + ", not a commit");
+        }
+        id = ObjectId::from_hex(std::string(obj.bytes() + 7, ObjectId::HEX_SIZE));
+    }
+}
+
+// the headers of a commit that history walks need
+struct CommitInfo {
+    ObjectId tree;
+    std::vector<ObjectId> parents;
+    int64_t date = 0; // committer time
+};
+
+CommitInfo parse_commit(const char* data, size_t size, const ObjectId& id) {
+    CommitInfo info;
+    bool has_tree = false;
+    const char* p = data;
+    const char* end = data + size;
+    while (p < end && *p != '\n') { // headers end at the first blank line
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+        std::string_view line(p, eol - p);
+        ObjectId ref;
+        if (line.rfind("tree ", 0) == 0 && ObjectId::parse(p + 5, line.size() - 5, ref)) {
+            info.tree = ref;
+            has_tree = true;
+        } else if (line.rfind("parent ", 0) == 0 && ObjectId::parse(p + 7, line.size() - 7, ref)) {
+            info.parents.push_back(ref);
+        } else if (line.rfind("committer ", 0) == 0) {
+            // "committer Name <email> <seconds> <tz>"
+            size_t gt = line.rfind('>');
+            if (gt != std::string_view::npos) info.date = strtoll(std::string(line.substr(gt + 1)).c_str(), nullptr, 10);
+        }
+        p = eol + 1;
+    }
+    if (!has_tree) throw std::runtime_error("Corrupt commit " + id.hex() + ": no tree");
+    return info;
+}
+
+// commit-graph
+// .git/objects/info/commit-graph in git's v1 layout, so either tool can write it and both read it:
+// a chunk table, then OIDF (256 cumulative fanout counts), OIDL (sorted commit ids), CDAT (per
+// commit: root tree, positions of the first two parents, 30-bit generation number and 34-bit
+// commit date) and EDGE (the extra parents of octopus merges), then a SHA-1 of everything before.
+// the generation number is 1 for a root and one more than the highest parent's otherwise, so a
+// commit can never be an ancestor of one whose generation is not greater than its own
+const std::filesystem::path COMMIT_GRAPH_FILE = ".git/objects/info/commit-graph";
+
+class CommitGraph {
+public:
+    static constexpr uint32_t PARENT_NONE = 0x70000000;
+    static constexpr uint32_t PARENT_EDGE = 0x80000000; // second parent slot: EDGE index; in EDGE: the last parent
+    static constexpr uint32_t GENERATION_MAX = 0x3FFFFFFF;
+    static constexpr size_t CDAT_WIDTH = ObjectId::RAW_SIZE + 16;
+
+    // false when there is no graph or it is malformed; callers then read commits from the object store
+    bool open(const std::filesystem::path& file) {
+        if (!map.open(file) || map.size < 8 + 12 + ObjectId::RAW_SIZE) return false;
+        const unsigned char* data = map.data;
+        // header: CGPH, version 1, hash version 1 (SHA-1), chunk count, no base graphs
+        if (memcmp(data, "CGPH", 4) != 0 || data[4] != 1 || data[5] != 1 || data[7] != 0) return false;
+        size_t chunks = data[6];
+        size_t body = map.size - ObjectId::RAW_SIZE;
+        if (8 + (chunks + 1) * 12 > body) return false;
+
+        // chunk table: (id, 64-bit offset) pairs, closed by a zero id whose offset ends the last chunk
+        size_t edge_size = 0;
+        for (size_t i = 0; i < chunks; i++) {
+            const unsigned char* entry = data + 8 + i * 12;
+            uint64_t offset = (uint64_t(get_be32(entry + 4)) << 32) | get_be32(entry + 8);
+            uint64_t next = (uint64_t(get_be32(entry + 16)) << 32) | get_be32(entry + 20);
+            if (offset > next || next > body) return false;
+            std::string id(reinterpret_cast<const char*>(entry), 4);
+            if (id == "OIDF") {
+                if (next - offset != 256 * 4) return false;
+                fanout = data + offset;
+            } else if (id == "OIDL") {
+                oids = data + offset;
+                count = static_cast<uint32_t>((next - offset) / ObjectId::RAW_SIZE);
+            } else if (id == "CDAT") {
+                cdat = data + offset;
+                if (next - offset != uint64_t(count) * CDAT_WIDTH) return false; // OIDL always comes first
+            } else if (id == "EDGE") {
+                edges = data + offset;
+                edge_size = (next - offset) / 4;
+            }
+        }
+        if (!fanout || !oids || !cdat || get_be32(fanout + 255 * 4) != count) return false;
+        edge_count = static_cast<uint32_t>(edge_size);
+        return true;
+    }
+
+    uint32_t size() const { return count; }
+
+    std::optional<uint32_t> find(const ObjectId& id) const {
+        uint8_t first = id.bytes[0];
+        uint32_t lo = first == 0 ? 0 : get_be32(fanout + (first - 1) * 4);
+        uint32_t hi = get_be32(fanout + first * 4);
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(oids + size_t(mid) * ObjectId::RAW_SIZE, id.data(), ObjectId::RAW_SIZE);
+            if (cmp == 0) return mid;
+            if (cmp < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return std::nullopt;
+    }
+
+    ObjectId id(uint32_t pos) const { return ObjectId::from_raw(oids + size_t(pos) * ObjectId::RAW_SIZE); }
+    ObjectId tree(uint32_t pos) const { return ObjectId::from_raw(cdat + size_t(pos) * CDAT_WIDTH); }
+    uint32_t generation(uint32_t pos) const { return get_be32(cdat + size_t(pos) * CDAT_WIDTH + 28) >> 2; }
+    int64_t date(uint32_t pos) const {
+        const unsigned char* p = cdat + size_t(pos) * CDAT_WIDTH + 28;
+        return (int64_t(get_be32(p) & 3) << 32) | get_be32(p + 4);
+    }
+
+    // graph positions of pos's parents, appended to out
+    void parents(uint32_t pos, std::vector<uint32_t>& out) const {
+        const unsigned char* p = cdat + size_t(pos) * CDAT_WIDTH + ObjectId::RAW_SIZE;
+        uint32_t first = get_be32(p);
+        uint32_t second = get_be32(p + 4);
+        if (first == PARENT_NONE) return;
+        out.push_back(checked(first));
+        if (second == PARENT_NONE) return;
+        if (!(second & PARENT_EDGE)) {
+            out.push_back(checked(second));
+            return;
+        }
+        for (uint32_t i = second & ~PARENT_EDGE;; i++) {
+            if (i >= edge_count) throw std::runtime_error("Corrupt commit-graph: EDGE index out of range");
+            uint32_t edge = get_be32(edges + size_t(i) * 4);
+            out.push_back(checked(edge & ~PARENT_EDGE));
+            if (edge & PARENT_EDGE) break;
+        }
+    }
+
+private:
+    MappedFile map;
+    const unsigned char* fanout = nullptr;
+    const unsigned char* oids = nullptr;
+    const unsigned char* cdat = nullptr;
+    const unsigned char* edges = nullptr;
+    uint32_t count = 0;
+    uint32_t edge_count = 0;
+
+    uint32_t checked(uint32_t pos) const {
+        if (pos >= count) throw std::runtime_error("Corrupt commit-graph: parent position out of range");
+        return pos;
+    }
+};
+
+// every commit a walk can reach, by dense position. commits in the graph keep their graph position
+// and are answered from the mapped file; the rest (written since the graph, or all of them when
+// there is none) are parsed from the object store once, together with their ancestry down to the
+// graph, and appended after it. the graph is closed under ancestry, so only such new commits can
+// have a parent outside it. in a shallow repository the cut-off commits count as roots
+class CommitIndex {
+public:
+    explicit CommitIndex(ObjectDatabase& db, const std::filesystem::path& graph_file = COMMIT_GRAPH_FILE,
+                         const std::filesystem::path& shallow_file = SHALLOW_FILE)
+        : db(db), shallow(read_shallow(shallow_file)) {
+        has_graph = graph.open(graph_file);
+        base = has_graph ? graph.size() : 0;
+    }
+
+    bool graph_loaded() const { return has_graph; }
+    size_t size() const { return base + extra.size(); }
+    size_t parsed() const { return extra.size(); }
+
+    uint32_t lookup(const ObjectId& id) {
+        if (auto pos = find(id)) return *pos;
+        // post-order, so every parent has a position (and a generation) before its child
+        std::vector<std::pair<ObjectId, CommitInfo>> stack;
+        stack.emplace_back(id, read(id));
+        while (!stack.empty()) {
+            std::optional<ObjectId> missing;
+            for (const ObjectId& parent : stack.back().second.parents) {
+                if (!find(parent)) {
+                    missing = parent;
+                    break;
+                }
+            }
+            if (missing) {
+                stack.emplace_back(*missing, read(*missing));
+                continue;
+            }
+            auto [commit, info] = std::move(stack.back());
+            stack.pop_back();
+            Extra e;
+            e.id = commit;
+            e.tree = info.tree;
+            e.date = info.date;
+            e.generation = 1;
+            for (const ObjectId& parent : info.parents) {
+                uint32_t pos = *find(parent);
+                e.parents.push_back(pos);
+                e.generation = std::max(e.generation, std::min(generation(pos) + 1, CommitGraph::GENERATION_MAX));
+            }
+            extra_index[commit] = static_cast<uint32_t>(base + extra.size());
+            extra.push_back(std::move(e));
+        }
+        return *find(id);
+    }
+
+    std::optional<uint32_t> find(const ObjectId& id) const {
+        if (has_graph) {
+            if (auto pos = graph.find(id)) return pos;
+        }
+        auto it = extra_index.find(id);
+        if (it == extra_index.end()) return std::nullopt;
+        return it->second;
+    }
+
+    ObjectId id(uint32_t pos) const { return pos < base ? graph.id(pos) : extra[pos - base].id; }
+    ObjectId tree(uint32_t pos) const { return pos < base ? graph.tree(pos) : extra[pos - base].tree; }
+    uint32_t generation(uint32_t pos) const { return pos < base ? graph.generation(pos) : extra[pos - base].generation; }
+    int64_t date(uint32_t pos) const { return pos < base ? graph.date(pos) : extra[pos - base].date; }
+
+    // replaces out with pos's parents
+    void parents(uint32_t pos, std::vector<uint32_t>& out) const {
+        out.clear();
+        if (pos < base) graph.parents(pos, out);
+        else out = extra[pos - base].parents;
+    }
+
+private:
+    struct Extra {
+        ObjectId id;
+        ObjectId tree;
+        std::vector<uint32_t> parents;
+        uint32_t generation = 0;
+        int64_t date = 0;
+    };
+
+    ObjectDatabase& db;
+    CommitGraph graph;
+    bool has_graph = false;
+    uint32_t base = 0;
+    std::vector<Extra> extra;
+    std::unordered_map<ObjectId, uint32_t> extra_index;
+    std::unordered_set<ObjectId> shallow;
+
+    CommitInfo read(const ObjectId& id) {
+        ObjectDatabase::Object obj = db.read(id, "commit");
+        CommitInfo info = parse_commit(obj.bytes(), obj.size(), id);
+        if (shallow.count(id)) info.parents.clear();
+        return info;
+    }
+};
+
+// writes every commit reachable from the refs (plus everything an existing graph already holds)
+// and returns how many. commits already in the old graph are copied from it, so rewriting after a
+// few new commits parses only those. like git, a shallow repository gets none: its generation
+// numbers would change as soon as it is deepened
+size_t write_commit_graph(ObjectDatabase& db) {
+    TraceSpan span("commit-graph-write");
+    if (std::filesystem::exists(SHALLOW_FILE)) return 0;
+    CommitIndex commits(db);
+    for (const ObjectId& tip : list_ref_tips()) {
+        ObjectDatabase::Object obj = db.read(tip);
+        if (obj && (obj.type == "commit" || obj.type == "tag")) {
+            try {
+                commits.lookup(resolve_commit(db, tip.hex()));
+            } catch (const std::exception&) {
+                // a tag of a tree or blob has no place in the graph
+            }
+        }
+    }
+
+    // 1. Graph order is id order; remember where each commit lands
+    const size_t n = commits.size();
+    if (n == 0) return 0;
+    std::vector<uint32_t> order(n);
+    for (size_t i = 0; i < n; i++) order[i] = static_cast<uint32_t>(i);
+    std::vector<ObjectId> ids(n);
+    for (size_t i = 0; i < n; i++) ids[i] = commits.id(static_cast<uint32_t>(i));
+    std::sort(order.begin(), order.end(), [&ids](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+    std::vector<uint32_t> position(n);
+    for (size_t i = 0; i < n; i++) position[order[i]] = static_cast<uint32_t>(i);
+
+    // 2. Chunks
+    std::string oidf, oidl, cdat, edge;
+    uint32_t fan[256] = {0};
+    for (const ObjectId& id : ids) fan[id.bytes[0]]++;
+    for (int b = 1; b < 256; b++) fan[b] += fan[b - 1];
+    for (int b = 0; b < 256; b++) put_be32(oidf, fan[b]);
+    oidl.reserve(n * ObjectId::RAW_SIZE);
+    cdat.reserve(n * CommitGraph::CDAT_WIDTH);
+    std::vector<uint32_t> parents;
+    for (uint32_t pos : order) {
+        oidl.append(reinterpret_cast<const char*>(ids[pos].data()), ObjectId::RAW_SIZE);
+        cdat.append(reinterpret_cast<const char*>(commits.tree(pos).data()), ObjectId::RAW_SIZE);
+        commits.parents(pos, parents);
+        put_be32(cdat, parents.empty() ? CommitGraph::PARENT_NONE : position[parents[0]]);
+        if (parents.size() <= 2) {
+            put_be32(cdat, parents.size() < 2 ? CommitGraph::PARENT_NONE : position[parents[1]]);
+        } else {
+            put_be32(cdat, CommitGraph::PARENT_EDGE | static_cast<uint32_t>(edge.size() / 4));
+            for (size_t i = 1; i < parents.size(); i++) {
+                put_be32(edge, position[parents[i]] | (i + 1 == parents.size() ? CommitGraph::PARENT_EDGE : 0));
+            }
+        }
+        uint64_t date = static_cast<uint64_t>(std::clamp<int64_t>(commits.date(pos), 0, (int64_t(1) << 34) - 1));
+        put_be32(cdat, (commits.generation(pos) << 2) | static_cast<uint32_t>(date >> 32));
+        put_be32(cdat, static_cast<uint32_t>(date));
+    }
+
+    // 3. Header, chunk table, chunks, checksum
+    std::vector<std::pair<const char*, const std::string*>> chunks = {{"OIDF", &oidf}, {"OIDL", &oidl}, {"CDAT", &cdat}};
+    if (!edge.empty()) chunks.push_back({"EDGE", &edge});
+    std::string file("CGPH", 4);
+    file += {1, 1, static_cast<char>(chunks.size()), 0};
+    uint64_t offset = 8 + (chunks.size() + 1) * 12;
+    auto put_chunk_entry = [&file](const char* id, uint64_t offset) {
+        file.append(id, 4);
+        put_be32(file, static_cast<uint32_t>(offset >> 32));
+        put_be32(file, static_cast<uint32_t>(offset));
+    };
+    for (const auto& [id, data] : chunks) {
+        put_chunk_entry(id, offset);
+        offset += data->size();
+    }
+    put_chunk_entry("\0\0\0\0", offset);
+    for (const auto& chunk : chunks) file += *chunk.second;
+    unsigned char checksum[20];
+    SHA1(reinterpret_cast<const unsigned char*>(file.data()), file.size(), checksum);
+    file.append(reinterpret_cast<const char*>(checksum), 20);
+
+    std::filesystem::create_directories(COMMIT_GRAPH_FILE.parent_path());
+    std::filesystem::path tmp = COMMIT_GRAPH_FILE.string() + ".lock";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        f.write(file.data(), file.size());
+        if (!f) throw std::runtime_error("Failed to write " + tmp.string());
+    }
+    std::filesystem::rename(tmp, COMMIT_GRAPH_FILE);
+    return n;
+}
+
+// history walks
+// walks that decide reachability pop commits highest generation first (newest date first among
+// equals), so a commit comes off the queue only after every reachable commit that could be its
+// descendant. its flags are final by then, which is what lets a walk stop as soon as nothing left
+// in the queue can matter
+struct CommitQueue {
+    explicit CommitQueue(const CommitIndex& commits)
+        : heap([&commits](uint32_t a, uint32_t b) {
+              uint32_t ga = commits.generation(a), gb = commits.generation(b);
+              return ga != gb ? ga < gb : commits.date(a) < commits.date(b);
+          }) {}
+
+    std::priority_queue<uint32_t, std::vector<uint32_t>, std::function<bool(uint32_t, uint32_t)>> heap;
+};
+
+struct RevListOptions {
+    std::vector<ObjectId> include; // walk from these
+    std::vector<ObjectId> exclude; // ^rev / the left side of a..b: hide these and their ancestors
+    size_t max_count = SIZE_MAX;
+};
+
+// commits reachable from include but not from exclude, in git's default order (newest commit date
+// first among the commits whose children have all been shown)
+std::vector<uint32_t> rev_list(CommitIndex& commits, const RevListOptions& options) {
+    TraceSpan span("rev-list");
+    enum : uint8_t { SEEN = 1, UNINTERESTING = 2, SHOWN = 4 };
+    std::vector<uint32_t> tips;
+    for (const ObjectId& id : options.include) tips.push_back(commits.lookup(id));
+    std::vector<uint32_t> hidden;
+    for (const ObjectId& id : options.exclude) hidden.push_back(commits.lookup(id));
+
+    // everything reachable is known by now (tips load their ancestry), so flags fit in one array
+    std::vector<uint8_t> flags(commits.size(), 0);
+    std::vector<uint32_t> parents;
+
+    // 1. Hide everything the exclusions reach. the walk ends once every queued commit is hidden:
+    //    whatever lies below them is hidden too, and the output walk never descends past them
+    if (!hidden.empty()) {
+        CommitQueue queue(commits);
+        size_t interesting = 0; // queued commits not yet known to be hidden
+        for (uint32_t pos : hidden) flags[pos] |= UNINTERESTING;
+        for (uint32_t pos : tips) {
+            if (flags[pos] & SEEN) continue;
+            flags[pos] |= SEEN;
+            if (!(flags[pos] & UNINTERESTING)) interesting++;
+            queue.heap.push(pos);
+        }
+        for (uint32_t pos : hidden) {
+            if (flags[pos] & SEEN) continue;
+            flags[pos] |= SEEN;
+            queue.heap.push(pos);
+        }
+        while (interesting > 0) {
+            uint32_t pos = queue.heap.top();
+            queue.heap.pop();
+            bool hide = flags[pos] & UNINTERESTING;
+            if (!hide) interesting--;
+            commits.parents(pos, parents);
+            for (uint32_t parent : parents) {
+                uint8_t& f = flags[parent];
+                if (!(f & SEEN)) {
+                    f |= SEEN | (hide ? UNINTERESTING : 0);
+                    if (!hide) interesting++;
+                    queue.heap.push(parent);
+                } else if (hide && !(f & UNINTERESTING)) {
+                    f |= UNINTERESTING; // still queued: nothing of lower generation has been popped yet
+                    interesting--;
+                }
+            }
+        }
+    }
+
+    // 2. Output in commit date order, ties first come first served
+    using Entry = std::pair<int64_t, uint64_t>; // (date, -arrival)
+    std::priority_queue<std::pair<Entry, uint32_t>> queue;
+    uint64_t arrivals = 0;
+    auto push = [&](uint32_t pos) {
+        if (flags[pos] & (SHOWN | UNINTERESTING)) return;
+        flags[pos] |= SHOWN;
+        queue.push({{commits.date(pos), ~arrivals++}, pos});
+    };
+    for (uint32_t pos : tips) push(pos);
+    std::vector<uint32_t> out;
+    while (!queue.empty() && out.size() < options.max_count) {
+        uint32_t pos = queue.top().second;
+        queue.pop();
+        out.push_back(pos);
+        commits.parents(pos, parents);
+        for (uint32_t parent : parents) push(parent);
+    }
+    return out;
+}
+
+// is a an ancestor of (or the same as) b: a depth-first search from b that never descends below
+// a's generation
+bool is_ancestor(CommitIndex& commits, const ObjectId& a, const ObjectId& b) {
+    uint32_t target = commits.lookup(a);
+    uint32_t from = commits.lookup(b);
+    uint32_t floor = commits.generation(target);
+    std::vector<bool> seen(commits.size(), false);
+    std::vector<uint32_t> stack = {from};
+    std::vector<uint32_t> parents;
+    seen[from] = true;
+    while (!stack.empty()) {
+        uint32_t pos = stack.back();
+        stack.pop_back();
+        if (pos == target) return true;
+        commits.parents(pos, parents);
+        for (uint32_t parent : parents) {
+            if (seen[parent] || commits.generation(parent) < floor) continue;
+            seen[parent] = true;
+            stack.push_back(parent);
+        }
+    }
+    return false;
+}
+
+// the best common ancestors of a and b: common ancestors none of which is an ancestor of another,
+// highest generation first. ancestry of a and of b is painted down together; a commit reached from
+// both is a result and stales everything below it, and the walk ends once only stale commits remain
+std::vector<ObjectId> merge_bases(CommitIndex& commits, const ObjectId& a, const ObjectId& b) {
+    TraceSpan span("merge-base");
+    enum : uint8_t { FROM_A = 1, FROM_B = 2, STALE = 4, RESULT = 8 };
+    uint32_t pa = commits.lookup(a);
+    uint32_t pb = commits.lookup(b);
+    if (pa == pb) return {a};
+
+    std::vector<uint8_t> flags(commits.size(), 0);
+    CommitQueue queue(commits);
+    size_t active = 2; // queued commits that are not stale
+    flags[pa] = FROM_A;
+    flags[pb] = FROM_B;
+    queue.heap.push(pa);
+    queue.heap.push(pb);
+
+    std::vector<ObjectId> result;
+    std::vector<uint32_t> parents;
+    while (active > 0) {
+        uint32_t pos = queue.heap.top();
+        queue.heap.pop();
+        uint8_t paint = flags[pos] & (FROM_A | FROM_B | STALE);
+        if (!(paint & STALE)) active--;
+        if (paint == (FROM_A | FROM_B)) {
+            flags[pos] |= RESULT;
+            result.push_back(commits.id(pos));
+            paint |= STALE;
+        }
+        commits.parents(pos, parents);
+        for (uint32_t parent : parents) {
+            uint8_t& f = flags[parent];
+            if ((f & paint) == paint) continue;
+            bool queued = f & (FROM_A | FROM_B);
+            bool was_active = queued && !(f & STALE);
+            f |= paint;
+            if (!queued) queue.heap.push(parent);
+            if (!was_active && !(f & STALE)) active++;
+            else if (was_active && (f & STALE)) active--;
+        }
+    }
+    return result;
+}
+
+// log output
+// "Mon Oct 14 09:30:00 2026 +0200" from a commit's "<seconds> <tz>", in the committer's zone
+std::string format_git_date(int64_t seconds, const std::string& tz) {
+    int offset = 0;
+    if (tz.size() == 5 && (tz[0] == '+' || tz[0] == '-')) {
+        offset = (std::stoi(tz.substr(1, 2)) * 60 + std::stoi(tz.substr(3, 2))) * 60;
+        if (tz[0] == '-') offset = -offset;
+    }
+    std::time_t local = static_cast<std::time_t>(seconds + offset);
+    std::tm tm{};
+    gmtime_r(&local, &tm);
+    char buf[64];
+    strftime(buf, sizeof(buf), "%a %b ", &tm);
+    std::string out = buf;
+    strftime(buf, sizeof(buf), "%H:%M:%S %Y ", &tm);
+    return out + std::to_string(tm.tm_mday) + " " + buf + tz;
+}
+
+// appends one commit in git log's medium (or --oneline) format
+void format_log_entry(const ObjectId& id, const ObjectDatabase::Object& commit, bool oneline, bool first, std::string& out) {
+    std::string_view text(commit.bytes(), commit.size());
+    size_t blank = text.find("\n\n");
+    std::string_view headers = text.substr(0, blank);
+    std::string_view message = blank == std::string_view::npos ? std::string_view() : text.substr(blank + 2);
+
+    if (oneline) {
+        out += id.hex().substr(0, 7);
+        out += ' ';
+        out += message.substr(0, message.find('\n'));
+        out += '\n';
+        return;
+    }
+
+    std::string merge, author, date;
+    size_t parent_count = 0;
+    for (size_t p = 0; p < headers.size();) {
+        size_t eol = std::min(headers.find('\n', p), headers.size());
+        std::string_view line = headers.substr(p, eol - p);
+        p = eol + 1;
+        if (line.rfind("parent ", 0) == 0) {
+            merge += ' ';
+            merge += line.substr(7, 7);
+            parent_count++;
+        }
+        if (line.rfind("author ", 0) != 0) continue;
+        // "author Name <email> <seconds> <tz>"
+        size_t gt = line.rfind('>');
+        if (gt == std::string_view::npos) continue;
+        author = std::string(line.substr(7, gt + 1 - 7));
+        std::istringstream when{std::string(line.substr(gt + 1))};
+        int64_t seconds = 0;
+        std::string tz;
+        when >> seconds >> tz;
+        date = format_git_date(seconds, tz);
+    }
+
+    if (!first) out += '\n';
+    out += "commit " + id.hex() + "\n";
+    if (parent_count > 1) out += "Merge:" + merge + "\n";
+    out += "Author: " + author + "\n";
+    out += "Date:   " + date + "\n\n";
+    while (!message.empty() && message.back() == '\n') message.remove_suffix(1);
+    for (size_t p = 0; p <= message.size();) {
+        size_t eol = std::min(message.find('\n', p), message.size());
+        std::string_view line = message.substr(p, eol - p);
+        out += "    ";
+        out += line;
+        out += '\n';
+        p = eol + 1;
+    }
+}
+
+// ---- Smart HTTP transport (clone) ----
+
+struct GitPacket {
+    int length;
+    std::string data;
+};
+
+// pkt-line framing: 4 hex digits of total length (payload + 4), then the payload
+std::string pkt_line(const std::string& payload) {
+    char len[5];
+    snprintf(len, sizeof(len), "%04x", static_cast<unsigned>(payload.size() + 4));
+    return len + payload;
+}
+
+// helper function to read pkt-line formatted data
+std::vector<GitPacket> parsePktLines(const std::string& buffer) {
+    std::vector<GitPacket> packets;
+    size_t offset = 0;
+
+    while (offset + 4 <= buffer.length()) {
+        // 1. Read the 4-character hex length
+        int len = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = buffer[offset + i];
+            int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+            if (digit < 0) throw std::runtime_error("Malformed pkt-line length");
+            len = len * 16 + digit;
+        }
+
+        // Handle special "Flush Packet" (0000)
+        if (len == 0) {
+            packets.push_back({0, ""});
+            offset += 4;
+            continue;
+        }
+        if (len < 4 || offset + len > buffer.length()) throw std::runtime_error("Malformed pkt-line");
+
+        // 2. Extract the data 
+        packets.push_back({len, buffer.substr(offset + 4, len - 4)});
+
+        // 3. Move the offset to the start of the next packet
+        offset += len;
+    }
+    return packets;
+}
+
+// function to extract the target hash (HEAD) from parsed packets
+std::string getTargetHash(const std::vector<GitPacket>& packets) {
+    for (const auto& pkt : packets) {
+        // Skip the service header and flush packets
+        if (pkt.data.empty() || pkt.data[0] == '#') continue;
+
+        // The first real ref line usually contains "HEAD"
+        // Format: "SHA-1 name\0capabilities" or "SHA-1 name"
+        size_t spacePos = pkt.data.find(' ');
+        if (spacePos != std::string::npos) {
+            std::string hash = pkt.data.substr(0, spacePos);
+            std::string ref = pkt.data.substr(spacePos + 1);
+
+            if (ref.find("HEAD") != std::string::npos) {
+                return hash; // Found it!
+            }
+        }
+    }
+    return "";
+}
+
+// branch HEAD points to, from the "symref=HEAD:refs/heads/<name>" capability
+std::string getHeadBranch(const std::vector<GitPacket>& packets) {
+    const std::string key = "symref=HEAD:refs/heads/";
+    for (const auto& pkt : packets) {
+        size_t pos = pkt.data.find(key);
+        if (pos == std::string::npos) continue;
+        pos += key.size();
+        size_t end = pkt.data.find_first_of(" \n", pos);
+        return pkt.data.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    }
+    return "main";
+}
+
+// This callback function is called by libcurl as soon as there is data received
+// use -> to save response data into a std::string
+size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* userp) {
+    size_t totalSize = size * nmemb;
+    userp->append((char*)contents, totalSize);
+    return totalSize;
+}
+
+// protocol v2 is requested with this header on every request; a server that only speaks v0 ignores it
+const char* const GIT_PROTOCOL_V2_HEADER = "Git-Protocol: version=2";
+
+// Function to perform HTTP GET request
+std::string performGetRequest(const std::string& url, const std::vector<std::string>& extraHeaders = {}) {
+    std::string readBuffer;
+    CURL* curl = curl_easy_init();
+    if (!curl) throw std::runtime_error("curl_easy_init() failed");
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    // Follow redirects (important for some Git hosting providers)
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    struct curl_slist* headers = NULL;
+    for (const auto& h : extraHeaders) headers = curl_slist_append(headers, h.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    // Send the output to our WriteCallback function
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
+
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+    if (res != CURLE_OK) {
+        throw std::runtime_error(std::string("GET ") + url + " failed: " + curl_easy_strerror(res));
+    }
+    return readBuffer;
+}
+
+// side-band demultiplexer
+// an incremental pkt-line parser for the upload-pack response. packets may be split anywhere across
+// curl callbacks, so only the 4-byte length and small negotiation lines are ever buffered: channel 1
+// payload goes to on_pack as it arrives, channel 2 (progress) to stderr, channel 3 is a fatal error.
+// text lines (ACK/NAK, v2 section headers, ls-refs and shallow-info lines) go to on_line without
+// their newline; v2's delimiter and response-end packets are skipped like flushes
+class SideBandDemuxer {
+public:
+    explicit SideBandDemuxer(std::function<void(const unsigned char*, size_t)> on_pack)
+        : on_pack(std::move(on_pack)) {}
+
+    std::exception_ptr error; // set by the curl callback, which must not throw
+    std::function<void(const std::string&)> on_line;
+
+    void feed(const unsigned char* data, size_t n) {
+        while (n > 0) {
+            switch (state) {
+            case State::Length: {
+                size_t take = std::min(n, 4 - length.size());
+                length.append(reinterpret_cast<const char*>(data), take);
+                data += take;
+                n -= take;
+                if (length.size() < 4) break;
+                remaining = std::stoul(length, nullptr, 16);
+                length.clear();
+                if (remaining <= 2) break; // flush, delimiter or response-end packet
+                if (remaining < 5) throw std::runtime_error("Malformed pkt-line in upload-pack response");
+                remaining -= 4;
+                state = State::Start;
+                break;
+            }
+            case State::Start: {
+                // side-band packets start with their channel byte, negotiation lines with text
+                channel = *data;
+                if (channel >= 1 && channel <= 3) {
+                    data++;
+                    n--;
+                    remaining--;
+                } else {
+                    channel = 0;
+                }
+                line.clear();
+                state = remaining ? State::Payload : State::Length;
+                break;
+            }
+            case State::Payload: {
+                size_t take = std::min(n, remaining);
+                if (channel == 1) {
+                    on_pack(data, take);
+                } else if (channel == 2) {
+                    std::cerr.write(reinterpret_cast<const char*>(data), take);
+                } else {
+                    line.append(reinterpret_cast<const char*>(data), take);
+                    if (line.size() > 65536) throw std::runtime_error("Malformed upload-pack response");
+                }
+                data += take;
+                n -= take;
+                remaining -= take;
+                if (remaining == 0) {
+                    end_packet();
+                    state = State::Length;
+                }
+                break;
+            }
+            }
+        }
+    }
+
+private:
+    enum class State { Length, Start, Payload };
+
+    std::function<void(const unsigned char*, size_t)> on_pack;
+    State state = State::Length;
+    std::string length;
+    size_t remaining = 0;
+    int channel = 0;
+    std::string line;
+
+    void end_packet() {
+        if (channel == 3) throw std::runtime_error("remote error: " + line);
+        if (channel != 0) return;
+        if (line.compare(0, 4, "ERR ") == 0) throw std::runtime_error("remote error: " + line.substr(4));
+        if (!line.empty() && line.back() == '\n') line.pop_back();
+        if (on_line) on_line(line);
+    }
+};
+
+// curl hands the response over in arbitrary slices; they go straight into the demuxer
+size_t SideBandCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    auto* demux = static_cast<SideBandDemuxer*>(userp);
+    try {
+        demux->feed(static_cast<const unsigned char*>(contents), size * nmemb);
+    } catch (...) {
+        demux->error = std::current_exception();
+        return 0; // aborts the transfer
+    }
+    return size * nmemb;
+}
+
+// POSTs a request to <url>/git-upload-pack; the response goes to the demuxer as it downloads
+void postUploadPack(const std::string& repoUrl, const std::string& body, bool v2, SideBandDemuxer& demux) {
+    CURL* curl = curl_easy_init();
+    if (!curl) throw std::runtime_error("curl_easy_init() failed");
+
+    std::string url = repoUrl + "/git-upload-pack";
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, body.length());
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+
+    // Set Headers (Git servers are picky about these)
+    struct curl_slist* headers = NULL;
+    headers = curl_slist_append(headers, "Content-Type: application/x-git-upload-pack-request");
+    headers = curl_slist_append(headers, "Accept: application/x-git-upload-pack-result");
+    if (v2) headers = curl_slist_append(headers, GIT_PROTOCOL_V2_HEADER);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, SideBandCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &demux);
+
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+
+    if (demux.error) std::rethrow_exception(demux.error);
+    if (res != CURLE_OK) throw std::runtime_error(std::string("POST ") + url + " failed: " + curl_easy_strerror(res));
+}
+
+//Post request to negotiate packfile (protocol v0)
+// the response is demultiplexed and indexed while it downloads, so memory stays flat for any pack size
+void negotiatePackfile(const std::string& repoUrl, const std::string& targetHash, PackIndexer& indexer) {
+    TraceSpan span("fetch-pack");
+    // Construct the body in pkt-line format: one want with our capabilities, flush, done
+    std::string body = pkt_line("want " + targetHash + " side-band-64k ofs-delta\n") + "0000" + pkt_line("done\n");
+    SideBandDemuxer demux([&indexer](const unsigned char* data, size_t n) { indexer.feed(data, n); });
+    postUploadPack(repoUrl, body, false, demux);
+}
+
+// ---- protocol v2 ----
+// asked for with the Git-Protocol header, a v2 server answers info/refs with its capabilities
+// instead of its refs. each request is then one command: "command=<name>", capabilities, a
+// delimiter packet (0001) and the command's arguments. ls-refs lists only the refs a client asks
+// for, fetch takes the wants plus "deepen <n>" (shallow) and "filter <spec>" (partial clone)
+
+// capability -> value, e.g. "fetch" -> "shallow filter"; empty when the server answered in v0
+std::map<std::string, std::string> parse_v2_capabilities(const std::vector<GitPacket>& packets) {
+    std::map<std::string, std::string> capabilities;
+    bool v2 = false;
+    for (const auto& pkt : packets) {
+        std::string line = pkt.data;
+        if (!line.empty() && line.back() == '\n') line.pop_back();
+        if (line == "version 2") {
+            v2 = true;
+        } else if (v2 && !line.empty()) {
+            size_t eq = line.find('=');
+            capabilities[line.substr(0, eq)] = eq == std::string::npos ? "" : line.substr(eq + 1);
+        }
+    }
+    return capabilities;
+}
+
+std::string v2_request(const std::string& command, const std::vector<std::string>& arguments) {
+    std::string body = pkt_line("command=" + command + "\n") + pkt_line("agent=proto_git/1.0\n") +
+                       pkt_line("object-format=sha1\n") + "0001";
+    for (const auto& argument : arguments) body += pkt_line(argument + "\n");
+    return body + "0000";
+}
+
+struct RemoteRef {
+    std::string name;
+    ObjectId id;
+    std::string symref_target;      // where a symref (HEAD) points
+    std::optional<ObjectId> peeled; // what an annotated tag points at
+};
+
+// ls-refs: the remote's refs that start with one of the prefixes (every ref when there are none)
+std::vector<RemoteRef> ls_refs(const std::string& url, const std::vector<std::string>& prefixes) {
+    std::vector<std::string> arguments = {"symrefs", "peel"};
+    for (const auto& prefix : prefixes) arguments.push_back("ref-prefix " + prefix);
+    std::vector<RemoteRef> refs;
+    SideBandDemuxer demux([](const unsigned char*, size_t) {
+        throw std::runtime_error("Unexpected side-band data in ls-refs response");
+    });
+    // "<id> <name>[ symref-target:<ref>][ peeled:<id>]"
+    demux.on_line = [&refs](const std::string& line) {
+        std::istringstream words(line);
+        std::string hex, word;
+        RemoteRef ref;
+        if (!(words >> hex >> ref.name) || !ObjectId::parse(hex, ref.id)) {
+            throw std::runtime_error("Malformed ls-refs line: " + line);
+        }
+        while (words >> word) {
+            ObjectId peeled;
+            if (word.rfind("symref-target:", 0) == 0) ref.symref_target = word.substr(14);
+            else if (word.rfind("peeled:", 0) == 0 && ObjectId::parse(word.substr(7), peeled)) ref.peeled = peeled;
+        }
+        refs.push_back(std::move(ref));
+    };
+    postUploadPack(url, v2_request("ls-refs", arguments), true, demux);
+    return refs;
+}
+
+// object filters for partial clones: blobs of at least the returned size stay on the server
+// ("blob:none" is a limit of 0). "blob:limit=<n>" takes a k, m or g suffix like git's
+uint64_t parse_blob_filter(const std::string& spec) {
+    if (spec == "blob:none") return 0;
+    const std::string prefix = "blob:limit=";
+    if (spec.rfind(prefix, 0) == 0 && spec.size() > prefix.size() && std::isdigit(static_cast<unsigned char>(spec[prefix.size()]))) {
+        size_t used = 0;
+        uint64_t limit = std::stoull(spec.substr(prefix.size()), &used);
+        std::string unit = spec.substr(prefix.size() + used);
+        if (unit == "k" || unit == "K") return limit << 10;
+        if (unit == "m" || unit == "M") return limit << 20;
+        if (unit == "g" || unit == "G") return limit << 30;
+        if (unit.empty()) return limit;
+    }
+    throw std::runtime_error("Unsupported object filter '" + spec + "' (use blob:none or blob:limit=<n>[kmg])");
+}
+
+// what a v2 fetch asks for
+struct FetchRequest {
+    std::vector<ObjectId> wants;
+    int depth = 0;       // deepen <n>: history cut n commits below the wants; 0 for all of it
+    std::string filter;  // "blob:none", "blob:limit=<n>" or empty
+    bool progress = true;
+};
+
+// v2 fetch with done, so no negotiation: the server answers with a shallow-info section when the
+// history is cut, then the pack. returns the commits it was cut at
+std::vector<ObjectId> fetch_pack_v2(const std::string& url, const FetchRequest& request, PackIndexer& indexer) {
+    TraceSpan span("fetch-pack");
+    std::vector<std::string> arguments = {"ofs-delta"};
+    if (!request.progress) arguments.push_back("no-progress");
+    for (const ObjectId& want : request.wants) arguments.push_back("want " + want.hex());
+    if (request.depth > 0) arguments.push_back("deepen " + std::to_string(request.depth));
+    if (!request.filter.empty()) arguments.push_back("filter " + request.filter);
+    arguments.push_back("done");
+
+    std::vector<ObjectId> shallow;
+    SideBandDemuxer demux([&indexer](const unsigned char* data, size_t n) { indexer.feed(data, n); });
+    demux.on_line = [&shallow](const std::string& line) {
+        ObjectId id;
+        if (line.rfind("shallow ", 0) == 0 && ObjectId::parse(line.substr(8), id)) shallow.push_back(id);
+    };
+    postUploadPack(url, v2_request("fetch", arguments), true, demux);
+    return shallow;
+}
+
+// partial clones: objects the filter left behind are fetched from the promisor remote the first
+// time something reads them, into a pack marked .promisor like the clone's own. clone records the
+// remote in the config: extensions.partialclone names it, remote.<name>.url says where it is
+void enable_lazy_fetch(ObjectDatabase& db, const std::filesystem::path& git_dir = ".git") {
+    std::optional<std::string> remote = read_config("extensions.partialclone", git_dir);
+    if (!remote) return;
+    std::optional<std::string> url = read_config("remote." + *remote + ".url", git_dir);
+    if (!url) throw std::runtime_error("Promisor remote '" + *remote + "' has no url");
+    std::filesystem::path pack_dir = git_dir / "objects" / "pack";
+    db.fetch_missing = [url = *url, pack_dir](const std::vector<ObjectId>& ids) {
+        TraceSpan span("lazy-fetch");
+        PackIndexer indexer(pack_dir, default_jobs());
+        FetchRequest request;
+        request.wants = ids;
+        request.progress = false;
+        fetch_pack_v2(url, request, indexer);
+        std::string pack = indexer.finish();
+        std::ofstream(pack_dir / ("pack-" + pack + ".promisor"));
+    };
+}
+
+ObjectId getTreeShaFromCommit(ObjectDatabase& db, const ObjectId& commitSha) {
+    ObjectDatabase::Object commit = db.read(commitSha);
+    if (!commit || commit.type != "commit") throw std::runtime_error("Commit " + commitSha.hex() + " not found");
+    // The first line is "tree <sha>"
+    ObjectId tree;
+    if (commit.size() >= 45 && memcmp(commit.bytes(), "tree ", 5) == 0 &&
+        ObjectId::parse(commit.bytes() + 5, ObjectId::HEX_SIZE, tree)) {
+        return tree;
+    }
+    throw std::runtime_error("Could not find tree SHA in commit object");
+}
+
+// ls-tree
+// one line per entry, depth first in tree order; -r descends into subtrees instead of listing them,
+// -l adds blob sizes, --name-only prints just the path. lines are built in one reused buffer
+struct LsTreeOptions {
+    bool recursive = false;
+    bool long_format = false;
+    bool name_only = false;
+};
+
+void ls_tree(ObjectDatabase& db, const ObjectId& tree_id, std::string& prefix, const LsTreeOptions& options, std::string& out) {
+    ObjectDatabase::Object tree = db.read(tree_id, "tree");
+    for (const TreeView::Entry& e : TreeView(*tree.data, tree_id)) {
+        // 1. Subtrees are walked in place of their own line
+        if (options.recursive && e.is_tree()) {
+            size_t prefix_size = prefix.size();
+            prefix.append(e.name).push_back('/');
+            ls_tree(db, e.id(), prefix, options, out);
+            prefix.resize(prefix_size);
+            continue;
+        }
+
+        // 2. "<mode> <type> <id>[ <size>]\t<path>", modes zero-padded to six digits as git prints them
+        if (!options.name_only) {
+            out.append(e.mode.size() < 6 ? 6 - e.mode.size() : 0, '0').append(e.mode);
+            out.append(1, ' ').append(e.type()).append(1, ' ');
+            size_t at = out.size();
+            out.resize(at + ObjectId::HEX_SIZE);
+            e.id().to_hex(&out[at]);
+            if (options.long_format) {
+                std::string size = "-";
+                if (!e.is_tree() && !e.is_gitlink()) {
+                    auto header = [&](const std::string&, size_t n) {
+                        size = std::to_string(n);
+                        return false;
+                    };
+                    if (!db.stream(e.id(), header, [](const char*, size_t) {})) {
+                        throw std::runtime_error("Object " + e.id().hex() + " not found");
+                    }
+                }
+                out.append(size.size() < 7 ? 8 - size.size() : 1, ' ').append(size);
+            }
+            out.push_back('\t');
+        }
+        out.append(prefix).append(e.name).push_back('\n');
+
+        if (out.size() >= BLOB_CHUNK_SIZE) {
+            std::cout.write(out.data(), out.size());
+            out.clear();
+        }
+    }
+}
+
+// ---- diff ----
+// tree diffs walk both trees in lockstep, entry by entry in tree order, and never open a subtree
+// whose id is the same on both sides: a change costs the directories on its path, not the size of
+// the snapshot. changed blobs get a Myers line diff in git's unified format
+
+// an entry that differs between the trees. the side where it does not exist has an empty mode and
+// the null id
+struct TreeChange {
+    char status; // A(dded), D(eleted), M(odified), T(ype changed: file, symlink, submodule)
+    std::string old_mode, new_mode;
+    ObjectId old_id, new_id;
+    std::string path;
+};
+
+// appends the changes between two trees (either may be the null id: an empty tree) under prefix.
+// with recursive, subtrees are compared in turn instead of being reported as changed
+void diff_trees(ObjectDatabase& db, const ObjectId& old_tree, const ObjectId& new_tree, std::string& prefix,
+                bool recursive, std::vector<TreeChange>& changes) {
+    if (old_tree == new_tree) return; // same id, same contents all the way down
+    TraceSpan span("diff-tree");
+    const ObjectId none;
+    ObjectDatabase::Object a, b;
+    if (old_tree != none) a = db.read(old_tree, "tree");
+    if (new_tree != none) b = db.read(new_tree, "tree");
+    TreeView old_view(a ? a.bytes() : nullptr, a ? a.size() : 0, old_tree);
+    TreeView new_view(b ? b.bytes() : nullptr, b ? b.size() : 0, new_tree);
+
+    auto i = old_view.begin(), j = new_view.begin();
+    while (i != old_view.end() || j != new_view.end()) {
+        // 1. Pair up the entries; a name on one side only is an add or a delete
+        int c = i == old_view.end() ? 1
+              : j == new_view.end() ? -1
+              : compare_tree_entries(i->name, i->is_tree(), j->name, j->is_tree());
+        const TreeView::Entry* old_entry = c <= 0 ? &*i : nullptr;
+        const TreeView::Entry* new_entry = c >= 0 ? &*j : nullptr;
+        const TreeView::Entry& entry = old_entry ? *old_entry : *new_entry;
+        bool same = old_entry && new_entry && old_entry->mode == new_entry->mode &&
+                    memcmp(old_entry->raw_id, new_entry->raw_id, ObjectId::RAW_SIZE) == 0;
+
+        // 2. Subtrees are descended into, everything else reported
+        if (same) {
+            // unchanged, subtree or not
+        } else if (recursive && entry.is_tree()) {
+            size_t prefix_size = prefix.size();
+            prefix.append(entry.name).push_back('/');
+            diff_trees(db, old_entry ? old_entry->id() : none, new_entry ? new_entry->id() : none, prefix, recursive, changes);
+            prefix.resize(prefix_size);
+        } else {
+            TreeChange change;
+            change.status = !old_entry ? 'A' : !new_entry ? 'D' : old_entry->mode.substr(0, 2) != new_entry->mode.substr(0, 2) ? 'T' : 'M';
+            if (old_entry) {
+                change.old_mode = std::string(old_entry->mode);
+                change.old_id = old_entry->id();
+            }
+            if (new_entry) {
+                change.new_mode = std::string(new_entry->mode);
+                change.new_id = new_entry->id();
+            }
+            change.path = prefix + std::string(entry.name);
+            changes.push_back(std::move(change));
+        }
+        if (c <= 0) ++i;
+        if (c >= 0) ++j;
+    }
+}
+
+// modes as git prints them: six digits, 000000 for a side that does not exist
+std::string format_mode(const std::string& mode) {
+    if (mode.empty()) return "000000";
+    return std::string(mode.size() < 6 ? 6 - mode.size() : 0, '0') + mode;
+}
+
+// line diff
+// lines are interned once (equal lines, trailing newline included, get equal numbers), so the
+// search compares integers. myers_diff marks the lines outside a longest common subsequence,
+// finding the middle snake of each range in linear space and recursing on both halves
+class LineDiff {
+public:
+    std::vector<std::string_view> old_lines, new_lines;
+    std::vector<char> deleted, inserted; // per old / new line
+
+    LineDiff(const char* a, size_t a_size, const char* b, size_t b_size) {
+        split(a, a_size, old_lines, old_ids);
+        split(b, b_size, new_lines, new_ids);
+        deleted.assign(old_lines.size(), 0);
+        inserted.assign(new_lines.size(), 0);
+        diff(0, old_ids.size(), 0, new_ids.size());
+        slide(old_ids, deleted);
+        slide(new_ids, inserted);
+    }
+
+private:
+    std::unordered_map<std::string_view, uint32_t> interned;
+    std::vector<uint32_t> old_ids, new_ids;
+    std::vector<int64_t> forward, backward;
+
+    void split(const char* data, size_t size, std::vector<std::string_view>& lines, std::vector<uint32_t>& ids) {
+        for (size_t at = 0; at < size;) {
+            const char* nl = static_cast<const char*>(memchr(data + at, '\n', size - at));
+            size_t end = nl ? nl - data + 1 : size;
+            std::string_view line(data + at, end - at);
+            lines.push_back(line);
+            ids.push_back(interned.emplace(line, static_cast<uint32_t>(interned.size())).first->second);
+            at = end;
+        }
+    }
+
+    void diff(size_t a0, size_t a1, size_t b0, size_t b1) {
+        // 1. Common prefix and suffix are not part of the problem
+        while (a0 < a1 && b0 < b1 && old_ids[a0] == new_ids[b0]) a0++, b0++;
+        while (a0 < a1 && b0 < b1 && old_ids[a1 - 1] == new_ids[b1 - 1]) a1--, b1--;
+        if (a0 == a1 || b0 == b1) {
+            std::fill(deleted.begin() + a0, deleted.begin() + a1, 1);
+            std::fill(inserted.begin() + b0, inserted.begin() + b1, 1);
+            return;
+        }
+
+        // 2. Split at the middle snake and solve both sides
+        auto [x, y] = middle_snake(a0, a1, b0, b1);
+        if ((x == a0 && y == b0) || (x == a1 && y == b1)) { // no common line at all
+            std::fill(deleted.begin() + a0, deleted.begin() + a1, 1);
+            std::fill(inserted.begin() + b0, inserted.begin() + b1, 1);
+            return;
+        }
+        diff(a0, x, b0, y);
+        diff(x, a1, y, b1);
+    }
+
+    // a point on an optimal edit path through the middle of [a0, a1) x [b0, b1): furthest reaching
+    // D-paths run from both corners, diagonal by diagonal, until they overlap
+    std::pair<size_t, size_t> middle_snake(size_t a0, size_t a1, size_t b0, size_t b1) {
+        const uint32_t* a = old_ids.data() + a0;
+        const uint32_t* b = new_ids.data() + b0;
+        const int64_t n = a1 - a0, m = b1 - b0;
+        const int64_t max_d = (n + m + 1) / 2, offset = max_d, delta = n - m;
+        const bool odd = delta & 1;
+        forward.assign(2 * max_d + 2, -1);
+        backward.assign(2 * max_d + 2, -1);
+        forward[offset + 1] = backward[offset + 1] = 0;
+        int64_t k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+        for (int64_t d = 0; d < max_d; d++) {
+            for (int64_t k = -d + k1_start; k <= d - k1_end; k += 2) {
+                int64_t x = k == -d || (k != d && forward[offset + k - 1] < forward[offset + k + 1])
+                          ? forward[offset + k + 1] : forward[offset + k - 1] + 1;
+                int64_t y = x - k;
+                while (x < n && y < m && a[x] == b[y]) x++, y++;
+                forward[offset + k] = x;
+                if (x > n) k1_end += 2;
+                else if (y > m) k1_start += 2;
+                else if (odd) {
+                    int64_t k2 = offset + delta - k;
+                    if (k2 >= 0 && k2 < 2 * max_d + 2 && backward[k2] != -1 && x >= n - backward[k2]) {
+                        return {a0 + x, b0 + y};
+                    }
+                }
+            }
+            for (int64_t k = -d + k2_start; k <= d - k2_end; k += 2) {
+                int64_t x = k == -d || (k != d && backward[offset + k - 1] < backward[offset + k + 1])
+                          ? backward[offset + k + 1] : backward[offset + k - 1] + 1;
+                int64_t y = x - k;
+                while (x < n && y < m && a[n - x - 1] == b[m - y - 1]) x++, y++;
+                backward[offset + k] = x;
+                if (x > n) k2_end += 2;
+                else if (y > m) k2_start += 2;
+                else if (!odd) {
+                    int64_t k1 = offset + delta - k;
+                    if (k1 >= 0 && k1 < 2 * max_d + 2 && forward[k1] != -1) {
+                        int64_t fx = forward[k1];
+                        if (fx >= n - x) return {a0 + fx, b0 + fx - (k1 - offset)};
+                    }
+                }
+            }
+        }
+        return {a0, b0};
+    }
+
+    // slides each run of changed lines as far down as it goes while keeping the same diff (a run
+    // followed by a copy of its first line can move past it), so inserted blocks line up the way
+    // git shows them
+    static void slide(const std::vector<uint32_t>& ids, std::vector<char>& changed) {
+        size_t n = ids.size();
+        for (size_t start = 0; start < n;) {
+            if (!changed[start]) {
+                start++;
+                continue;
+            }
+            size_t end = start;
+            while (end < n && changed[end]) end++;
+            while (end < n && ids[start] == ids[end]) {
+                changed[start++] = 0;
+                changed[end++] = 1;
+                while (end < n && changed[end]) end++; // merged into the next run
+            }
+            start = end;
+        }
+    }
+};
+
+const size_t DIFF_CONTEXT = 3;
+const size_t DIFF_BINARY_PROBE = 8000; // like git, a NUL in the first 8000 bytes makes a file binary
+
+// git's default hunk header context: the nearest line above the hunk that starts with a letter,
+// '_' or '$', cut to 80 bytes
+std::string_view hunk_function(const std::vector<std::string_view>& lines, size_t start) {
+    for (size_t i = start; i-- > 0;) {
+        std::string_view line = lines[i];
+        if (line.empty() || !(isalpha(static_cast<unsigned char>(line[0])) || line[0] == '_' || line[0] == '$')) continue;
+        line = line.substr(0, 80);
+        while (!line.empty() && isspace(static_cast<unsigned char>(line.back()))) line.remove_suffix(1);
+        return line;
+    }
+    return {};
+}
+
+// "@@ -<start>,<count> +<start>,<count> @@" ranges: 1-based, ",1" left out, and an empty range
+// names the line before it
+std::string hunk_range(size_t start, size_t count) {
+    if (count == 0) return std::to_string(start) + ",0";
+    if (count == 1) return std::to_string(start + 1);
+    return std::to_string(start + 1) + "," + std::to_string(count);
+}
+
+// unified hunks with DIFF_CONTEXT lines of context; changes closer than twice that share a hunk
+void write_hunks(const LineDiff& diff, std::string& out) {
+    struct Op {
+        char kind; // ' ', '-' or '+'
+        size_t a, b; // old and new line number at this op
+    };
+    std::vector<Op> ops;
+    for (size_t a = 0, b = 0; a < diff.old_lines.size() || b < diff.new_lines.size();) {
+        if (a < diff.old_lines.size() && diff.deleted[a]) ops.push_back({'-', a++, b});
+        else if (b < diff.new_lines.size() && diff.inserted[b]) ops.push_back({'+', a, b++});
+        else ops.push_back({' ', a++, b++});
+    }
+
+    for (size_t k = 0; k < ops.size();) {
+        while (k < ops.size() && ops[k].kind == ' ') k++;
+        if (k == ops.size()) break;
+        size_t start = k > DIFF_CONTEXT ? k - DIFF_CONTEXT : 0, end = k;
+        for (;;) {
+            while (end < ops.size() && ops[end].kind != ' ') end++;
+            size_t next = end;
+            while (next < ops.size() && ops[next].kind == ' ') next++;
+            if (next == ops.size() || next - end > 2 * DIFF_CONTEXT) break;
+            end = next;
+        }
+        size_t stop = std::min(ops.size(), end + DIFF_CONTEXT);
+
+        size_t old_count = 0, new_count = 0;
+        for (size_t i = start; i < stop; i++) {
+            old_count += ops[i].kind != '+';
+            new_count += ops[i].kind != '-';
+        }
+        out += "@@ -" + hunk_range(ops[start].a, old_count) + " +" + hunk_range(ops[start].b, new_count) + " @@";
+        std::string_view function = hunk_function(diff.old_lines, ops[start].a);
+        if (!function.empty()) out.append(1, ' ').append(function);
+        out.push_back('\n');
+        for (size_t i = start; i < stop; i++) {
+            std::string_view line = ops[i].kind == '+' ? diff.new_lines[ops[i].b] : diff.old_lines[ops[i].a];
+            out.append(1, ops[i].kind).append(line);
+            if (line.back() != '\n') out += "\n\\ No newline at end of file\n";
+        }
+        k = stop;
+    }
+}
+
+// a blob's content for the diff; a submodule is shown as the commit it points at
+std::shared_ptr<const std::vector<char>> diff_content(ObjectDatabase& db, const std::string& mode, const ObjectId& id) {
+    if (mode.empty()) return std::make_shared<std::vector<char>>();
+    if (mode == "160000") {
+        std::string text = "Subproject commit " + id.hex() + "\n";
+        return std::make_shared<std::vector<char>>(text.begin(), text.end());
+    }
+    return db.read(id, "blob").data;
+}
+
+// one file's "diff --git" section: the header lines git prints, then hunks or a binary notice
+void write_patch(ObjectDatabase& db, const TreeChange& change, std::string& out) {
+    // 1. A type change is a deletion and an addition
+    if (change.status == 'T') {
+        TreeChange removed = change, added = change;
+        removed.status = 'D';
+        removed.new_mode.clear();
+        removed.new_id = ObjectId();
+        added.status = 'A';
+        added.old_mode.clear();
+        added.old_id = ObjectId();
+        write_patch(db, removed, out);
+        write_patch(db, added, out);
+        return;
+    }
+
+    // 2. Header
+    const std::string& path = change.path;
+    out += "diff --git a/" + path + " b/" + path + "\n";
+    if (change.status == 'A') out += "new file mode " + format_mode(change.new_mode) + "\n";
+    else if (change.status == 'D') out += "deleted file mode " + format_mode(change.old_mode) + "\n";
+    else if (change.old_mode != change.new_mode) {
+        out += "old mode " + format_mode(change.old_mode) + "\nnew mode " + format_mode(change.new_mode) + "\n";
+    }
+    if (change.old_id == change.new_id) return; // a mode change alone
+    out += "index " + change.old_id.hex().substr(0, 7) + ".." + change.new_id.hex().substr(0, 7);
+    if (change.status == 'M' && change.old_mode == change.new_mode) out += " " + format_mode(change.new_mode);
+    out.push_back('\n');
+
+    // 3. Hunks, or a notice for binary content
+    auto a = diff_content(db, change.old_mode, change.old_id);
+    auto b = diff_content(db, change.new_mode, change.new_id);
+    std::string old_name = change.old_mode.empty() ? "/dev/null" : "a/" + path;
+    std::string new_name = change.new_mode.empty() ? "/dev/null" : "b/" + path;
+    auto binary = [](const std::vector<char>& data) {
+        return !data.empty() && memchr(data.data(), '\0', std::min(data.size(), DIFF_BINARY_PROBE)) != nullptr;
+    };
+    if (binary(*a) || binary(*b)) {
+        out += "Binary files " + old_name + " and " + new_name + " differ\n";
+        return;
+    }
+    if (a->empty() && b->empty()) return;
+    LineDiff diff(a->data(), a->size(), b->data(), b->size());
+    out += "--- " + old_name + "\n+++ " + new_name + "\n";
+    write_hunks(diff, out);
+}
+
+enum class DiffFormat { Raw, NameOnly, NameStatus, Patch };
+
+// the changes as git's diff-tree and diff print them. a patch reads every blob it shows, so a
+// partial clone fetches the missing ones in one batch first
+void write_tree_changes(ObjectDatabase& db, const std::vector<TreeChange>& changes, DiffFormat format, std::string& out) {
+    if (format == DiffFormat::Patch) {
+        std::vector<ObjectId> blobs;
+        for (const TreeChange& change : changes) {
+            if (!change.old_mode.empty() && change.old_mode != "160000") blobs.push_back(change.old_id);
+            if (!change.new_mode.empty() && change.new_mode != "160000") blobs.push_back(change.new_id);
+        }
+        db.prefetch(blobs);
+    }
+    for (const TreeChange& change : changes) {
+        switch (format) {
+        case DiffFormat::Raw:
+            out += ":" + format_mode(change.old_mode) + " " + format_mode(change.new_mode) + " " + change.old_id.hex() +
+                   " " + change.new_id.hex() + " " + change.status + "\t" + change.path + "\n";
+            break;
+        case DiffFormat::NameOnly:
+            out += change.path + "\n";
+            break;
+        case DiffFormat::NameStatus:
+            out += std::string(1, change.status) + "\t" + change.path + "\n";
+            break;
+        case DiffFormat::Patch:
+            write_patch(db, change, out);
+            break;
+        }
+        if (out.size() >= BLOB_CHUNK_SIZE) {
+            std::cout.write(out.data(), out.size());
+            out.clear();
+        }
+    }
+}
+
+// a tree-ish: a tree id, or a revision (its commit's root tree)
+ObjectId resolve_tree(ObjectDatabase& db, const std::string& name) {
+    ObjectId id;
+    if (ObjectId::parse(name, id)) {
+        ObjectDatabase::Object obj = db.read(id);
+        if (obj && obj.type == "tree") return id;
+    }
+    return getTreeShaFromCommit(db, resolve_commit(db, name));
+}
+
+// parallel checkout
+// the trees are walked first into a complete list of directories and files; all directories are
+// created up front (parents before children), so the workers only ever create files. each worker
+// streams blobs through its own ObjectDatabase straight into the file, a batch of files per task.
+// with io_uring a task preloads its batch's loose blobs, inflates the small ones into memory and
+// creates, writes and closes those files a batch of operations at a time
+const size_t CHECKOUT_BATCH = 32;
+const size_t CHECKOUT_BUFFER_MAX = 1024 * 1024;
+
+struct CheckoutFile {
+    std::filesystem::path path;
+    ObjectId id;
+    std::string mode;
+};
+
+void checkout_tree(const ObjectId& tree_id, const std::filesystem::path& root, size_t jobs) {
+    TraceSpan span("checkout");
+    // 1. Walk the trees
+    ObjectDatabase db;
+    std::vector<std::filesystem::path> dirs;
+    std::vector<CheckoutFile> files;
+    std::vector<std::pair<ObjectId, std::filesystem::path>> pending{{tree_id, root}};
+    while (!pending.empty()) {
+        auto [id, dir] = pending.back();
+        pending.pop_back();
+        ObjectDatabase::Object tree = db.read(id);
+        if (!tree || tree.type != "tree") throw std::runtime_error("Tree " + id.hex() + " not found");
+        const std::vector<char>& content = *tree.data;
+        for (const TreeView::Entry& e : TreeView(content, id)) {
+            if (e.name.empty() || e.name == "." || e.name == ".." || e.name == ".git" ||
+                e.name.find('/') != std::string_view::npos) {
+                throw std::runtime_error("Refusing to check out unsafe path '" + std::string(e.name) + "' in tree " + id.hex());
+            }
+
+            std::filesystem::path path = dir / e.name;
+            if (e.is_tree()) {
+                dirs.push_back(path);
+                pending.emplace_back(e.id(), path);
+            } else if (e.is_gitlink()) {
+                dirs.push_back(path); // a submodule is checked out as an empty directory
+            } else {
+                files.push_back({path, e.id(), std::string(e.mode)});
+            }
+        }
+    }
+
+    // 2. Directories, parents first (the walk lists each directory before anything inside it)
+    for (const auto& d : dirs) std::filesystem::create_directory(d);
+
+    // a partial clone downloads the blobs it lacks now, in a few large batches
+    enable_lazy_fetch(db);
+    std::vector<ObjectId> blobs;
+    blobs.reserve(files.size());
+    for (const auto& f : files) blobs.push_back(f.id);
+    db.prefetch(blobs);
+
+    // 3. Blobs, written concurrently; one ObjectDatabase per worker since it keeps inflate state
+    ThreadPool pool(jobs);
+    std::vector<std::unique_ptr<ObjectDatabase>> readers;
+    for (size_t i = 0; i < pool.size(); i++) readers.push_back(std::make_unique<ObjectDatabase>());
+
+    std::mutex mutex;
+    std::condition_variable idle;
+    size_t in_flight = 0;
+    std::exception_ptr error;
+
+    // writes f, unless buffer is given and the blob is small enough: then its content is left
+    // there for a batched write and true is returned
+    auto write_file = [&](const CheckoutFile& f, std::vector<char>* buffer) {
+        ObjectDatabase& reader = *readers[ThreadPool::current_worker()];
+
+        if (f.mode == "120000") { // symlink: the blob is the target path
+            ObjectDatabase::Object blob = reader.read(f.id, "blob");
+            std::string target(blob.bytes(), blob.size());
+            if (symlink(target.c_str(), f.path.c_str()) != 0) {
+                throw std::runtime_error("Failed to create symlink " + f.path.string() + ": " + strerror(errno));
+            }
+            return false;
+        }
+
+        int fd = -1;
+        bool buffered = false;
+        try {
+            auto on_header = [&](const std::string& type, size_t size) {
+                if (type != "blob") throw std::runtime_error("Object " + f.id.hex() + " is a " + type + ", not a blob");
+                if (buffer && size <= CHECKOUT_BUFFER_MAX) {
+                    buffered = true;
+                    buffer->reserve(size);
+                    return true;
+                }
+                fd = open(f.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, f.mode == "100755" ? 0777 : 0666);
+                if (fd < 0) throw std::runtime_error("Failed to create " + f.path.string() + ": " + strerror(errno));
+                return true;
+            };
+            auto on_data = [&](const char* data, size_t n) {
+                if (buffered) buffer->insert(buffer->end(), data, data + n);
+                else write_all(fd, data, n, f.path.string());
+            };
+            if (!reader.stream(f.id, on_header, on_data)) {
+                throw std::runtime_error("Blob " + f.id.hex() + " not found");
+            }
+        } catch (...) {
+            if (fd >= 0) close(fd);
+            throw;
+        }
+        if (fd >= 0) close(fd);
+        return buffered;
+    };
+
+    bool batched = IoEngine::uring_enabled();
+    auto write_batch = [&](size_t begin, size_t end) {
+        if (!batched) {
+            for (size_t i = begin; i < end; i++) write_file(files[i], nullptr);
+            return;
+        }
+        std::vector<ObjectId> ids;
+        for (size_t i = begin; i < end; i++) ids.push_back(files[i].id);
+        readers[ThreadPool::current_worker()]->preload(ids);
+
+        std::vector<std::vector<char>> contents(end - begin);
+        std::vector<FileWrite> writes;
+        for (size_t i = begin; i < end; i++) {
+            std::vector<char>& content = contents[i - begin];
+            if (write_file(files[i], &content)) {
+                writes.push_back({files[i].path.string(), content.data(), content.size(), O_CREAT | O_TRUNC,
+                                  static_cast<mode_t>(files[i].mode == "100755" ? 0777 : 0666)});
+            }
+        }
+        write_small_files(writes);
+    };
+
+    for (size_t begin = 0; begin < files.size(); begin += CHECKOUT_BATCH) {
+        size_t end = std::min(begin + CHECKOUT_BATCH, files.size());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight++;
+        }
+        pool.submit([&, begin, end] {
+            try {
+                write_batch(begin, end);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--in_flight == 0) idle.notify_all();
+        });
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&] { return in_flight == 0; });
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+struct CloneOptions {
+    size_t jobs = 1;
+    int depth = 0;       // --depth: only this many commits of history below HEAD
+    std::string filter;  // --filter: blobs left on the server until something reads them
+};
+
+// the config of a fresh clone: where it came from and, for a partial clone, that the remote
+// promises the objects the filter left out
+void write_clone_config(const std::string& url, const std::string& filter) {
+    std::ofstream config(".git/config");
+    config << "[core]\n"
+           << "\trepositoryformatversion = " << (filter.empty() ? 0 : 1) << "\n"
+           << "\tfilemode = true\n"
+           << "\tbare = false\n"
+           << "[remote \"origin\"]\n"
+           << "\turl = " << url << "\n"
+           << "\tfetch = +refs/heads/*:refs/remotes/origin/*\n";
+    if (!filter.empty()) {
+        config << "\tpromisor = true\n"
+               << "\tpartialclonefilter = " << filter << "\n"
+               << "[extensions]\n"
+               << "\tpartialclone = origin\n";
+    }
+    if (!config) throw std::runtime_error("Failed to write .git/config");
+}
+
+// clone <url> <dir>: discovery, negotiation, streamed pack download + indexing, checkout.
+// speaks protocol v2 when the server does (required for --depth and --filter), v0 otherwise
+void clone_repository(const std::string& url, const std::filesystem::path& dir, const CloneOptions& options) {
+    // 1. Discover refs: a v2 server lists capabilities, and ls-refs then asks for HEAD alone
+    std::vector<GitPacket> packets =
+        parsePktLines(performGetRequest(url + "/info/refs?service=git-upload-pack", {GIT_PROTOCOL_V2_HEADER}));
+    std::map<std::string, std::string> capabilities = parse_v2_capabilities(packets);
+    bool v2 = !capabilities.empty();
+    std::set<std::string> features;
+    std::istringstream words(capabilities["fetch"]);
+    for (std::string word; words >> word;) features.insert(word);
+    if (!v2 && (options.depth > 0 || !options.filter.empty())) {
+        throw std::runtime_error("--depth and --filter need a server that speaks protocol v2");
+    }
+    if (options.depth > 0 && !features.count("shallow")) throw std::runtime_error("Server does not support shallow clones");
+    if (!options.filter.empty()) {
+        parse_blob_filter(options.filter);
+        if (!features.count("filter")) throw std::runtime_error("Server does not support --filter (uploadpack.allowFilter)");
+    }
+
+    std::string headHash, branch = "main";
+    if (v2) {
+        for (const RemoteRef& ref : ls_refs(url, {"HEAD"})) {
+            if (ref.name != "HEAD") continue;
+            headHash = ref.id.hex();
+            if (ref.symref_target.rfind("refs/heads/", 0) == 0) branch = ref.symref_target.substr(11);
+        }
+    } else {
+        headHash = getTargetHash(packets);
+        branch = getHeadBranch(packets);
+    }
+    if (headHash.empty()) throw std::runtime_error("Remote has no HEAD (empty repository?)");
+    // the branch name comes from the server and becomes HEAD and two ref paths
+    if (!check_ref_format("refs/heads/" + branch)) throw std::runtime_error("Remote HEAD names a bad branch '" + branch + "'");
+
+    // 2. Fresh repository to clone into
+    std::filesystem::create_directories(dir);
+    std::filesystem::current_path(dir);
+    init_repository(branch);
+    write_clone_config(url, options.filter);
+
+    // 3. Negotiate; the pack is spooled and split into objects as it downloads
+    PackIndexer indexer(".git/objects/pack", options.jobs);
+    std::vector<ObjectId> shallow;
+    if (v2) {
+        FetchRequest request;
+        request.wants.push_back(ObjectId::from_hex(headHash));
+        request.depth = options.depth;
+        request.filter = options.filter;
+        shallow = fetch_pack_v2(url, request, indexer);
+    } else {
+        negotiatePackfile(url, headHash, indexer);
+    }
+    std::string pack = indexer.finish();
+    std::cerr << "Received pack " << pack << " (" << indexer.object_count() << " objects)\n";
+    if (!options.filter.empty()) std::ofstream(".git/objects/pack/pack-" + pack + ".promisor");
+    if (!shallow.empty()) {
+        std::sort(shallow.begin(), shallow.end());
+        std::ofstream file(SHALLOW_FILE);
+        for (const ObjectId& id : shallow) file << id.hex() << '\n';
+    }
+
+    // 4. Point the branch (and origin's, for fetch to update) at the commit
+    write_ref("refs/heads/" + branch, ObjectId::from_hex(headHash));
+    write_ref("refs/remotes/origin/" + branch, ObjectId::from_hex(headHash));
+
+    // 5. Finally, reconstruct the files (a partial clone fetches the blobs it needs here)
+    ObjectDatabase db;
+    checkout_tree(getTreeShaFromCommit(db, ObjectId::from_hex(headHash)), std::filesystem::current_path(), options.jobs);
+}
+
+// ---- fetch ----
+// fetch [<url>]: brings refs/remotes/origin/* and refs/tags up to date. the wants are negotiated
+// against local history over v0's stateless multi_ack_detailed, so the server sends only what is
+// missing, as a thin pack whose deltas may lean on objects we already have
+
+// a v0 ref advertisement: the refs (peeled "^{}" lines dropped) and the first line's capabilities
+struct RefAdvertisement {
+    std::vector<std::pair<std::string, ObjectId>> refs;
+    std::set<std::string> capabilities;
+};
+
+RefAdvertisement parse_ref_advertisement(const std::vector<GitPacket>& packets) {
+    RefAdvertisement advertisement;
+    for (const GitPacket& pkt : packets) {
+        if (pkt.data.empty() || pkt.data[0] == '#') continue;
+        std::string line = pkt.data;
+        if (line.back() == '\n') line.pop_back();
+        size_t nul = line.find('\0');
+        if (nul != std::string::npos) {
+            std::istringstream words(line.substr(nul + 1));
+            for (std::string word; words >> word;) advertisement.capabilities.insert(word);
+            line.resize(nul);
+        }
+        ObjectId id;
+        if (line.size() <= ObjectId::HEX_SIZE + 1 || !ObjectId::parse(line.substr(0, ObjectId::HEX_SIZE), id)) continue;
+        std::string name = line.substr(ObjectId::HEX_SIZE + 1);
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, "^{}") == 0) continue; // also an empty repo's capabilities^{}
+        if (name != "HEAD" && !check_ref_format(name)) {
+            std::cerr << "warning: ignoring ref with broken name " << name << '\n';
+            continue;
+        }
+        advertisement.refs.emplace_back(name, id);
+    }
+    return advertisement;
+}
+
+// local history offered as haves: newest commit first, starting from every ref. a commit the
+// server acknowledges is common and so is all its ancestry; the mark spreads down through what the
+// walk has already expanded and reaches the rest as it is popped, so none of it is offered
+class HaveWalker {
+public:
+    HaveWalker(ObjectDatabase& db, CommitIndex& commits) : commits(commits) {
+        for (const ObjectId& tip : list_ref_tips()) {
+            ObjectDatabase::Object obj = db.read(tip);
+            if (!obj || (obj.type != "commit" && obj.type != "tag")) continue;
+            try {
+                push(commits.lookup(resolve_commit(db, tip.hex())));
+            } catch (const std::exception&) {
+                // a tag of a tree or blob says nothing about history
+            }
+        }
+    }
+
+    std::optional<ObjectId> next() {
+        std::vector<uint32_t> parents;
+        while (!queue.empty()) {
+            uint32_t pos = queue.top().second;
+            queue.pop();
+            flags[pos] |= EXPANDED;
+            bool common = flags[pos] & COMMON;
+            commits.parents(pos, parents);
+            for (uint32_t parent : parents) {
+                push(parent);
+                if (common) mark(parent);
+            }
+            if (!common) return commits.id(pos);
+        }
+        return std::nullopt;
+    }
+
+    void mark_common(const ObjectId& id) {
+        if (auto pos = commits.find(id)) mark(*pos);
+    }
+
+private:
+    enum : uint8_t { SEEN = 1, EXPANDED = 2, COMMON = 4 };
+
+    CommitIndex& commits;
+    std::vector<uint8_t> flags; // by position
+    std::priority_queue<std::pair<int64_t, uint32_t>> queue; // (commit date, position)
+
+    uint8_t& flag(uint32_t pos) {
+        if (pos >= flags.size()) flags.resize(commits.size());
+        return flags[pos];
+    }
+
+    void push(uint32_t pos) {
+        if (flag(pos) & SEEN) return;
+        flag(pos) |= SEEN;
+        queue.emplace(commits.date(pos), pos);
+    }
+
+    void mark(uint32_t pos) {
+        std::vector<uint32_t> stack = {pos}, parents;
+        while (!stack.empty()) {
+            uint32_t p = stack.back();
+            stack.pop_back();
+            if (flag(p) & COMMON) continue;
+            flag(p) |= COMMON;
+            if (!(flag(p) & EXPANDED)) continue; // its parents hear about it when it is popped
+            commits.parents(p, parents);
+            stack.insert(stack.end(), parents.begin(), parents.end());
+        }
+    }
+};
+
+// have batches start small, so a nearly up-to-date repository finishes in one short round, and
+// double up to a cap; after MAX_IN_VAIN haves without a new ACK the client stops looking
+constexpr size_t INITIAL_HAVES = 16;
+constexpr size_t MAX_HAVES_PER_ROUND = 16384;
+constexpr size_t MAX_IN_VAIN = 256;
+
+struct NegotiationOptions {
+    std::set<std::string> capabilities; // the server's
+    std::vector<ObjectId> wants;
+    std::vector<ObjectId> shallow;      // our cut-off commits, so the server doesn't count on their parents
+    std::string filter;
+};
+
+// stateless rounds: each request repeats the wants and the haves found common so far, then a new
+// batch. the server ACKs the haves it has ("common"), says "ready" once it can cut a pack that
+// covers the wants, and ends each round with NAK. done goes out on ready, when local history runs
+// out, or after MAX_IN_VAIN haves in vain; that last request brings the pack
+void negotiate_and_fetch(const std::string& url, const NegotiationOptions& options, HaveWalker& walker, PackIndexer& indexer) {
+    TraceSpan span("fetch-pack");
+    // 1. The wants, the first with the capabilities we use out of the server's
+    std::string capabilities = "multi_ack_detailed side-band-64k";
+    for (const char* capability : {"thin-pack", "ofs-delta"}) {
+        if (options.capabilities.count(capability)) capabilities += std::string(" ") + capability;
+    }
+    if (!options.filter.empty()) capabilities += " filter";
+    capabilities += " agent=proto_git/1.0";
+    std::string head;
+    for (size_t i = 0; i < options.wants.size(); i++) {
+        head += pkt_line("want " + options.wants[i].hex() + (i == 0 ? " " + capabilities : "") + "\n");
+    }
+    for (const ObjectId& id : options.shallow) head += pkt_line("shallow " + id.hex() + "\n");
+    if (!options.filter.empty()) head += pkt_line("filter " + options.filter + "\n");
+    head += "0000";
+
+    // 2. Rounds of haves until the server is ready or we have nothing left worth offering
+    std::vector<ObjectId> common;
+    std::unordered_set<ObjectId> common_set;
+    size_t batch = INITIAL_HAVES, in_vain = 0;
+    bool ready = false, exhausted = false;
+    while (!ready && !exhausted && !(!common.empty() && in_vain >= MAX_IN_VAIN)) {
+        std::string body = head;
+        for (const ObjectId& id : common) body += pkt_line("have " + id.hex() + "\n");
+        size_t sent = 0;
+        for (; sent < batch; sent++) {
+            std::optional<ObjectId> id = walker.next();
+            if (!id) {
+                exhausted = true;
+                break;
+            }
+            body += pkt_line("have " + id->hex() + "\n");
+        }
+        if (sent == 0) break;
+        body += "0000";
+
+        bool news = false;
+        SideBandDemuxer demux([](const unsigned char*, size_t) {
+            throw std::runtime_error("Unexpected pack data during negotiation");
+        });
+        demux.on_line = [&](const std::string& line) {
+            ObjectId id;
+            if (line.rfind("ACK ", 0) != 0 || !ObjectId::parse(line.substr(4, ObjectId::HEX_SIZE), id)) return;
+            if (line.compare(4 + ObjectId::HEX_SIZE, std::string::npos, " ready") == 0) ready = true;
+            if (common_set.insert(id).second) {
+                common.push_back(id);
+                walker.mark_common(id);
+                news = true;
+            }
+        };
+        postUploadPack(url, body, false, demux);
+        in_vain = news ? 0 : in_vain + sent;
+        batch = std::min(batch * 2, MAX_HAVES_PER_ROUND);
+    }
+
+    // 3. done: the pack comes back, demultiplexed and indexed as it downloads
+    std::string body = head;
+    for (const ObjectId& id : common) body += pkt_line("have " + id.hex() + "\n");
+    body += pkt_line("done\n");
+    SideBandDemuxer demux([&indexer](const unsigned char* data, size_t n) { indexer.feed(data, n); });
+    postUploadPack(url, body, false, demux);
+    std::cerr << "Negotiated " << common.size() << " common commit" << (common.size() == 1 ? "" : "s") << '\n';
+}
+
+// "   1234567..89abcde  main       -> origin/main", as git prints ref updates; a branch that
+// didn't fast-forward is " + 1234567...89abcde main -> origin/main  (forced update)"
+std::string format_ref_update(const std::optional<ObjectId>& old_id, const ObjectId& new_id, bool tag, bool forced,
+                              const std::string& from, const std::string& to) {
+    std::string summary = old_id ? old_id->hex().substr(0, 7) + (forced ? "..." : "..") + new_id.hex().substr(0, 7)
+                                 : tag ? "[new tag]" : "[new branch]";
+    std::string line = std::string(!old_id ? " * " : forced ? " + " : "   ") + summary;
+    line.resize(std::max<size_t>(line.size() + 1, 21), ' ');
+    line += from;
+    line.resize(std::max<size_t>(line.size(), 21 + 10), ' ');
+    return line + " -> " + to + (forced ? "  (forced update)" : "");
+}
+
+void fetch_remote(std::string url, size_t jobs) {
+    if (url.empty()) {
+        std::optional<std::string> origin = read_config("remote.origin.url");
+        if (!origin) throw std::runtime_error("No remote given and remote.origin.url is not set");
+        url = *origin;
+    }
+
+    // 1. Discover refs; v0, since that is where multi_ack_detailed lives
+    RefAdvertisement remote =
+        parse_ref_advertisement(parsePktLines(performGetRequest(url + "/info/refs?service=git-upload-pack")));
+    for (const char* capability : {"multi_ack_detailed", "side-band-64k"}) {
+        if (!remote.capabilities.count(capability)) throw std::runtime_error(std::string("Server does not support ") + capability);
+    }
+
+    // 2. Branches land under refs/remotes/origin, new tags as they are; wants are what we lack
+    struct RefUpdate {
+        std::string name, local;
+        ObjectId id;
+        std::optional<ObjectId> old_id;
+    };
+    ObjectDatabase db;
+    enable_lazy_fetch(db);
+    std::vector<RefUpdate> updates;
+    NegotiationOptions options;
+    options.capabilities = remote.capabilities;
+    std::unordered_set<ObjectId> wanted;
+    for (const auto& [name, id] : remote.refs) {
+        RefUpdate update{name, "", id, std::nullopt};
+        if (name.rfind("refs/heads/", 0) == 0) update.local = "refs/remotes/origin/" + name.substr(11);
+        else if (name.rfind("refs/tags/", 0) == 0) update.local = name;
+        else continue;
+        update.old_id = read_ref(update.local);
+        if (update.old_id == id || (update.old_id && name.rfind("refs/tags/", 0) == 0)) continue; // tags don't move
+        updates.push_back(update);
+        if (!db.contains(id) && wanted.insert(id).second) options.wants.push_back(id);
+    }
+
+    // 3. Negotiate and download the missing objects
+    if (!options.wants.empty()) {
+        std::unordered_set<ObjectId> shallow = read_shallow();
+        if (!shallow.empty() && !remote.capabilities.count("shallow")) {
+            throw std::runtime_error("Server cannot fetch into a shallow repository");
+        }
+        options.shallow.assign(shallow.begin(), shallow.end());
+        std::sort(options.shallow.begin(), options.shallow.end());
+        std::optional<std::string> promisor = read_config("extensions.partialclone");
+        if (promisor && remote.capabilities.count("filter")) {
+            options.filter = read_config("remote." + *promisor + ".partialclonefilter").value_or("");
+        }
+
+        CommitIndex commits(db);
+        HaveWalker walker(db, commits);
+        PackIndexer indexer(".git/objects/pack", jobs);
+        indexer.thin_base = [&db](const ObjectId& id, int& type, std::vector<char>& content) {
+            ObjectDatabase::Object obj = db.read(id);
+            if (!obj) return false;
+            type = pack_type_code(obj.type);
+            content.assign(obj.bytes(), obj.bytes() + obj.size());
+            return true;
+        };
+        negotiate_and_fetch(url, options, walker, indexer);
+        std::string pack = indexer.finish();
+        std::cerr << "Received pack " << pack << " (" << indexer.object_count() << " objects, "
+                  << indexer.thin_bases_added() << " delta bases completed locally)\n";
+        if (promisor) std::ofstream(".git/objects/pack/pack-" + pack + ".promisor");
+    }
+
+    // 4. Move the refs, now that everything they point at is here; a branch whose old commit is
+    // not an ancestor of the new one was rewritten upstream and is reported as forced
+    if (updates.empty()) return;
+    std::cerr << "From " << url << '\n';
+    ObjectDatabase fetched; // sees the new pack
+    CommitIndex commits(fetched);
+    for (const RefUpdate& update : updates) {
+        bool tag = update.name.rfind("refs/tags/", 0) == 0;
+        bool forced = false;
+        if (update.old_id && !tag) {
+            try {
+                forced = !is_ancestor(commits, *update.old_id, update.id);
+            } catch (const std::exception&) {
+                forced = true; // the old commit isn't here, so nothing shows it was a fast-forward
+            }
+        }
+        write_ref(update.local, update.id);
+        std::cerr << format_ref_update(update.old_id, update.id, tag, forced, update.name.substr(tag ? 10 : 11),
+                                       tag ? update.local.substr(10) : update.local.substr(13)) << '\n';
+    }
+}
+
+// ---- upload-pack server ----
+// the serving side of the smart protocol, v0 and (when the client asks for it) v2 with shallow and
+// filtered fetches: upload-pack on stdin and stdout like git's, for ssh-style transports and git http-backend's --stateless-rpc, and an
+// http-backend that serves every repository below a directory over HTTP from a thread pool
+
+// a repository's git directory: <dir>/.git, or dir itself when it is bare
+std::filesystem::path find_git_dir(const std::filesystem::path& dir) {
+    if (std::filesystem::is_directory(dir / ".git")) return dir / ".git";
+    if (std::filesystem::exists(dir / "HEAD") && std::filesystem::is_directory(dir / "objects")) return dir;
+    throw std::runtime_error("Not a git repository: " + dir.string());
+}
+
+// every ref under refs/ (loose ones win over packed-refs), sorted by name
+std::vector<std::pair<std::string, ObjectId>> list_refs(const std::filesystem::path& git_dir) {
+    std::map<std::string, ObjectId> refs;
+    std::ifstream packed(git_dir / "packed-refs");
+    std::string line;
+    while (std::getline(packed, line)) {
+        ObjectId id;
+        if (line.size() > ObjectId::HEX_SIZE + 1 && line[0] != '#' && line[0] != '^' &&
+            ObjectId::parse(line.substr(0, ObjectId::HEX_SIZE), id)) {
+            refs[line.substr(ObjectId::HEX_SIZE + 1)] = id;
+        }
+    }
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(git_dir / "refs", ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file()) continue;
+        std::ifstream f(it->path());
+        ObjectId id;
+        if (std::getline(f, line) && ObjectId::parse(line.substr(0, ObjectId::HEX_SIZE), id)) {
+            refs[std::filesystem::relative(it->path(), git_dir).generic_string()] = id;
+        }
+    }
+    return {refs.begin(), refs.end()};
+}
+
+// pkt-lines from a byte source (a pipe, or an HTTP request body); payloads lose their trailing newline
+class PktReader {
+public:
+    enum class Result { Line, Flush, Delim, ResponseEnd, End }; // Delim and ResponseEnd only occur in v2
+
+    explicit PktReader(std::function<size_t(char*, size_t)> source) : source(std::move(source)) {}
+
+    Result read(std::string& line) {
+        char length[4];
+        if (!fill(length, 4, true)) return Result::End;
+        size_t n = 0;
+        for (char c : length) {
+            int digit = HEX_TABLES.decode[static_cast<unsigned char>(c)];
+            if (digit < 0) throw std::runtime_error("Malformed pkt-line length");
+            n = n * 16 + digit;
+        }
+        line.clear();
+        if (n == 0) return Result::Flush;
+        if (n == 1) return Result::Delim;
+        if (n == 2) return Result::ResponseEnd;
+        if (n < 4) throw std::runtime_error("Malformed pkt-line");
+        line.resize(n - 4);
+        fill(line.data(), line.size(), false);
+        if (!line.empty() && line.back() == '\n') line.pop_back();
+        return Result::Line;
+    }
+
+private:
+    std::function<size_t(char*, size_t)> source;
+
+    // false only when the input ends cleanly before the first byte and that is allowed
+    bool fill(char* out, size_t n, bool may_end) {
+        for (size_t got = 0; got < n;) {
+            size_t r = source(out + got, n - got);
+            if (r == 0) {
+                if (may_end && got == 0) return false;
+                throw std::runtime_error("Unexpected end of pkt-line stream");
+            }
+            got += r;
+        }
+        return true;
+    }
+};
+
+// write_all for sockets: a peer that has gone away is an error, not a SIGPIPE
+void send_all(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t sent = send(fd, data, n, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) throw std::runtime_error(std::string("client went away: ") + strerror(errno));
+        data += sent;
+        n -= static_cast<size_t>(sent);
+    }
+}
+
+// where an upload-pack response goes: a pipe or socket, optionally inside HTTP/1.1 chunked transfer
+// encoding. output is buffered up to 64 KiB; once the client has chosen a side band, pack data and
+// progress travel as side-band packets
+class UploadPackOutput {
+public:
+    UploadPackOutput(int fd, bool socket, bool chunked) : fd(fd), socket(socket), chunked(chunked) {}
+
+    size_t band_limit = 0; // largest side-band packet, 0 for a bare pack stream
+    bool progress = true;
+
+    void packet(const std::string& payload) { raw(pkt_line(payload)); }
+    void flush_packet() { raw("0000"); }
+    void delim_packet() { raw("0001"); }
+
+    void pack_data(const char* data, size_t n) {
+        if (band_limit == 0) raw(data, n);
+        else band(1, data, n);
+    }
+
+    void progress_message(const std::string& message) {
+        if (band_limit != 0 && progress) band(2, message.data(), message.size());
+    }
+
+    // fatal error: on the error band when there is one, as an ERR line otherwise
+    void error(const std::string& message) {
+        if (band_limit != 0) band(3, message.data(), message.size());
+        else packet("ERR " + message + "\n");
+    }
+
+    // sends what is buffered, e.g. before waiting for the client's next round
+    void flush() { drain(); }
+
+    // flush() and the end of the chunked body; upload_pack may have finished already
+    void finish() {
+        drain();
+        if (chunked && !finished) write_out("0\r\n\r\n", 5);
+        finished = true;
+    }
+
+private:
+    int fd;
+    bool socket;
+    bool chunked;
+    bool finished = false;
+    std::string buffer;
+
+    void band(char channel, const char* data, size_t n) {
+        size_t max = band_limit - 5; // 4 length digits and the channel byte
+        for (size_t done = 0; done < n;) {
+            size_t take = std::min(max, n - done);
+            char length[5];
+            snprintf(length, sizeof(length), "%04x", static_cast<unsigned>(take + 5));
+            raw(length, 4);
+            raw(&channel, 1);
+            raw(data + done, take);
+            done += take;
+        }
+    }
+
+    void raw(const std::string& s) { raw(s.data(), s.size()); }
+    void raw(const char* data, size_t n) {
+        buffer.append(data, n);
+        if (buffer.size() >= (1 << 16)) drain();
+    }
+
+    void drain() {
+        if (buffer.empty()) return;
+        if (chunked) {
+            char size[20];
+            int len = snprintf(size, sizeof(size), "%zx\r\n", buffer.size());
+            buffer.insert(0, size, len);
+            buffer += "\r\n";
+        }
+        write_out(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    void write_out(const char* data, size_t n) {
+        if (socket) send_all(fd, data, n);
+        else write_all(fd, data, n, "upload-pack output");
+    }
+};
+
+// capabilities upload-pack offers on its first ref line
+const std::string UPLOAD_PACK_CAPABILITIES = "multi_ack_detailed side-band side-band-64k thin-pack ofs-delta shallow no-progress agent=proto_git/1.0";
+
+// the commit an annotated tag under refs/tags/ points at; nothing for other refs
+std::optional<ObjectId> peel_tag_ref(ObjectDatabase& db, const std::string& name, const ObjectId& id) {
+    if (name.rfind("refs/tags/", 0) != 0) return std::nullopt;
+    ObjectDatabase::Object obj = db.read(id);
+    if (!obj || obj.type != "tag") return std::nullopt;
+    try {
+        return resolve_commit(db, id.hex());
+    } catch (const std::exception&) {
+        return std::nullopt; // a tag of a tree or blob: no commit to peel to
+    }
+}
+
+// ref advertisement: HEAD first with the capabilities, then every ref, annotated tags followed by
+// their peeled "<ref>^{}" line
+void advertise_refs(const std::filesystem::path& git_dir, UploadPackOutput& out) {
+    ObjectDatabase db(git_dir / "objects");
+    std::string capabilities = UPLOAD_PACK_CAPABILITIES;
+    std::ifstream head_file(git_dir / "HEAD");
+    std::string head_line;
+    if (std::getline(head_file, head_line) && head_line.rfind("ref: ", 0) == 0) {
+        capabilities += " symref=HEAD:" + head_line.substr(5);
+    }
+
+    std::vector<std::pair<std::string, ObjectId>> refs;
+    if (auto head = read_ref("HEAD", git_dir)) refs.emplace_back("HEAD", *head);
+    for (auto& ref : list_refs(git_dir)) refs.push_back(std::move(ref));
+    if (refs.empty()) {
+        out.packet(std::string(ObjectId::HEX_SIZE, '0') + " capabilities^{}" + '\0' + capabilities + "\n");
+    }
+    for (size_t i = 0; i < refs.size(); i++) {
+        const auto& [name, id] = refs[i];
+        out.packet(id.hex() + " " + name + (i == 0 ? std::string(1, '\0') + capabilities : "") + "\n");
+        if (auto peeled = peel_tag_ref(db, name, id)) out.packet(peeled->hex() + " " + name + "^{}\n");
+    }
+    out.flush_packet();
+}
+
+// what a client asks upload-pack for
+struct UploadRequest {
+    std::vector<ObjectId> wants;
+    std::vector<ObjectId> common;                 // haves this side has as well
+    std::unordered_set<ObjectId> client_shallow;  // the client's own cut-off commits ("shallow <id>")
+    int depth = 0;                                // "deepen <n>"; 0 for all of history
+    bool deepen_relative = false;                 // depth counts from the client's shallow commits
+    std::optional<uint64_t> blob_limit;           // v2 "filter": blobs this size or larger stay behind
+
+    // for deepen, filled in by limit_depth: the commits within depth of the wants, and those of
+    // them whose parents the client will not get
+    std::vector<uint32_t> within_depth;
+    std::vector<uint32_t> shallow;
+};
+
+// deepen <n>: a breadth-first walk n commits down from the wanted commits (deepen-relative: n
+// commits below the client's shallow commits). a commit reached at the last level keeps its
+// parents from the client and becomes shallow there
+void limit_depth(ObjectDatabase& db, CommitIndex& commits, UploadRequest& request) {
+    std::unordered_map<uint32_t, int> depth;
+    std::deque<uint32_t> queue;
+    std::vector<ObjectId> starts = request.wants;
+    if (request.deepen_relative) starts.assign(request.client_shallow.begin(), request.client_shallow.end());
+    int max_depth = request.deepen_relative ? request.depth + 1 : request.depth;
+    for (const ObjectId& start : starts) {
+        ObjectId id;
+        try {
+            id = resolve_commit(db, start.hex());
+        } catch (const std::exception&) {
+            continue; // a tree or blob has no history to cut, and unknown shallow commits are ignored
+        }
+        uint32_t pos = commits.lookup(id);
+        if (depth.emplace(pos, 1).second) queue.push_back(pos);
+    }
+    std::vector<uint32_t> parents;
+    while (!queue.empty()) {
+        uint32_t pos = queue.front();
+        queue.pop_front();
+        request.within_depth.push_back(pos);
+        commits.parents(pos, parents);
+        if (parents.empty()) continue;
+        int d = depth[pos];
+        if (d >= max_depth) {
+            request.shallow.push_back(pos);
+            continue;
+        }
+        for (uint32_t parent : parents) {
+            if (depth.emplace(parent, d + 1).second) queue.push_back(parent);
+        }
+    }
+}
+
+// after limit_depth, the "shallow <id>" lines for where the client's history is now cut and the
+// "unshallow <id>" lines for its shallow commits that get their parents this time
+void send_shallow_update(CommitIndex& commits, const UploadRequest& request, UploadPackOutput& out) {
+    std::unordered_set<uint32_t> cut(request.shallow.begin(), request.shallow.end());
+    for (uint32_t pos : request.shallow) out.packet("shallow " + commits.id(pos).hex() + "\n");
+    std::vector<uint32_t> parents;
+    for (uint32_t pos : request.within_depth) {
+        commits.parents(pos, parents);
+        if (request.client_shallow.count(commits.id(pos)) && !cut.count(pos) && !parents.empty()) {
+            out.packet("unshallow " + commits.id(pos).hex() + "\n");
+        }
+    }
+}
+
+// objects a client needs: everything reachable from the wants but not from the common commits.
+// commits come from the commit-graph walk (for deepen, from limit_depth's walk). trees and blobs
+// come from walking the trees of the new commits, minus whatever the trees of the boundary
+// (commits the client has that are common or parents of new ones) already hold; blobs are listed
+// from tree entries and never read, except for their size under a blob:limit filter. client_objects,
+// when given, receives what the boundary walk found the client to have (thin pack delta bases)
+std::vector<PackCandidate> enumerate_for_upload(ObjectDatabase& db, CommitIndex& commits,
+                                                const UploadRequest& request, UploadPackOutput& out,
+                                                std::unordered_set<ObjectId>* client_objects = nullptr) {
+    TraceSpan span("enumerate-objects");
+    std::vector<PackCandidate> found;
+    std::unordered_set<ObjectId> seen;
+    auto add = [&found](const ObjectId& id, int type, const std::string& path) {
+        PackCandidate c;
+        c.id = id;
+        c.type = type;
+        c.name_hash = pack_name_hash(path);
+        found.push_back(std::move(c));
+    };
+    auto report = [&found, &out](bool done) {
+        if (done || found.size() % 10000 == 0) {
+            out.progress_message("Enumerating objects: " + std::to_string(found.size()) + (done ? ", done.\n" : "\r"));
+        }
+    };
+
+    // 1. Wants: tags are sent along with what they peel to
+    RevListOptions revs;
+    std::vector<std::pair<ObjectId, int>> roots; // trees and blobs wanted directly
+    for (const ObjectId& want : request.wants) {
+        ObjectId id = want;
+        for (;;) {
+            ObjectDatabase::Object obj = db.read(id);
+            if (!obj) throw std::runtime_error("upload-pack: not our ref " + id.hex());
+            if (obj.type == "commit") {
+                revs.include.push_back(id);
+            } else if (obj.type == "tag") {
+                if (seen.insert(id).second) add(id, OBJ_TAG, "");
+                if (obj.size() < 7 + ObjectId::HEX_SIZE || memcmp(obj.bytes(), "object ", 7) != 0) {
+                    throw std::runtime_error("Corrupt tag " + id.hex());
+                }
+                id = ObjectId::from_hex(std::string(obj.bytes() + 7, ObjectId::HEX_SIZE));
+                continue;
+            } else {
+                roots.emplace_back(id, obj.type == "tree" ? OBJ_TREE : OBJ_BLOB);
+            }
+            break;
+        }
+    }
+    for (const ObjectId& id : request.common) {
+        if (commits.find(id) || db.read(id).type == "commit") revs.exclude.push_back(id);
+    }
+
+    // 2. Commits, and the boundary whose trees the client already has
+    std::vector<uint32_t> new_commits;
+    if (request.depth > 0 || !request.client_shallow.empty()) {
+        // what the client has: ancestors of common commits, no older than the depth walk reached
+        // and never past the client's own shallow commits
+        uint32_t floor = request.depth > 0 ? CommitGraph::GENERATION_MAX : 0;
+        for (uint32_t pos : request.within_depth) floor = std::min(floor, commits.generation(pos));
+        std::unordered_set<uint32_t> hidden, within(request.within_depth.begin(), request.within_depth.end());
+        std::unordered_set<uint32_t> cut_off(request.shallow.begin(), request.shallow.end());
+        std::vector<uint32_t> stack, parents;
+        for (const ObjectId& id : revs.exclude) stack.push_back(commits.lookup(id));
+        while (!stack.empty()) {
+            uint32_t pos = stack.back();
+            stack.pop_back();
+            if (!hidden.insert(pos).second || request.client_shallow.count(commits.id(pos))) continue;
+            commits.parents(pos, parents);
+            for (uint32_t parent : parents) {
+                if (commits.generation(parent) >= floor) stack.push_back(parent);
+            }
+        }
+        // then everything the client lacks from the wants down to the new shallow commits; below
+        // a client shallow commit the depth walk reaches past, its parents are new as well
+        std::unordered_set<uint32_t> visited;
+        for (const ObjectId& id : revs.include) stack.push_back(commits.lookup(id));
+        for (uint32_t pos : request.within_depth) {
+            if (request.client_shallow.count(commits.id(pos)) && !cut_off.count(pos)) stack.push_back(pos);
+        }
+        while (!stack.empty()) {
+            uint32_t pos = stack.back();
+            stack.pop_back();
+            if (!visited.insert(pos).second) continue;
+            bool deepened = request.client_shallow.count(commits.id(pos)) && within.count(pos) && !cut_off.count(pos);
+            if (!deepened) {
+                if (hidden.count(pos)) continue;
+                new_commits.push_back(pos);
+                if (cut_off.count(pos)) continue;
+            }
+            commits.parents(pos, parents);
+            stack.insert(stack.end(), parents.begin(), parents.end());
+        }
+    } else if (!revs.include.empty()) {
+        new_commits = rev_list(commits, revs);
+    }
+    std::vector<bool> is_new(commits.size(), false), cut(commits.size(), false);
+    for (uint32_t pos : new_commits) is_new[pos] = true;
+    for (uint32_t pos : request.shallow) cut[pos] = true;
+    std::vector<ObjectId> boundary;
+    std::vector<uint32_t> parents;
+    for (const ObjectId& id : revs.exclude) boundary.push_back(commits.tree(commits.lookup(id)));
+    for (uint32_t pos : new_commits) {
+        commits.parents(pos, parents);
+        for (uint32_t parent : parents) {
+            if (!is_new[parent] && !cut[pos]) boundary.push_back(commits.tree(parent));
+        }
+        add(commits.id(pos), OBJ_COMMIT, "");
+        report(false);
+    }
+
+    // 3. Trees, depth first; with only_mark the objects are remembered as the client's, not added
+    auto walk = [&](const ObjectId& root, bool only_mark) {
+        if (!seen.insert(root).second) return;
+        if (!only_mark) add(root, OBJ_TREE, "");
+        std::vector<std::pair<ObjectId, std::string>> pending = {{root, ""}};
+        while (!pending.empty()) {
+            auto [tree, path] = std::move(pending.back());
+            pending.pop_back();
+            ObjectDatabase::Object obj = db.read(tree, "tree");
+            for (const TreeView::Entry& e : TreeView(*obj.data, tree)) {
+                if (e.is_gitlink()) continue;
+                ObjectId id = e.id();
+                if (!seen.insert(id).second) continue;
+                std::string child = path.empty() ? std::string(e.name) : path + "/" + std::string(e.name);
+                if (e.is_tree()) pending.emplace_back(id, child);
+                if (only_mark) continue;
+                if (!e.is_tree() && request.blob_limit) {
+                    std::optional<uint64_t> size;
+                    if (*request.blob_limit > 0) size = db.size(id);
+                    if (!size || *size >= *request.blob_limit) continue; // filtered out
+                }
+                add(id, e.is_tree() ? OBJ_TREE : OBJ_BLOB, child);
+                report(false);
+            }
+        }
+    };
+    for (const ObjectId& tree : boundary) walk(tree, true);
+    if (client_objects) *client_objects = seen;
+    for (uint32_t pos : new_commits) walk(commits.tree(pos), false);
+    for (const auto& [id, type] : roots) {
+        if (type == OBJ_TREE) walk(id, false);
+        else if (seen.insert(id).second) add(id, OBJ_BLOB, "");
+    }
+    report(true);
+    return found;
+}
+
+// streams objects as a pack. an entry that is already packed is copied verbatim (no inflate, no
+// deflate), and so is a packed delta whose base goes out in the same pack from the same source
+// pack; it is written after its base, as OFS_DELTA when the client takes those. for a thin pack,
+// a delta against one of thin_bases (objects the client has) is copied as a REF_DELTA as well.
+// everything else (loose objects, deltas against a base the client does not get) is deflated afresh
+void stream_pack(ObjectDatabase& db, const std::vector<PackCandidate>& objects, bool ofs_delta, UploadPackOutput& out,
+                 const std::unordered_set<ObjectId>* thin_bases = nullptr) {
+    TraceSpan span("stream-pack");
+    struct Plan {
+        PackFile* pack = nullptr; // source of a verbatim copy
+        PackResolver::Entry entry{};
+        uint64_t offset = 0;
+        int base = -1;
+        std::optional<ObjectId> client_base; // thin: the delta's base stays on the client
+    };
+    std::unordered_map<ObjectId, int> index;
+    for (size_t i = 0; i < objects.size(); i++) index[objects[i].id] = static_cast<int>(i);
+
+    // 1. Where each object comes from
+    std::vector<Plan> plans(objects.size());
+    for (size_t i = 0; i < objects.size(); i++) {
+        Plan& plan = plans[i];
+        plan.pack = db.find_packed(objects[i].id, plan.offset);
+        if (!plan.pack) continue;
+        plan.entry = plan.pack->entry(plan.offset);
+        if (plan.entry.type != OBJ_OFS_DELTA && plan.entry.type != OBJ_REF_DELTA) continue;
+        ObjectId base_id = plan.entry.base_id;
+        uint64_t base_offset = 0;
+        if (plan.entry.type == OBJ_OFS_DELTA && !plan.pack->id_at(plan.entry.base_offset, base_id)) {
+            throw std::runtime_error("Corrupt pack: no object at delta base offset");
+        }
+        auto it = index.find(base_id);
+        if (it != index.end() && db.find_packed(base_id, base_offset) == plan.pack) plan.base = it->second;
+        else if (it == index.end() && thin_bases && thin_bases->count(base_id)) plan.client_base = base_id;
+        else plan.pack = nullptr; // the base stays behind: send the whole object
+    }
+
+    // 2. Header, then every object with its base ahead of it
+    Sha1Stream sha;
+    uint64_t offset = 0;
+    auto emit = [&](const char* data, size_t n) {
+        sha.update(data, n);
+        out.pack_data(data, n);
+        offset += n;
+    };
+    std::string header("PACK", 4);
+    put_be32(header, 2);
+    put_be32(header, static_cast<uint32_t>(objects.size()));
+    emit(header.data(), header.size());
+
+    std::vector<uint64_t> offsets(objects.size(), 0);
+    std::vector<bool> written(objects.size(), false);
+    size_t reused = 0, reused_deltas = 0;
+    std::vector<char> compressed;
+    auto write_one = [&](size_t i) {
+        const Plan& plan = plans[i];
+        std::string entry;
+        offsets[i] = offset;
+        written[i] = true;
+        if (plan.pack) {
+            uint64_t end = plan.pack->entry_end(plan.offset);
+            const char* data = reinterpret_cast<const char*>(plan.pack->bytes());
+            if (plan.client_base) {
+                append_pack_entry_header(entry, OBJ_REF_DELTA, plan.entry.size);
+                entry.append(reinterpret_cast<const char*>(plan.client_base->data()), ObjectId::RAW_SIZE);
+                emit(entry.data(), entry.size());
+                emit(data + plan.entry.data_offset, end - plan.entry.data_offset);
+                reused_deltas++;
+            } else if (plan.base < 0) {
+                emit(data + plan.offset, end - plan.offset); // header and all
+            } else {
+                append_pack_entry_header(entry, ofs_delta ? OBJ_OFS_DELTA : OBJ_REF_DELTA, plan.entry.size);
+                if (ofs_delta) append_ofs_distance(entry, offsets[i] - offsets[plan.base]);
+                else entry.append(reinterpret_cast<const char*>(objects[plan.base].id.data()), ObjectId::RAW_SIZE);
+                emit(entry.data(), entry.size());
+                emit(data + plan.entry.data_offset, end - plan.entry.data_offset);
+                reused_deltas++;
+            }
+            reused++;
+            return;
+        }
+        ObjectDatabase::Object obj = db.read(objects[i].id);
+        if (!obj) throw std::runtime_error("upload-pack: missing object " + objects[i].id.hex());
+        append_pack_entry_header(entry, objects[i].type, obj.size());
+        compress_buffer(obj.bytes(), obj.size(), choose_level(obj.bytes(), obj.size()), compressed);
+        entry.append(compressed.data(), compressed.size());
+        emit(entry.data(), entry.size());
+    };
+    for (size_t i = 0; i < objects.size(); i++) {
+        std::vector<size_t> chain;
+        for (int j = static_cast<int>(i); !written[j]; j = plans[j].base) {
+            chain.push_back(j);
+            if (plans[j].base < 0) break;
+            if (chain.size() > 10000) throw std::runtime_error("Corrupt pack: delta chain too deep");
+        }
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) write_one(*it);
+    }
+
+    // 3. Trailer
+    ObjectId checksum = sha.digest();
+    out.pack_data(reinterpret_cast<const char*>(checksum.data()), ObjectId::RAW_SIZE);
+    out.progress_message("Total " + std::to_string(objects.size()) + " (reused " + std::to_string(reused) +
+                         ", reused deltas " + std::to_string(reused_deltas) + ")\n");
+}
+
+// whether a wanted commit has one of the common commits as an ancestor
+bool descends_from_common(ObjectDatabase& db, CommitIndex& commits, const ObjectId& want, const std::vector<ObjectId>& common) {
+    if (!commits.find(want) && db.read(want).type != "commit") return false;
+    for (const ObjectId& c : common) {
+        if ((commits.find(c) || db.read(c).type == "commit") && is_ancestor(commits, c, want)) return true;
+    }
+    return false;
+}
+
+// upload-pack after the ref advertisement: wants, then rounds of haves answered with ACK/NAK,
+// then the pack once the client says done. stateless (one HTTP request per round) returns at the
+// end of a round without done; the client repeats its wants and common haves next time
+void upload_pack(const std::filesystem::path& git_dir, PktReader& in, UploadPackOutput& out, bool stateless) {
+    TraceSpan span("upload-pack");
+    ObjectDatabase db(git_dir / "objects");
+    CommitIndex commits(db, git_dir / "objects" / "info" / "commit-graph", git_dir / "shallow");
+
+    // 1. Wants, the first one carrying the client's capabilities, then a shallow client's
+    // "shallow <id>" lines and "deepen <n>"
+    std::vector<ObjectId> wants;
+    UploadRequest request;
+    std::set<std::string> capabilities;
+    std::string line;
+    for (;;) {
+        PktReader::Result r = in.read(line);
+        if (r == PktReader::Result::End) return; // the client only wanted the refs
+        if (r == PktReader::Result::Flush) break;
+        ObjectId id;
+        if (line.rfind("shallow ", 0) == 0 && ObjectId::parse(line.substr(8), id)) {
+            request.client_shallow.insert(id);
+            continue;
+        }
+        if (line.rfind("deepen ", 0) == 0 && parse_number(line.substr(7), request.depth) && request.depth > 0) {
+            continue;
+        }
+        if (line.rfind("want ", 0) != 0 || !ObjectId::parse(line.substr(5, ObjectId::HEX_SIZE), id)) {
+            out.packet("ERR upload-pack: unsupported request '" + line + "'\n");
+            out.finish();
+            return;
+        }
+        if (wants.empty()) {
+            std::istringstream words(line.substr(5 + ObjectId::HEX_SIZE));
+            std::string word;
+            while (words >> word) capabilities.insert(word);
+        }
+        if (!db.contains(id)) {
+            out.packet("ERR upload-pack: not our ref " + id.hex() + "\n");
+            out.finish();
+            return;
+        }
+        wants.push_back(id);
+    }
+    if (wants.empty()) return;
+    bool detailed = capabilities.count("multi_ack_detailed");
+    request.wants = wants;
+
+    // for deepen, where the history is cut goes out before negotiation (in every stateless round)
+    if (request.depth > 0) {
+        limit_depth(db, commits, request);
+        send_shallow_update(commits, request, out);
+        out.flush_packet();
+        out.flush();
+    }
+
+    // 2. Haves. once every wanted commit descends from something common the client may stop early
+    std::vector<ObjectId> common;
+    std::vector<bool> satisfied(wants.size(), false);
+    std::string last_common;
+    bool got_common = false, got_other = false;
+    auto ready = [&]() {
+        for (size_t i = 0; i < wants.size(); i++) {
+            if (!satisfied[i] && !(satisfied[i] = descends_from_common(db, commits, wants[i], common))) return false;
+        }
+        return true;
+    };
+    for (;;) {
+        PktReader::Result r = in.read(line);
+        if (r == PktReader::Result::End && stateless && request.depth > 0 && common.empty()) {
+            // a stateless client's first deepen request ends with the wants: it only asked for
+            // the shallow lines above
+            out.finish();
+            return;
+        }
+        if (r == PktReader::Result::End) throw std::runtime_error("upload-pack: client hung up during negotiation");
+        if (r == PktReader::Result::Flush) {
+            if (detailed && got_common && !got_other && ready()) out.packet("ACK " + last_common + " ready\n");
+            if (common.empty() || detailed) out.packet("NAK\n");
+            if (stateless) {
+                out.finish();
+                return;
+            }
+            out.flush();
+            got_common = got_other = false;
+            continue;
+        }
+        if (line == "done") {
+            if (!common.empty() && detailed) out.packet("ACK " + last_common + "\n");
+            else if (common.empty()) out.packet("NAK\n");
+            break;
+        }
+        ObjectId id;
+        if (line.rfind("have ", 0) != 0 || !ObjectId::parse(line.substr(5), id)) {
+            throw std::runtime_error("upload-pack: unexpected '" + line + "'");
+        }
+        if (!db.contains(id)) {
+            got_other = true;
+            if (detailed && ready()) out.packet("ACK " + id.hex() + " ready\n");
+            continue;
+        }
+        got_common = true;
+        last_common = id.hex();
+        bool first = common.empty();
+        common.push_back(id);
+        if (detailed) out.packet("ACK " + last_common + " common\n");
+        else if (first) out.packet("ACK " + last_common + "\n");
+    }
+
+    // 3. The pack, framed as the client asked
+    if (capabilities.count("side-band-64k")) out.band_limit = 65520;
+    else if (capabilities.count("side-band")) out.band_limit = 1000;
+    out.progress = !capabilities.count("no-progress");
+    try {
+        request.common = common;
+        std::unordered_set<ObjectId> client_objects;
+        std::vector<PackCandidate> objects = enumerate_for_upload(db, commits, request, out, &client_objects);
+        stream_pack(db, objects, capabilities.count("ofs-delta"), out,
+                    capabilities.count("thin-pack") ? &client_objects : nullptr);
+        if (out.band_limit) out.flush_packet();
+    } catch (const std::exception& e) {
+        out.error(std::string("upload-pack: ") + e.what());
+    }
+    out.finish();
+}
+
+// protocol v2: capabilities go out in place of the refs, which the client then asks for with ls-refs
+void advertise_v2_capabilities(UploadPackOutput& out) {
+    out.packet("version 2\n");
+    out.packet("agent=proto_git/1.0\n");
+    out.packet("ls-refs\n");
+    out.packet("fetch=shallow filter\n");
+    out.packet("object-format=sha1\n");
+    out.flush_packet();
+}
+
+// ls-refs: "<id> <name>" for HEAD and the refs under any requested prefix, with symref-target on
+// HEAD when asked for symrefs and peeled on annotated tags when asked to peel
+void ls_refs_v2(const std::filesystem::path& git_dir, const std::vector<std::string>& arguments, UploadPackOutput& out) {
+    bool symrefs = false, peel = false;
+    std::vector<std::string> prefixes;
+    for (const std::string& arg : arguments) {
+        if (arg == "symrefs") symrefs = true;
+        else if (arg == "peel") peel = true;
+        else if (arg.rfind("ref-prefix ", 0) == 0) prefixes.push_back(arg.substr(11));
+    }
+
+    ObjectDatabase db(git_dir / "objects");
+    std::vector<std::pair<std::string, ObjectId>> refs;
+    if (auto head = read_ref("HEAD", git_dir)) refs.emplace_back("HEAD", *head);
+    for (auto& ref : list_refs(git_dir)) refs.push_back(std::move(ref));
+    for (const auto& [name, id] : refs) {
+        if (!prefixes.empty() && std::none_of(prefixes.begin(), prefixes.end(),
+                                              [&name](const std::string& p) { return name.rfind(p, 0) == 0; })) {
+            continue;
+        }
+        std::string line = id.hex() + " " + name;
+        if (symrefs && name == "HEAD") {
+            std::ifstream head_file(git_dir / "HEAD");
+            std::string head_line;
+            if (std::getline(head_file, head_line) && head_line.rfind("ref: ", 0) == 0) {
+                line += " symref-target:" + head_line.substr(5);
+            }
+        }
+        if (peel) {
+            if (auto peeled = peel_tag_ref(db, name, id)) line += " peeled:" + peeled->hex();
+        }
+        out.packet(line + "\n");
+    }
+    out.flush_packet();
+}
+
+// fetch. without done the request is one round of negotiation: an acknowledgments section that
+// ends the response unless every want already descends from a common commit ("ready"). then a
+// shallow-info section for deepen, and the packfile section in side-band-64k frames
+void fetch_v2(const std::filesystem::path& git_dir, const std::vector<std::string>& arguments, UploadPackOutput& out) {
+    ObjectDatabase db(git_dir / "objects");
+    CommitIndex commits(db, git_dir / "objects" / "info" / "commit-graph", git_dir / "shallow");
+
+    // 1. Arguments
+    UploadRequest request;
+    std::vector<ObjectId> haves;
+    bool done = false, ofs_delta = false, thin = false, progress = true;
+    try {
+        for (const std::string& arg : arguments) {
+            size_t space = arg.find(' ');
+            std::string name = arg.substr(0, space);
+            std::string value = space == std::string::npos ? "" : arg.substr(space + 1);
+            ObjectId id;
+            bool has_id = ObjectId::parse(value, id);
+            if (name == "want" && has_id) {
+                if (!db.contains(id)) throw std::runtime_error("not our ref " + id.hex());
+                request.wants.push_back(id);
+            } else if (name == "have" && has_id) {
+                haves.push_back(id);
+            } else if (name == "shallow" && has_id) {
+                request.client_shallow.insert(id);
+            } else if (name == "deepen") {
+                request.depth = std::stoi(value);
+                if (request.depth <= 0) throw std::runtime_error("invalid deepen " + value);
+            } else if (arg == "deepen-relative") {
+                request.deepen_relative = true;
+            } else if (name == "filter") {
+                request.blob_limit = parse_blob_filter(value);
+            } else if (arg == "done") {
+                done = true;
+            } else if (arg == "ofs-delta") {
+                ofs_delta = true;
+            } else if (arg == "no-progress") {
+                progress = false;
+            } else if (arg == "thin-pack") {
+                thin = true;
+            } else if (arg != "include-tag") {
+                throw std::runtime_error("unsupported argument '" + arg + "'");
+            }
+        }
+        if (request.wants.empty()) throw std::runtime_error("no wants");
+    } catch (const std::exception& e) {
+        out.packet(std::string("ERR upload-pack: ") + e.what() + "\n");
+        return;
+    }
+
+    // 2. Acknowledgments, unless the client is done negotiating
+    for (const ObjectId& have : haves) {
+        if (db.contains(have)) request.common.push_back(have);
+    }
+    if (!done) {
+        out.packet("acknowledgments\n");
+        if (request.common.empty()) out.packet("NAK\n");
+        for (const ObjectId& id : request.common) out.packet("ACK " + id.hex() + "\n");
+        bool ready = !request.common.empty() &&
+                     std::all_of(request.wants.begin(), request.wants.end(), [&](const ObjectId& want) {
+                         return descends_from_common(db, commits, want, request.common);
+                     });
+        if (!ready) {
+            out.flush_packet();
+            return;
+        }
+        out.packet("ready\n");
+        out.delim_packet();
+    }
+
+    // 3. Where the history is cut; a client's shallow commit that now gets its parents is unshallowed
+    if (request.depth > 0) {
+        limit_depth(db, commits, request);
+        out.packet("shallow-info\n");
+        send_shallow_update(commits, request, out);
+        out.delim_packet();
+    }
+
+    // 4. The pack
+    out.packet("packfile\n");
+    out.band_limit = 65520;
+    out.progress = progress;
+    try {
+        std::unordered_set<ObjectId> client_objects;
+        std::vector<PackCandidate> objects = enumerate_for_upload(db, commits, request, out, &client_objects);
+        stream_pack(db, objects, ofs_delta, out, thin ? &client_objects : nullptr);
+    } catch (const std::exception& e) {
+        out.error(std::string("upload-pack: ") + e.what());
+    }
+    out.flush_packet();
+}
+
+// protocol v2 after the capability advertisement: requests of "command=<name>", capabilities, a
+// delimiter and the command's arguments, ended by a flush. stateless (HTTP) serves one request;
+// otherwise requests are served until the client sends a bare flush or hangs up
+void upload_pack_v2(const std::filesystem::path& git_dir, PktReader& in, UploadPackOutput& out, bool stateless) {
+    TraceSpan span("upload-pack");
+    for (;;) {
+        std::string line, command;
+        PktReader::Result r = in.read(line);
+        if (r != PktReader::Result::Line) return;
+        if (line.rfind("command=", 0) != 0) {
+            out.packet("ERR upload-pack: expected a command, got '" + line + "'\n");
+            return;
+        }
+        command = line.substr(8);
+        std::vector<std::string> arguments;
+        bool in_arguments = false;
+        while ((r = in.read(line)) != PktReader::Result::Flush) {
+            if (r == PktReader::Result::End) throw std::runtime_error("upload-pack: client hung up mid-request");
+            if (r == PktReader::Result::Delim) in_arguments = true;
+            else if (in_arguments) arguments.push_back(line);
+            // capabilities (agent, object-format) before the delimiter need no action
+        }
+
+        if (command == "ls-refs") ls_refs_v2(git_dir, arguments, out);
+        else if (command == "fetch") fetch_v2(git_dir, arguments, out);
+        else out.packet("ERR upload-pack: unknown command '" + command + "'\n");
+        if (stateless) return;
+        out.flush();
+    }
+}
+
+// the protocol version a client asked for ("version=2" in Git-Protocol / $GIT_PROTOCOL)
+bool wants_protocol_v2(const std::string& git_protocol) {
+    std::istringstream fields(git_protocol);
+    for (std::string field; std::getline(fields, field, ':');) {
+        if (field == "version=2") return true;
+    }
+    return false;
+}
+
+// http-backend
+// a minimal HTTP/1.1 server for the smart protocol: GET <repo>/info/refs?service=git-upload-pack
+// and POST <repo>/git-upload-pack, with keep-alive, gzip and chunked request bodies and a chunked
+// response so the pack streams out as it is produced. each connection runs on a pool thread
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::string query;
+    std::map<std::string, std::string> headers; // names lowercased
+    std::string body;
+};
+
+class HttpConnection {
+public:
+    // request bodies (after gunzip) are capped like git's http.maxRequestBuffer default; a larger
+    // one is refused with std::length_error before it is buffered
+    static constexpr size_t MAX_BODY = 10 * 1024 * 1024;
+
+    explicit HttpConnection(int fd) : fd(fd) {}
+
+    // false when the client closed the connection between requests
+    bool read_request(HttpRequest& request) {
+        // 1. Request line and headers
+        size_t end;
+        while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (buffer.size() > 65536) throw std::runtime_error("HTTP headers too large");
+            if (!receive()) {
+                if (buffer.empty()) return false;
+                throw std::runtime_error("Connection closed mid-request");
+            }
+        }
+        std::istringstream head(buffer.substr(0, end));
+        buffer.erase(0, end + 4);
+        std::string line, version;
+        std::getline(head, line);
+        std::istringstream request_line(line);
+        std::string target;
+        request_line >> request.method >> target >> version;
+        size_t q = target.find('?');
+        request.path = target.substr(0, q);
+        request.query = q == std::string::npos ? "" : target.substr(q + 1);
+        request.headers.clear();
+        while (std::getline(head, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) continue;
+            std::string name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+            size_t value = line.find_first_not_of(' ', colon + 1);
+            request.headers[name] = value == std::string::npos ? "" : line.substr(value);
+        }
+
+        // 2. Body, by length or in chunks, then gunzipped if need be
+        request.body.clear();
+        if (header(request, "transfer-encoding") == "chunked") {
+            for (;;) {
+                std::string size_line = read_line();
+                size_t size = std::stoul(size_line, nullptr, 16);
+                if (size == 0) {
+                    while (!read_line().empty()) {} // trailers
+                    break;
+                }
+                if (size > MAX_BODY - request.body.size()) throw std::length_error("HTTP request body too large");
+                request.body += read_exact(size);
+                read_line();
+            }
+        } else if (!header(request, "content-length").empty()) {
+            size_t size = std::stoul(header(request, "content-length"));
+            if (size > MAX_BODY) throw std::length_error("HTTP request body too large");
+            request.body = read_exact(size);
+        }
+        if (header(request, "content-encoding") == "gzip") request.body = gunzip(request.body);
+        return true;
+    }
+
+    static std::string header(const HttpRequest& request, const std::string& name) {
+        auto it = request.headers.find(name);
+        return it == request.headers.end() ? "" : it->second;
+    }
+
+private:
+    int fd;
+    std::string buffer;
+
+    bool receive() {
+        char chunk[65536];
+        ssize_t n;
+        do {
+            n = recv(fd, chunk, sizeof(chunk), 0);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return false;
+        buffer.append(chunk, static_cast<size_t>(n));
+        return true;
+    }
+
+    std::string read_line() {
+        size_t eol;
+        while ((eol = buffer.find("\r\n")) == std::string::npos) {
+            if (!receive()) throw std::runtime_error("Connection closed mid-request");
+        }
+        std::string line = buffer.substr(0, eol);
+        buffer.erase(0, eol + 2);
+        return line;
+    }
+
+    std::string read_exact(size_t n) {
+        while (buffer.size() < n) {
+            if (!receive()) throw std::runtime_error("Connection closed mid-request");
+        }
+        std::string data = buffer.substr(0, n);
+        buffer.erase(0, n);
+        return data;
+    }
+
+    static std::string gunzip(const std::string& data) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) throw std::runtime_error("inflateInit2 failed");
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        zs.avail_in = static_cast<uInt>(data.size());
+        std::string out;
+        char chunk[65536];
+        int ret;
+        do {
+            zs.next_out = reinterpret_cast<Bytef*>(chunk);
+            zs.avail_out = sizeof(chunk);
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                inflateEnd(&zs);
+                throw std::runtime_error("Corrupt gzip request body");
+            }
+            out.append(chunk, sizeof(chunk) - zs.avail_out);
+            if (out.size() > MAX_BODY) {
+                inflateEnd(&zs);
+                throw std::length_error("HTTP request body too large");
+            }
+        } while (ret != Z_STREAM_END && (zs.avail_in > 0 || zs.avail_out == 0));
+        inflateEnd(&zs);
+        return out;
+    }
+};
+
+void send_http_response(int fd, int status, const std::string& content_type, const std::string& body) {
+    std::string reason = status == 200 ? "OK" : status == 403 ? "Forbidden" : status == 404 ? "Not Found" :
+                         status == 413 ? "Payload Too Large" : "Error";
+    std::string response = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n" +
+                           "Content-Type: " + content_type + "\r\n" +
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+                           "Cache-Control: no-cache\r\n\r\n" + body;
+    send_all(fd, response.data(), response.size());
+}
+
+// the repository a request path names, or an empty path when it isn't one below root: every
+// segment must be a plain name (no empty, "." or ".." segment, so "//tmp/x" can't become absolute)
+// and the canonical result, symlinks resolved, must still lie inside the canonical root
+std::filesystem::path repository_under_root(const std::filesystem::path& root, const std::string& repo) {
+    if (repo.size() < 2 || repo[0] != '/') return {};
+    std::filesystem::path relative;
+    std::istringstream segments(repo.substr(1));
+    for (std::string segment; std::getline(segments, segment, '/');) {
+        if (segment.empty() || segment == "." || segment == "..") return {};
+        relative /= segment;
+    }
+    if (repo.back() == '/') return {};
+
+    std::filesystem::path base = std::filesystem::weakly_canonical(root);
+    std::filesystem::path candidate = std::filesystem::weakly_canonical(base / relative);
+    auto [base_end, candidate_at] = std::mismatch(base.begin(), base.end(), candidate.begin(), candidate.end());
+    if (base_end != base.end()) return {};
+    return candidate;
+}
+
+// one client connection, possibly several requests over keep-alive
+void serve_http_connection(int fd, const std::filesystem::path& root) {
+    HttpConnection connection(fd);
+    HttpRequest request;
+    for (;;) {
+        try {
+            if (!connection.read_request(request)) break;
+        } catch (const std::length_error& e) {
+            send_http_response(fd, 413, "text/plain", std::string(e.what()) + "\n");
+            throw;
+        }
+        // 1. Route: <repo>/info/refs or <repo>/git-upload-pack, repo inside root
+        std::string path = request.path;
+        std::string repo, action;
+        for (const char* suffix : {"/info/refs", "/git-upload-pack", "/git-receive-pack"}) {
+            size_t n = strlen(suffix);
+            if (path.size() > n && path.compare(path.size() - n, n, suffix) == 0) {
+                repo = path.substr(0, path.size() - n);
+                action = suffix;
+            }
+        }
+        std::filesystem::path git_dir;
+        try {
+            std::filesystem::path dir;
+            if (!action.empty()) dir = repository_under_root(root, repo);
+            if (!dir.empty()) git_dir = find_git_dir(dir);
+        } catch (const std::exception&) {
+            // not a repository: 404 below
+        }
+        if (git_dir.empty() || action == "/git-receive-pack" ||
+            (action == "/info/refs" && (request.method != "GET" || request.query != "service=git-upload-pack")) ||
+            (action == "/git-upload-pack" && request.method != "POST")) {
+            send_http_response(fd, action == "/git-receive-pack" ? 403 : 404, "text/plain", "Not found\n");
+            continue;
+        }
+
+        // 2. Smart protocol; v2 when the client asks for it in the Git-Protocol header
+        bool v2 = wants_protocol_v2(HttpConnection::header(request, "git-protocol"));
+        if (action == "/info/refs") {
+            std::string head = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: application/x-git-upload-pack-advertisement\r\n"
+                               "Cache-Control: no-cache\r\nTransfer-Encoding: chunked\r\n\r\n";
+            send_all(fd, head.data(), head.size());
+            UploadPackOutput out(fd, true, true);
+            if (v2) {
+                advertise_v2_capabilities(out); // like git http-backend: no service line in v2
+            } else {
+                out.packet("# service=git-upload-pack\n");
+                out.flush_packet();
+                advertise_refs(git_dir, out);
+            }
+            out.finish();
+        } else {
+            std::string head = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: application/x-git-upload-pack-result\r\n"
+                               "Cache-Control: no-cache\r\nTransfer-Encoding: chunked\r\n\r\n";
+            send_all(fd, head.data(), head.size());
+            UploadPackOutput out(fd, true, true);
+            size_t consumed = 0;
+            PktReader in([&request, &consumed](char* buf, size_t n) {
+                size_t take = std::min(n, request.body.size() - consumed);
+                memcpy(buf, request.body.data() + consumed, take);
+                consumed += take;
+                return take;
+            });
+            if (v2) upload_pack_v2(git_dir, in, out, true);
+            else upload_pack(git_dir, in, out, true);
+            out.finish();
+        }
+        if (HttpConnection::header(request, "connection") == "close") break;
+    }
+}
+
+void http_backend(const std::filesystem::path& root, const std::string& address, int port, size_t jobs) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (fd < 0 || inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        std::string error = strerror(errno);
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("http-backend: cannot listen on " + address + ":" + std::to_string(port) + ": " + error);
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    std::cout << "Serving " << std::filesystem::absolute(root).string() << " on http://" << address << ":"
+              << ntohs(addr.sin_port) << "/" << std::endl;
 
-    // 3. Zlib Compress
-    uLongf compressed_size = compressBound(full_data.size());
-    std::vector<char> compressed(compressed_size);
-    compress(reinterpret_cast<Bytef*>(compressed.data()), &compressed_size, 
-             reinterpret_cast<const Bytef*>(full_data.data()), full_data.size());
-    compressed.resize(compressed_size);
+    ThreadPool pool(jobs);
+    for (;;) {
+        int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) continue;
+            throw std::runtime_error(std::string("http-backend: accept failed: ") + strerror(errno));
+        }
+        // an idle or stalled client can't hold a pool thread forever
+        timeval timeout{60, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        pool.submit([client, root] {
+            try {
+                serve_http_connection(client, root);
+            } catch (const std::exception& e) {
+                std::cerr << "http-backend: " << e.what() << '\n';
+            }
+            close(client);
+        });
+    }
+}
 
-    // 4. Write to Disk
-    std::string dir = sha.substr(0, 2);
-    std::string file = sha.substr(2);
-    std::filesystem::create_directories(".git/objects/" + dir);
-    std::ofstream out(".git/objects/" + dir + "/" + file, std::ios::binary);
-    out.write(compressed.data(), compressed.size());
+// benchmark suite
+// bench repo writes a deterministic synthetic work tree; bench suite times the object pipeline
+// stages in process and every command end to end as a child process of this binary (so each one
+// reports its own peak RSS), and prints a table or one JSON object per result; bench compare
+// diffs two such JSON files so runs can be checked against each other for regressions
+struct SyntheticRepoSpec {
+    size_t files = 2000;
+    size_t mean_size = 4096;
+    std::string distribution = "lognormal"; // fixed | uniform | lognormal
+    size_t depth = 3;                       // deepest directory level
+    double compressibility = 0.7;           // share of 4 KiB blocks that are text rather than random bytes
+    uint64_t seed = 1;
+};
 
-    return sha;
+// consumes one --files= / --size= / --dist= / --depth= / --compressibility= / --seed= option
+bool parse_repo_spec_option(const std::string& arg, SyntheticRepoSpec& spec) {
+    auto value = [&](const char* name) -> const char* {
+        size_t n = strlen(name);
+        return arg.compare(0, n, name) == 0 ? arg.c_str() + n : nullptr;
+    };
+    if (const char* v = value("--files=")) spec.files = std::stoul(v);
+    else if (const char* v = value("--size=")) spec.mean_size = std::stoul(v);
+    else if (const char* v = value("--dist=")) spec.distribution = v;
+    else if (const char* v = value("--depth=")) spec.depth = std::stoul(v);
+    else if (const char* v = value("--compressibility=")) spec.compressibility = std::stod(v);
+    else if (const char* v = value("--seed=")) spec.seed = std::stoull(v);
+    else return false;
+    if (spec.distribution != "fixed" && spec.distribution != "uniform" && spec.distribution != "lognormal") {
+        throw std::runtime_error("Unknown size distribution: " + spec.distribution);
+    }
+    return true;
 }
 
-// tree struct
-struct TreeEntry {
-    std::string mode;
-    std::string name;
-    std::vector<unsigned char> hash_bytes; // 20 bytes SHA-1 hash
-    // comparator for sorting
-    bool operator<(const TreeEntry& other) const {
-        return name < other.name;
+// the same xorshift64 as fill_pseudo_random, as a stream of draws
+struct BenchRng {
+    uint64_t x;
+    explicit BenchRng(uint64_t seed) : x(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+    uint64_t next() {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return x;
     }
+    double uniform() { return static_cast<double>(next() >> 11) / 9007199254740992.0; } // [0, 1)
 };
 
-// hex to 20-byte hashing
-std::vector<unsigned char> hexToBytes(const std::string& hex) {
-    std::vector<unsigned char> bytes;
-    for (size_t i = 0; i < hex.length(); i += 2) {
-        std::string byteString = hex.substr(i, 2);
-        unsigned char byte = static_cast<unsigned char>(strtol(byteString.c_str(), nullptr, 16));
-        bytes.push_back(byte);
-    }
-    return bytes;
+size_t synthetic_size(const SyntheticRepoSpec& spec, BenchRng& rng) {
+    if (spec.distribution == "fixed") return spec.mean_size;
+    if (spec.distribution == "uniform") return static_cast<size_t>(rng.uniform() * 2 * spec.mean_size);
+    // lognormal with sigma 1 and the requested mean: many small files, a few large ones
+    const double sigma = 1.0;
+    double mu = std::log(std::max<size_t>(spec.mean_size, 1)) - sigma * sigma / 2;
+    double z = std::sqrt(-2 * std::log(1 - rng.uniform())) * std::cos(2 * M_PI * rng.uniform());
+    return std::min<size_t>(static_cast<size_t>(std::exp(mu + sigma * z)), 64 * spec.mean_size);
 }
 
-// function to hash a file as blob and return hex string
-std::string hash_file_as_blob(const std::filesystem::path& filePath) {
-    // 1. Read file content
-    std::ifstream inputFile(filePath, std::ios::binary);
-    if (!inputFile.is_open()) {
-        throw std::runtime_error("Failed to open file: " + filePath.string());
+void synthetic_content(const SyntheticRepoSpec& spec, BenchRng& rng, size_t size, std::vector<char>& out) {
+    out.resize(size);
+    for (size_t at = 0; at < size; at += 4096) {
+        size_t n = std::min<size_t>(4096, size - at);
+        if (rng.uniform() < spec.compressibility) fill_pseudo_text(out.data() + at, n, rng.next());
+        else fill_pseudo_random(out.data() + at, n, rng.next());
     }
-    std::vector<char> fileData((std::istreambuf_iterator<char>(inputFile)), std::istreambuf_iterator<char>());
-    inputFile.close();
+}
+
+struct SyntheticRepo {
+    std::vector<std::string> files; // relative paths
+    uint64_t bytes = 0;
+};
 
-    // 2. Create blob object (header + content)
-    std::string header = "blob " + std::to_string(fileData.size()) + '\0';
-    std::vector<char> objectData(header.begin(), header.end());
-    objectData.insert(objectData.end(), fileData.begin(), fileData.end());
+// a fresh repository at dir holding spec.files files; the same spec always gives the same tree
+SyntheticRepo generate_synthetic_repo(const SyntheticRepoSpec& spec, const std::filesystem::path& dir) {
+    if (std::filesystem::exists(dir / ".git")) throw std::runtime_error("Refusing to generate into existing repository " + dir.string());
+    std::filesystem::create_directories(dir / ".git" / "objects");
+    std::filesystem::create_directories(dir / ".git" / "refs" / "heads");
+    std::ofstream(dir / ".git" / "HEAD") << "ref: refs/heads/main\n";
 
-    // 3. Compute SHA-1 hash (Binary)
-    unsigned char hash[20];
-    SHA1(reinterpret_cast<const unsigned char*>(objectData.data()), objectData.size(), hash);
+    // 1. Directory fan-out so that the deepest level holds about eight files per directory
+    BenchRng rng(spec.seed);
+    size_t width = spec.depth == 0 ? 1 : std::max<size_t>(2, static_cast<size_t>(std::ceil(std::pow(spec.files / 8.0, 1.0 / spec.depth))));
 
-    // 4. Convert binary hash to hex string
-    std::ostringstream hashHex;
-    for (int i = 0; i < 20; ++i) {
-        hashHex << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    // 2. Files
+    SyntheticRepo repo;
+    std::vector<char> content;
+    for (size_t i = 0; i < spec.files; i++) {
+        std::string path;
+        size_t levels = spec.depth == 0 ? 0 : rng.next() % (spec.depth + 1);
+        for (size_t l = 0; l < levels; l++) path += "dir" + std::to_string(rng.next() % width) + "/";
+        path += "file" + std::to_string(i) + ".txt";
+
+        synthetic_content(spec, rng, synthetic_size(spec, rng), content);
+        std::filesystem::create_directories((dir / path).parent_path());
+        std::ofstream out(dir / path, std::ios::binary | std::ios::trunc);
+        out.write(content.data(), content.size());
+        if (!out) throw std::runtime_error("Failed to write " + (dir / path).string());
+        repo.files.push_back(path);
+        repo.bytes += content.size();
     }
-    std::string hashStr = hashHex.str();
+    return repo;
+}
+
+struct BenchResult {
+    std::string name;
+    uint64_t ops = 0;      // operations in the timed run(s)
+    uint64_t bytes = 0;    // bytes processed by them
+    double seconds = 0;
+    long peak_rss_kb = 0;
 
-    // 5. Compress data using zlib
-    uLongf compressedSize = compressBound(objectData.size());
-    std::vector<char> compressedData(compressedSize);
-    compress(reinterpret_cast<Bytef*>(compressedData.data()), &compressedSize, 
-             reinterpret_cast<const Bytef*>(objectData.data()), objectData.size());
-    compressedData.resize(compressedSize);
+    double ns_per_op() const { return ops ? seconds * 1e9 / ops : 0; }
+    double mb_per_s() const { return seconds > 0 ? bytes / seconds / 1e6 : 0; }
+};
 
-    // 6. Store object in .git/objects/xx/xxxx...
-    std::string dir = hashStr.substr(0, 2);
-    std::string file = hashStr.substr(2);
-    std::filesystem::path objectDir = std::filesystem::path(".git/objects") / dir;
-    std::filesystem::create_directories(objectDir);
+long peak_rss_kb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
 
-    std::ofstream objectFile(objectDir / file, std::ios::binary);
-    objectFile.write(compressedData.data(), compressedData.size());
-    objectFile.close();
+// runs this binary with args in cwd, stdin from stdin_file (or /dev/null) and stdout into
+// stdout_file (or /dev/null); fails unless it exits with 0. returns the wall time and peak RSS
+std::pair<double, long> run_self(const std::vector<std::string>& args, const std::filesystem::path& cwd,
+                                 const std::string& stdin_file = "", const std::string& stdout_file = "") {
+    std::vector<char*> argv;
+    std::string self = "proto_git";
+    argv.push_back(self.data());
+    std::vector<std::string> copy = args;
+    for (auto& a : copy) argv.push_back(a.data());
+    argv.push_back(nullptr);
 
-    return hashStr;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) throw std::runtime_error(std::string("bench: fork failed: ") + strerror(errno));
+    if (pid == 0) {
+        int in = open(stdin_file.empty() ? "/dev/null" : stdin_file.c_str(), O_RDONLY);
+        int out = stdout_file.empty() ? open("/dev/null", O_WRONLY) : open(stdout_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int null = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0 || null < 0 || chdir(cwd.c_str()) != 0) _exit(127);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv("/proc/self/exe", argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    rusage usage{};
+    if (wait4(pid, &status, 0, &usage) < 0) throw std::runtime_error(std::string("bench: wait4 failed: ") + strerror(errno));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::string command;
+        for (const auto& a : args) command += " " + a;
+        throw std::runtime_error("bench: '" + command.substr(1) + "' failed in " + cwd.string());
+    }
+    return {seconds, usage.ru_maxrss};
 }
 
-// recursive write-tree function
-std::string write_tree_recursive(std::filesystem::path current_path) {
-    std::vector<TreeEntry> entries;
+std::string read_first_line(const std::filesystem::path& file) {
+    std::ifstream in(file);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
 
-    for (const auto& entry : std::filesystem::directory_iterator(current_path)) {
-        std::string name = entry.path().filename().string();
-        
-        // 1. Skip the .git directory to avoid recursion loops
-        if (name == ".git") continue;
+// in-process timings of each pipeline stage over objects drawn like the synthetic repo's files
+void bench_micro(const SyntheticRepoSpec& spec, std::vector<BenchResult>& results) {
+    // 1. Up to 1000 objects; about 0.3 s per stage
+    BenchRng rng(spec.seed);
+    size_t count = std::min<size_t>(spec.files, 1000);
+    std::vector<std::vector<char>> objects(count);
+    uint64_t total = 0;
+    for (auto& o : objects) {
+        synthetic_content(spec, rng, synthetic_size(spec, rng), o);
+        total += o.size();
+    }
+    auto stage = [&](const std::string& name, uint64_t ops, uint64_t bytes, const std::function<void()>& fn) {
+        fn(); // warm-up
+        auto [rounds, seconds] = time_rounds(fn, 0.3);
+        results.push_back({"micro/" + name, ops * rounds, bytes * rounds, seconds, peak_rss_kb()});
+    };
 
-        TreeEntry te;
-        te.name = name;
+    stage("sha1", count, total, [&] {
+        for (const auto& o : objects) {
+            Sha1Stream sha;
+            sha.update("blob " + std::to_string(o.size()) + '\0');
+            sha.update(o.data(), o.size());
+            sha.digest();
+        }
+    });
 
-        if (entry.is_directory()) {
-            te.mode = "40000"; // Mode for directories
-            // Recursive call returns the hex hash of the sub-tree
-            std::string sub_tree_hash = write_tree_recursive(entry.path());
-            te.hash_bytes = hexToBytes(sub_tree_hash);
-        } else {
-            te.mode = "100644"; // Mode for regular files
-            // Use your existing hash-object logic to get file hash
-            std::string file_hash = hash_file_as_blob(entry.path()); 
-            te.hash_bytes = hexToBytes(file_hash);
+    std::vector<std::vector<char>> compressed(count);
+    stage("deflate", count, total, [&] {
+        for (size_t i = 0; i < count; i++) {
+            compress_buffer(objects[i].data(), objects[i].size(), choose_level(objects[i].data(), objects[i].size()), compressed[i]);
         }
-        entries.push_back(te);
+    });
+
+    std::vector<char> inflated;
+    stage("inflate", count, total, [&] {
+        for (size_t i = 0; i < count; i++) {
+            inflated.resize(objects[i].size());
+            uLongf n = inflated.size();
+            if (uncompress(reinterpret_cast<Bytef*>(inflated.data()), &n,
+                           reinterpret_cast<const Bytef*>(compressed[i].data()), compressed[i].size()) != Z_OK) {
+                throw std::runtime_error("bench: inflate failed");
+            }
+        }
+    });
+
+    // 2. Id round trips and tree parsing
+    std::vector<ObjectId> ids(count);
+    for (size_t i = 0; i < count; i++) ids[i] = compute_object_id(OBJ_BLOB, objects[i]);
+    stage("object-id-hex", count, count * ObjectId::HEX_SIZE, [&] {
+        char hex[ObjectId::HEX_SIZE];
+        for (const auto& id : ids) {
+            id.to_hex(hex);
+            ObjectId back;
+            if (!ObjectId::parse(hex, ObjectId::HEX_SIZE, back) || back != id) throw std::runtime_error("bench: id round trip failed");
+        }
+    });
+
+    std::vector<char> tree;
+    for (size_t i = 0; i < count; i++) {
+        std::string entry = "100644 file" + std::to_string(i) + ".txt";
+        tree.insert(tree.end(), entry.begin(), entry.end());
+        tree.push_back('\0');
+        tree.insert(tree.end(), ids[i].bytes.begin(), ids[i].bytes.end());
     }
+    stage("tree-parse", count, tree.size(), [&] {
+        size_t n = 0;
+        for (const TreeView::Entry& e : TreeView(tree)) n += e.name.size();
+        if (n == 0) throw std::runtime_error("bench: empty tree");
+    });
 
-    // 2. Sort entries alphabetically by name
-    std::sort(entries.begin(), entries.end());
+    // 3. Deltas between each object and a copy with a few bytes changed, as gc searches for
+    uint64_t delta_bytes = 0;
+    std::vector<std::vector<char>> edited(objects);
+    for (auto& e : edited) {
+        for (size_t k = 0; k < 4 && !e.empty(); k++) e[rng.next() % e.size()] ^= 0x5A;
+        delta_bytes += e.size();
+    }
+    stage("delta-create", count, delta_bytes, [&] {
+        for (size_t i = 0; i < count; i++) create_delta(objects[i], edited[i], edited[i].size());
+    });
+}
 
-    // 3. Construct the binary buffer
-    std::vector<char> tree_content;
-    for (const auto& e : entries) {
-        std::string line = e.mode + " " + e.name + '\0';
-        tree_content.insert(tree_content.end(), line.begin(), line.end());
-        tree_content.insert(tree_content.end(), e.hash_bytes.begin(), e.hash_bytes.end());
+// end to end: every command as a child process against a generated repository under work
+void bench_end_to_end(const SyntheticRepoSpec& spec, const std::filesystem::path& work, size_t runs,
+                      std::vector<BenchResult>& results) {
+    // 1. The repository, and the inputs the commands read
+    std::filesystem::path repo_dir = work / "repo";
+    SyntheticRepo repo = generate_synthetic_repo(spec, repo_dir);
+    std::string paths_file = (work / "paths.txt").string();
+    {
+        std::ofstream paths(paths_file);
+        for (const auto& f : repo.files) paths << f << '\n';
     }
+    auto remove_objects = [&] {
+        std::filesystem::remove_all(repo_dir / ".git" / "objects");
+        std::filesystem::create_directories(repo_dir / ".git" / "objects");
+        std::filesystem::remove(repo_dir / ".git" / "index");
+    };
 
-    // 4. Create header, hash, compress, and store (Just like hash-object)
-    std::string header = "tree " + std::to_string(tree_content.size()) + '\0';
+    // best of runs; setup is not timed
+    auto command = [&](const std::string& name, const std::vector<std::string>& args, uint64_t ops, uint64_t bytes,
+                       const std::function<void()>& setup, const std::string& stdin_file = "") {
+        BenchResult r{"e2e/" + name, ops, bytes, 0, 0};
+        for (size_t i = 0; i < runs; i++) {
+            if (setup) setup();
+            auto [seconds, rss] = run_self(args, repo_dir, stdin_file);
+            if (i == 0 || seconds < r.seconds) r.seconds = seconds;
+            r.peak_rss_kb = std::max(r.peak_rss_kb, rss);
+        }
+        results.push_back(r);
+    };
+
+    size_t n = repo.files.size();
+    command("hash-object", {"hash-object", "-w", "--stdin-paths"}, n, repo.bytes, remove_objects, paths_file);
+    command("write-tree-cold", {"write-tree"}, n, repo.bytes, remove_objects);
+    command("write-tree-cold-j", {"write-tree", "-j", "0"}, n, repo.bytes, remove_objects);
+    command("write-tree-warm", {"write-tree"}, n, repo.bytes, nullptr);
 
-    // 1. Prepare the final buffer (Header + Content)
-    std::vector<char> final_buffer;
-    final_buffer.insert(final_buffer.end(), header.begin(), header.end());
-    final_buffer.insert(final_buffer.end(), tree_content.begin(), tree_content.end());
+    // 2. A commit on main, and the list of every loose object
+    std::string out_file = (work / "out.txt").string();
+    run_self({"write-tree"}, repo_dir, "", out_file);
+    std::string tree = read_first_line(out_file);
+    run_self({"commit-tree", tree, "-m", "bench"}, repo_dir, "", out_file);
+    std::ofstream(repo_dir / ".git" / "refs" / "heads" / "main") << read_first_line(out_file) << '\n';
+
+    std::string ids_file = (work / "ids.txt").string();
+    size_t objects = 0;
+    {
+        std::ofstream ids(ids_file);
+        for (const auto& fanout : std::filesystem::directory_iterator(repo_dir / ".git" / "objects")) {
+            std::string dir = fanout.path().filename().string();
+            if (dir.size() != 2) continue;
+            for (const auto& obj : std::filesystem::directory_iterator(fanout.path())) {
+                ids << dir << obj.path().filename().string() << '\n';
+                objects++;
+            }
+        }
+    }
+    command("cat-file-batch-loose", {"cat-file", "--batch"}, objects, repo.bytes, nullptr, ids_file);
+    command("ls-tree-r", {"ls-tree", "-r", "-l", tree}, n, 0, nullptr);
 
-    // calculating the sha 20 byte hash 
-    unsigned char hash[20];
-    SHA1(reinterpret_cast<const unsigned char*>(final_buffer.data()), final_buffer.size(), hash);
+    // 3. Packing, from the same loose objects each run
+    std::filesystem::path objects_dir = repo_dir / ".git" / "objects";
+    std::filesystem::path saved = work / "objects";
+    std::filesystem::copy(objects_dir, saved, std::filesystem::copy_options::recursive);
+    command("gc", {"gc"}, objects, repo.bytes, [&] {
+        std::filesystem::remove_all(objects_dir);
+        std::filesystem::copy(saved, objects_dir, std::filesystem::copy_options::recursive);
+    });
+    command("cat-file-batch-packed", {"cat-file", "--batch"}, objects, repo.bytes, nullptr, ids_file);
 
-    // 3. Convert 20-byte binary to 40-character hex string
-    std::ostringstream hashHex;
-    for (int i = 0; i < 20; ++i) {
-        hashHex << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    // 4. Indexing the pack gc wrote
+    std::filesystem::path pack;
+    for (const auto& entry : std::filesystem::directory_iterator(objects_dir / "pack")) {
+        if (entry.path().extension() == ".pack") pack = entry.path();
     }
-    std::string final_hex_hash = hashHex.str();
+    std::filesystem::path copy = work / "bench.pack";
+    std::filesystem::copy_file(pack, copy);
+    command("index-pack", {"index-pack", copy.string()}, objects, std::filesystem::file_size(copy),
+            [&] { std::filesystem::remove(work / "bench.idx"); });
+}
 
-    // 4. Compress the final_buffer using zlib
-    uLongf compressedSize = compressBound(final_buffer.size());
-    std::vector<char> compressedData(compressedSize);
-    if (compress(reinterpret_cast<Bytef*>(compressedData.data()), &compressedSize, 
-                reinterpret_cast<const Bytef*>(final_buffer.data()), final_buffer.size()) != Z_OK) {
-        throw std::runtime_error("Compression failed for tree object");
+void print_bench_results(const std::vector<BenchResult>& results, bool json) {
+    for (const auto& r : results) {
+        if (json) {
+            std::cout << std::fixed << std::setprecision(1) << "{\"name\":\"" << r.name << "\",\"ns_per_op\":" << r.ns_per_op()
+                      << ",\"mb_per_s\":" << r.mb_per_s() << ",\"ops\":" << r.ops << ",\"bytes\":" << r.bytes
+                      << ",\"peak_rss_kb\":" << r.peak_rss_kb << "}\n";
+        } else {
+            std::cout << std::left << std::setw(28) << r.name << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(14) << r.ns_per_op() << " ns/op" << std::setw(10) << r.mb_per_s() << " MB/s"
+                      << std::setw(10) << r.peak_rss_kb << " KB peak RSS\n";
+        }
     }
-    compressedData.resize(compressedSize);
+}
 
-    // 5. Write to disk (.git/objects/xx/xxxx...)
-    std::string dir = final_hex_hash.substr(0, 2);
-    std::string file = final_hex_hash.substr(2);
-    std::filesystem::path objectDir = std::filesystem::path(".git/objects") / dir;
-    std::filesystem::create_directories(objectDir);
+// bench suite: the generated repository lives in a temp directory that is removed afterwards
+void bench_suite(const SyntheticRepoSpec& spec, size_t runs, bool json) {
+    std::string work = (std::filesystem::temp_directory_path() / "proto_git_bench_XXXXXX").string();
+    if (!mkdtemp(work.data())) throw std::runtime_error(std::string("bench: mkdtemp failed: ") + strerror(errno));
+    std::vector<BenchResult> results;
+    try {
+        bench_micro(spec, results);
+        bench_end_to_end(spec, work, runs, results);
+    } catch (...) {
+        std::filesystem::remove_all(work);
+        throw;
+    }
+    std::filesystem::remove_all(work);
+    if (!json) {
+        std::cout << spec.files << " files, " << spec.distribution << " sizes around " << spec.mean_size << " bytes, depth "
+                  << spec.depth << ", compressibility " << spec.compressibility << ", seed " << spec.seed << "\n";
+    }
+    print_bench_results(results, json);
+}
 
-    std::ofstream objectFile(objectDir / file, std::ios::binary);
-    objectFile.write(compressedData.data(), compressedData.size());
-    objectFile.close();
+// name -> ns_per_op from a file written by bench suite --json
+std::map<std::string, double> load_bench_results(const std::string& file) {
+    std::ifstream in(file);
+    if (!in.is_open()) throw std::runtime_error("Failed to open " + file);
+    std::map<std::string, double> results;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t name = line.find("\"name\":\"");
+        size_t ns = line.find("\"ns_per_op\":");
+        if (name == std::string::npos || ns == std::string::npos) continue;
+        name += 8;
+        results[line.substr(name, line.find('"', name) - name)] = std::strtod(line.c_str() + ns + 12, nullptr);
+    }
+    return results;
+}
 
-    // 6. Return the hex hash so the parent tree can use it..!!
-    return final_hex_hash;
+// bench compare: per-result change in ns/op; false when anything got slower by more than threshold %
+bool bench_compare(const std::string& old_file, const std::string& new_file, double threshold) {
+    std::map<std::string, double> before = load_bench_results(old_file), after = load_bench_results(new_file);
+    bool ok = true;
+    for (const auto& [name, ns] : after) {
+        auto it = before.find(name);
+        if (it == before.end() || it->second <= 0) continue;
+        double change = (ns - it->second) / it->second * 100;
+        bool regressed = change > threshold;
+        ok = ok && !regressed;
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(14) << it->second << " -> " << std::setw(14) << ns << " ns/op" << std::showpos
+                  << std::setw(9) << change << "%" << std::noshowpos << (regressed ? "  REGRESSION" : "") << '\n';
+    }
+    return ok;
 }
 
 int main(int argc, char *argv[])
@@ -231,6 +8537,15 @@ int main(int argc, char *argv[])
     // You can use print statements as follows for debugging, they'll be visible when running tests.
     std::cerr << "Logs from your program will appear here!\n";
 
+    // PROTO_GIT_TRACE / PROTO_GIT_METRICS: the tracer is set up before anything can record into it,
+    // so it is torn down (and writes its output) after everything else
+    if (TRACING) {
+        std::string command_line;
+        for (int i = 1; i < argc; i++) command_line += (i > 1 ? " " : "") + std::string(argv[i]);
+        Tracer::get().set_command(command_line);
+    }
+    TraceSpan command_span(argc >= 2 ? argv[1] : "main");
+
     // TODO: Uncomment the code below to pass the first stage
     
     if (argc < 2) {
@@ -243,86 +8558,120 @@ int main(int argc, char *argv[])
     // handles git init command 
     if (command == "init") {
         try {
-            // Create .git directory structure
-            std::filesystem::create_directory(".git");
-            std::filesystem::create_directory(".git/objects");
-            std::filesystem::create_directory(".git/refs");
-    
-            // Create HEAD file
-            std::ofstream headFile(".git/HEAD");
-            if (headFile.is_open()) {
-                headFile << "ref: refs/heads/main\n";
-                headFile.close();
-            } else {
-                std::cerr << "Failed to create .git/HEAD file.\n";
-                return EXIT_FAILURE;
-            }
-    
+            init_repository();
             std::cout << "Initialized git directory\n";
-        } catch (const std::filesystem::filesystem_error& e) {
+        } catch (const std::exception& e) {
             std::cerr << e.what() << '\n';
             return EXIT_FAILURE;
         }
     } 
 
-    // handles git cat-file -p <object> command
+    // handles git cat-file -p <object> and cat-file --batch / --batch-check commands
     else if(command == "cat-file") {
-        if(argc < 4 || std::string(argv[2]) != "-p") {
+        std::string mode = argc >= 3 ? argv[2] : "";
+        bool batch = mode == "--batch" || mode == "--batch-check";
+        if(!batch && (argc < 4 || mode != "-p")) {
             std::cerr << "Usage: cat-file -p <object>\n";
-            std::cerr << "Unknown command " << command <<" "<< argv[2] << '\n';
+            std::cerr << "       cat-file (--batch | --batch-check) < <object ids>\n";
+            std::cerr << "Unknown command " << command <<" "<< mode << '\n';
             return EXIT_FAILURE;
         }
-        std::string objectHash = argv[3];
 
-        // Locate object file
-        std::string dir = objectHash.substr(0,2);
-        std::string file = objectHash.substr(2);
-        std::filesystem::path objectPath = std::filesystem::path(".git/objects") / dir / file;
+        ObjectDatabase db;
+        auto print = [](const char* data, size_t n) { std::cout.write(data, n); };
 
-        if(!std::filesystem::exists(objectPath)) {
-            std::cerr << "Object " << objectHash << " not found.\n";
-            return EXIT_FAILURE;
+        if (!batch) {
+            std::string objectHash = argv[3];
+            try {
+                enable_lazy_fetch(db);
+                auto any = [](const std::string&, size_t) { return true; };
+                ObjectId id;
+                if (!ObjectId::parse(objectHash, id) || !db.stream(id, any, print)) {
+                    std::cerr << "Object " << objectHash << " not found.\n";
+                    return EXIT_FAILURE;
+                }
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << '\n';
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
         }
 
-        // Read compressed object data
-        std::ifstream objectFile(objectPath, std::ios::binary);
-        std::vector<char> compressedData((std::istreambuf_iterator<char>(objectFile)), std::istreambuf_iterator<char>());
-
-
-        // Decompress object data using zlib
-        std::vector<char> decompressed_data(compressedData.size() * 10); 
-        z_stream zs;
-        memset(&zs, 0, sizeof(zs));
-        inflateInit(&zs);
-
-        zs.next_in = (Bytef*)compressedData.data();
-        zs.avail_in = compressedData.size();
-        zs.next_out = (Bytef*)decompressed_data.data();
-        zs.avail_out = decompressed_data.size();
-
-        inflate(&zs, Z_FINISH);
-        inflateEnd(&zs);        
+        // one object id per line on stdin; output is flushed per object, not per write. stdin is
+        // taken as whole lines as fast as it arrives, so in a partial clone the missing objects
+        // among everything already sent are fetched in one round trip
+        bool with_content = mode == "--batch";
+        std::cout << std::nounitbuf;
+        try {
+            enable_lazy_fetch(db);
+            std::string input;
+            std::vector<std::string> lines;
+            std::vector<ObjectId> ids;
+            char chunk[65536];
+            for (bool eof = false; !eof;) {
+                ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) throw std::runtime_error(std::string("Failed to read stdin: ") + strerror(errno));
+                eof = n == 0;
+                input.append(chunk, static_cast<size_t>(n));
+                if (eof && !input.empty() && input.back() != '\n') input.push_back('\n');
 
-        // Extract and print object content   
-        std::string decomp_str(decompressed_data.begin(), decompressed_data.begin() + zs.total_out);
-        size_t null_pos = decomp_str.find('\0');
-        std::string content = decomp_str.substr(null_pos + 1);
-        std::cout << content;
+                // 1. The complete lines so far
+                lines.clear();
+                ids.clear();
+                size_t begin = 0;
+                for (size_t eol; (eol = input.find('\n', begin)) != std::string::npos; begin = eol + 1) {
+                    lines.push_back(input.substr(begin, eol - begin));
+                    ObjectId id;
+                    if (ObjectId::parse(lines.back(), id)) ids.push_back(id);
+                }
+                input.erase(0, begin);
+                db.prefetch(ids);
+                db.preload(ids);
 
+                // 2. Their objects
+                for (const std::string& line : lines) {
+                    auto header = [&](const std::string& type, size_t size) {
+                        std::cout << line << ' ' << type << ' ' << size << '\n';
+                        return with_content;
+                    };
+                    ObjectId id;
+                    if (!ObjectId::parse(line, id) || !db.stream(id, header, print)) {
+                        std::cout << line << " missing\n";
+                    } else if (with_content) {
+                        std::cout << '\n';
+                    }
+                    std::cout.flush();
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cout.flush();
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
         return EXIT_SUCCESS;
     }
 
     // handles git hash-object -w <file> command
+    // (several files, or --stdin-paths for one path per line on stdin, are hashed as a batch)
     else if ( command == "hash-object"){
         if(argc < 4 || std::string(argv[2]) != "-w") {
-            std::cerr << "Usage: hash-object -w <file>\n";
-            std::cerr << "Unknown command " << command <<" "<< argv[2] << '\n';
+            std::cerr << "Usage: hash-object -w (<file>... | --stdin-paths)\n";
+            std::cerr << "Unknown command " << command <<" "<< (argc > 2 ? argv[2] : "") << '\n';
             return EXIT_FAILURE;
             }
         
         try {
-            std::string hashStr = hash_file_as_blob(argv[3]);
-            std::cout << hashStr << '\n';
+            std::vector<std::filesystem::path> files;
+            if (std::string(argv[3]) == "--stdin-paths") {
+                std::string line;
+                while (std::getline(std::cin, line)) files.push_back(line);
+            } else {
+                files.assign(argv + 3, argv + argc);
+            }
+            std::vector<ObjectId> ids = hash_files_as_blobs(files);
+            object_writer().flush();
+            for (const auto& id : ids) std::cout << id << '\n';
         } catch (const std::exception& e) {
             std::cerr << e.what() << '\n';
             return EXIT_FAILURE;
@@ -330,84 +8679,421 @@ int main(int argc, char *argv[])
         
     }
     
-    // handles git ls-tree --name-only <hash> command
+    // handles git ls-tree [-r] [-l] [--name-only] <tree-ish> command
     else if(command == "ls-tree") {
-        if(argc < 4 || std::string(argv[2]) != "--name-only") {
-            std::cerr << "Usage: ls-tree --name-only <object>\n";
-            std::cerr << "Unknown command " << command <<" "<< argv[2] << '\n';
+        LsTreeOptions options;
+        std::vector<std::string> operands;
+        bool usage_error = false;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "-r") options.recursive = true;
+            else if (arg == "-l" || arg == "--long") options.long_format = true;
+            else if (arg == "--name-only") options.name_only = true;
+            else if (arg.size() > 1 && arg[0] == '-') usage_error = true;
+            else operands.push_back(arg);
+        }
+        if (usage_error || operands.size() != 1) {
+            std::cerr << "Usage: ls-tree [-r] [-l] [--name-only] <tree-ish>\n";
             return EXIT_FAILURE;
         }
 
-        std::string objectHash = argv[3];
+        std::string objectHash = operands[0];
+        try {
+            // 1. A commit lists its tree
+            ObjectDatabase db;
+            enable_lazy_fetch(db); // -l reads the sizes of blobs a partial clone may not have
+            ObjectId id;
+            ObjectDatabase::Object object;
+            if (ObjectId::parse(objectHash, id)) object = db.read(id);
+            if (!object) {
+                std::cerr << "Object " << objectHash << " not found.\n";
+                return EXIT_FAILURE;
+            }
+            if (object.type == "commit") id = getTreeShaFromCommit(db, id);
+            else if (object.type != "tree") throw std::runtime_error("Not a tree object: " + objectHash);
 
-        // Locate object file
-        std::string dir = objectHash.substr(0,2);
-        std::string file = objectHash.substr(2);
-        std::filesystem::path objectPath = std::filesystem::path(".git/objects") / dir / file;
+            // 2. Entries
+            std::string prefix, out;
+            ls_tree(db, id, prefix, options, out);
+            std::cout.write(out.data(), out.size());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
 
-        if(!std::filesystem::exists(objectPath)) {
-            std::cerr << "Object " << objectHash << " not found.\n";
+    // handles git diff-tree [-r] [-p] [--name-only | --name-status] [--root] <tree-ish> [<tree-ish>] command
+    // and git diff [--raw | --name-only | --name-status] <rev> <rev> (or <rev>..<rev>)
+    else if(command == "diff-tree" || command == "diff") {
+        bool diff = command == "diff", recursive = diff, root = false;
+        DiffFormat format = diff ? DiffFormat::Patch : DiffFormat::Raw;
+        std::vector<std::string> operands;
+        bool usage_error = false;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "-r" && !diff) recursive = true;
+            else if ((arg == "-p" || arg == "-u" || arg == "--patch") && !diff) format = DiffFormat::Patch;
+            else if (arg == "--raw" && diff) format = DiffFormat::Raw;
+            else if (arg == "--name-only") format = DiffFormat::NameOnly;
+            else if (arg == "--name-status") format = DiffFormat::NameStatus;
+            else if (arg == "--root" && !diff) root = true;
+            else if (arg.size() > 1 && arg[0] == '-') usage_error = true;
+            else operands.push_back(arg);
+        }
+        if (diff && operands.size() == 1 && operands[0].find("..") != std::string::npos) {
+            std::string range = operands[0];
+            size_t dots = range.find("..");
+            operands = {range.substr(0, dots), range.substr(dots + 2)};
+        }
+        if (usage_error || operands.empty() || operands.size() > 2 || (diff && operands.size() != 2)) {
+            std::cerr << (diff ? "Usage: diff [--raw | --name-only | --name-status] <rev> <rev>\n"
+                               : "Usage: diff-tree [-r] [-p] [--name-only | --name-status] [--root] <tree-ish> [<tree-ish>]\n");
             return EXIT_FAILURE;
         }
+        if (format == DiffFormat::Patch) recursive = true;
 
-        // Read compressed object data
-        std::ifstream objectFile(objectPath, std::ios::binary);
-        std::vector<char> compressedData((std::istreambuf_iterator<char>(objectFile)), std::istreambuf_iterator<char>());
-    
-        // Decompress object data using zlib
-        std::vector<char> decompressed_data(compressedData.size() * 10);
-        z_stream zs;
-        memset(&zs, 0, sizeof(zs));
-        inflateInit(&zs);
-        zs.next_in = (Bytef*)compressedData.data();
-        zs.avail_in = compressedData.size();
-        zs.next_out = (Bytef*)decompressed_data.data();
-        zs.avail_out = decompressed_data.size();    
-        inflate(&zs, Z_FINISH);
-        inflateEnd(&zs);
+        try {
+            ObjectDatabase db;
+            enable_lazy_fetch(db);
+            std::string out;
+            ObjectId old_tree, new_tree;
+            if (operands.size() == 2) {
+                old_tree = resolve_tree(db, operands[0]);
+                new_tree = resolve_tree(db, operands[1]);
+            } else {
+                // 1. A single commit is compared with its parent, under its own id; merges and (without
+                // --root) root commits show nothing, as in git
+                ObjectId commit = resolve_commit(db, operands[0]);
+                ObjectDatabase::Object obj = db.read(commit, "commit");
+                CommitInfo info = parse_commit(obj.bytes(), obj.size(), commit);
+                if (info.parents.size() > 1 || (info.parents.empty() && !root)) return EXIT_SUCCESS;
+                if (!info.parents.empty()) old_tree = getTreeShaFromCommit(db, info.parents[0]);
+                new_tree = info.tree;
+                out = commit.hex() + "\n";
+            }
 
-        // Extract and print file names from tree object 
-        
-        auto it = std::find(decompressed_data.begin(), decompressed_data.begin() + zs.total_out, '\0');
-        if (it != decompressed_data.begin() + zs.total_out) {   it++;   }
+            // 2. Changes, then their report
+            std::vector<TreeChange> changes;
+            std::string prefix;
+            diff_trees(db, old_tree, new_tree, prefix, recursive, changes);
+            if (changes.empty()) return EXIT_SUCCESS;
+            write_tree_changes(db, changes, format, out);
+            std::cout.write(out.data(), out.size());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    // handles git index-pack [-j <jobs>] <pack-file> command
+    else if(command == "index-pack") {
+        size_t jobs = default_jobs();
+        int arg = 2;
+        if (argc == 5 && (std::string(argv[2]) == "-j" || std::string(argv[2]) == "--jobs") && parse_jobs(argv[3], jobs)) {
+            arg = 4;
+        } else if(argc != 3) {
+            std::cerr << "Usage: index-pack [-j <jobs>] <pack-file>\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            std::cout << index_pack(argv[arg], jobs) << '\n';
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    // handles git pack-objects [--window=<n>] [--depth=<n>] <base-name> command
+    // (object ids on stdin, one per line, optionally followed by the path they were found at)
+    // and git gc [--window=<n>] [--depth=<n>]
+    else if(command == "pack-objects" || command == "gc") {
+        size_t window = 10;
+        int depth = 50;
+        bool usage_error = false;
+        std::vector<std::string> operands;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.rfind("--window=", 0) == 0) usage_error |= !parse_number(arg.substr(9), window);
+            else if (arg.rfind("--depth=", 0) == 0) usage_error |= !parse_number(arg.substr(8), depth) || depth < 0;
+            else operands.push_back(arg);
+        }
+        if (command == "pack-objects" && (usage_error || operands.size() != 1)) {
+            std::cerr << "Usage: pack-objects [--window=<n>] [--depth=<n>] <base-name> < object-list\n";
+            return EXIT_FAILURE;
+        }
+        if (command == "gc" && (usage_error || !operands.empty())) {
+            std::cerr << "Usage: gc [--window=<n>] [--depth=<n>]\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            if (command == "gc") {
+                gc(window, depth);
+                ObjectDatabase db; // sees the new pack
+                if (size_t written = write_commit_graph(db)) std::cout << "Wrote commit-graph with " << written << " commits\n";
+            } else {
+                ObjectDatabase db;
+                std::vector<PackCandidate> objects;
+                std::set<ObjectId> seen;
+                std::string line;
+                while (std::getline(std::cin, line)) {
+                    ObjectId id = ObjectId::from_hex(line.substr(0, 40));
+                    if (!seen.insert(id).second) continue;
+                    PackCandidate c;
+                    auto header = [&c](const std::string& type, size_t size) {
+                        c.type = type == "commit" ? OBJ_COMMIT : type == "tree" ? OBJ_TREE : type == "blob" ? OBJ_BLOB : OBJ_TAG;
+                        c.size = size;
+                        return false; // the header is all we need for now
+                    };
+                    if (!db.stream(id, header, [](const char*, size_t) {})) {
+                        throw std::runtime_error("pack-objects: missing object " + id.hex());
+                    }
+                    c.id = id;
+                    c.name_hash = pack_name_hash(line.size() > 41 ? line.substr(41) : "");
+                    objects.push_back(std::move(c));
+                }
+                find_deltas(db, objects, window, depth);
+                std::cout << write_pack(db, objects, operands[0]) << '\n';
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    // handles bench (sha1 | compress | repo | suite | compare) ...
+    else if(command == "bench") {
+        std::string what = argc >= 3 ? argv[2] : "";
+        auto usage = [] {
+            std::cerr << "Usage: bench (sha1 | compress) [--size=<bytes>] [--count=<n>]\n"
+                      << "       bench repo [<repo options>] <dir>\n"
+                      << "       bench suite [<repo options>] [--runs=<n>] [--json]\n"
+                      << "       bench compare <old.json> <new.json> [--threshold=<percent>]\n"
+                      << "repo options: --files=<n> --size=<mean bytes> --dist=(fixed|uniform|lognormal)\n"
+                      << "              --depth=<n> --compressibility=<0..1> --seed=<n>\n";
+            return EXIT_FAILURE;
+        };
+        try {
+            if (what == "sha1" || what == "compress") {
+                size_t size = what == "sha1" ? 1024 : 64 * 1024;
+                size_t count = what == "sha1" ? 4096 : 64;
+                for (int i = 3; i < argc; i++) {
+                    std::string arg = argv[i];
+                    if (arg.rfind("--size=", 0) == 0) size = std::stoul(arg.substr(7));
+                    else if (arg.rfind("--count=", 0) == 0) count = std::stoul(arg.substr(8));
+                    else return usage();
+                }
+                if (what == "sha1") bench_sha1(size, count);
+                else bench_compress(size, count);
+            } else if (what == "repo" || what == "suite") {
+                SyntheticRepoSpec spec;
+                size_t runs = 3;
+                bool json = false;
+                std::vector<std::string> operands;
+                for (int i = 3; i < argc; i++) {
+                    std::string arg = argv[i];
+                    if (parse_repo_spec_option(arg, spec)) continue;
+                    if (what == "suite" && arg.rfind("--runs=", 0) == 0) runs = std::max<size_t>(1, std::stoul(arg.substr(7)));
+                    else if (what == "suite" && arg == "--json") json = true;
+                    else if (arg.size() > 1 && arg[0] == '-') return usage();
+                    else operands.push_back(arg);
+                }
+                if (what == "repo") {
+                    if (operands.size() != 1) return usage();
+                    SyntheticRepo repo = generate_synthetic_repo(spec, operands[0]);
+                    std::cout << "Generated " << repo.files.size() << " files (" << repo.bytes << " bytes) in " << operands[0] << '\n';
+                } else {
+                    if (!operands.empty()) return usage();
+                    bench_suite(spec, runs, json);
+                }
+            } else if (what == "compare") {
+                double threshold = 10;
+                std::vector<std::string> operands;
+                for (int i = 3; i < argc; i++) {
+                    std::string arg = argv[i];
+                    if (arg.rfind("--threshold=", 0) == 0) threshold = std::stod(arg.substr(12));
+                    else operands.push_back(arg);
+                }
+                if (operands.size() != 2) return usage();
+                if (!bench_compare(operands[0], operands[1], threshold)) return EXIT_FAILURE;
+            } else {
+                return usage();
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
 
-        while(it<decompressed_data.begin()+ zs.total_out){
-            // read mode
-            std::string mode;
-            while(*it != ' '){
-                mode.push_back(*it);
-                it++;
+    // handles git clone [-j <jobs>] [--depth=<n>] [--filter=<spec>] <url> <dir> command
+    else if(command == "clone") {
+        CloneOptions options;
+        options.jobs = default_jobs();
+        std::vector<std::string> operands;
+        bool usage_error = false;
+        try {
+            for (int i = 2; i < argc; i++) {
+                std::string arg = argv[i];
+                if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) usage_error |= !parse_jobs(argv[++i], options.jobs);
+                else if (arg == "--depth" && i + 1 < argc) options.depth = std::stoi(argv[++i]);
+                else if (arg.rfind("--depth=", 0) == 0) options.depth = std::stoi(arg.substr(8));
+                else if (arg == "--filter" && i + 1 < argc) options.filter = argv[++i];
+                else if (arg.rfind("--filter=", 0) == 0) options.filter = arg.substr(9);
+                else if (arg.size() > 1 && arg[0] == '-') usage_error = true;
+                else operands.push_back(arg);
             }
-            it++; // skip space
+        } catch (const std::exception&) {
+            usage_error = true;
+        }
+        if (usage_error || operands.size() != 2 || options.depth < 0) {
+            std::cerr << "Usage: clone [-j <jobs>] [--depth=<n>] [--filter=(blob:none | blob:limit=<n>[kmg])] <url> <dir>\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            clone_repository(operands[0], operands[1], options);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
 
-            // read filename
-            std::string filename;
-            while(*it != '\0'){
-                filename.push_back(*it);
-                it++;
+    // handles git fetch [-j <jobs>] [<url>] command
+    else if(command == "fetch") {
+        size_t jobs = default_jobs();
+        std::vector<std::string> operands;
+        bool usage_error = false;
+        try {
+            for (int i = 2; i < argc; i++) {
+                std::string arg = argv[i];
+                if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) usage_error |= !parse_jobs(argv[++i], jobs);
+                else if (arg.size() > 1 && arg[0] == '-') usage_error = true;
+                else operands.push_back(arg);
             }
-            it++; // skip space
+        } catch (const std::exception&) {
+            usage_error = true;
+        }
+        if (usage_error || operands.size() > 1) {
+            std::cerr << "Usage: fetch [-j <jobs>] [<url>]\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            fetch_remote(operands.empty() ? "" : operands[0], jobs);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
 
-            // read hash 
-            std::string hash;
-            for(int i=0;i<20;i++){
-                char byte = *it;
-                hash.push_back(byte);
-                it++;
+    // handles git upload-pack [--stateless-rpc] [--advertise-refs] <dir> command
+    else if(command == "upload-pack") {
+        bool stateless = false, advertise_only = false;
+        std::vector<std::string> operands;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--stateless-rpc") stateless = true;
+            else if (arg == "--advertise-refs" || arg == "--http-backend-info-refs") advertise_only = true;
+            else if (arg == "--strict" || arg.rfind("--timeout=", 0) == 0) continue; // accepted for git compatibility
+            else operands.push_back(arg);
+        }
+        if (operands.size() != 1) {
+            std::cerr << "Usage: upload-pack [--stateless-rpc] [--advertise-refs] <dir>\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            // refs (v2: capabilities) first unless this is the second half of a stateless exchange
+            std::filesystem::path git_dir = find_git_dir(operands[0]);
+            const char* git_protocol = std::getenv("GIT_PROTOCOL");
+            bool v2 = git_protocol && wants_protocol_v2(git_protocol);
+            UploadPackOutput out(STDOUT_FILENO, false, false);
+            if (advertise_only || !stateless) {
+                if (v2) advertise_v2_capabilities(out);
+                else advertise_refs(git_dir, out);
+                out.flush();
             }
-            std::cout << filename << '\n';
+            if (!advertise_only) {
+                PktReader in([](char* buf, size_t n) {
+                    ssize_t r;
+                    do {
+                        r = read(STDIN_FILENO, buf, n);
+                    } while (r < 0 && errno == EINTR);
+                    return r < 0 ? size_t(0) : static_cast<size_t>(r);
+                });
+                if (v2) upload_pack_v2(git_dir, in, out, stateless);
+                else upload_pack(git_dir, in, out, stateless);
+            }
+            out.finish();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    // handles http-backend [--bind=<address>] [--port=<n>] [-j <threads>] <root> command
+    else if(command == "http-backend") {
+        std::string address = "127.0.0.1";
+        int port = 8080;
+        size_t jobs = default_jobs();
+        bool usage_error = false;
+        std::vector<std::string> operands;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.rfind("--bind=", 0) == 0) address = arg.substr(7);
+            else if (arg.rfind("--port=", 0) == 0) usage_error |= !parse_number(arg.substr(7), port) || port < 0 || port > 65535;
+            else if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) usage_error |= !parse_jobs(argv[++i], jobs);
+            else operands.push_back(arg);
+        }
+        if (usage_error || operands.size() != 1) {
+            std::cerr << "Usage: http-backend [--bind=<address>] [--port=<n>] [-j <threads>] <root>\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            http_backend(operands[0], address, port, jobs);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
         }
     }
 
     // handles git write-tree command
     else if(command == "write-tree"){
-        if(argc != 2) {
-            std::cerr << "Usage: write-tree\n";
+        // optional: -j <n> hashes on n worker threads (0 = one per core)
+        size_t jobs = 1;
+        bool jobs_given = argc == 4 && (std::string(argv[2]) == "-j" || std::string(argv[2]) == "--jobs") && parse_jobs(argv[3], jobs);
+        if (!jobs_given && argc != 2) {
+            std::cerr << "Usage: write-tree [-j <jobs>]\n";
             std::cerr << "Unknown command " << command <<'\n';
             return EXIT_FAILURE;
         }
         try {
-            std::string tree_hash = write_tree_recursive(std::filesystem::current_path());
+            // .git/index caches stat data and ids so unchanged files and subtrees are not rehashed
+            StatCache cache(std::filesystem::current_path());
+            cache.old_index.load(".git/index");
+
+            // with a running fsmonitor only the directories it saw change are walked
+            std::string token;
+            {
+                TraceSpan span("fsmonitor-query");
+                if (auto answer = query_fsmonitor(load_fsmonitor_token(cache.old_index))) {
+                    token = answer->token;
+                    cache.monitored = !answer->full;
+                    for (const auto& dir : answer->dirty) cache.mark_dirty(dir);
+                }
+            }
+
+            ObjectId tree_hash;
+            if (jobs > 1) {
+                ThreadPool pool(jobs);
+                tree_hash = write_tree_parallel(std::filesystem::current_path(), pool, &cache);
+            } else {
+                TraceSpan span("walk");
+                tree_hash = write_tree_recursive(std::filesystem::current_path(), &cache);
+            }
+            // objects first, so the index never points at something not yet on disk.
+            // when the fsmonitor saw no change at all, the index on disk is already this one
+            object_writer().flush();
+            if (!cache.monitored || !cache.dirty.empty()) {
+                cache.new_index.save(".git/index");
+                save_fsmonitor_token(cache.new_index, token);
+            }
             std::cout << tree_hash << '\n';
         } catch (const std::exception& e) {
             std::cerr << e.what() << '\n';
@@ -415,30 +9101,145 @@ int main(int argc, char *argv[])
         }
     }
 
+    // handles fsmonitor--daemon (start | run | stop | status) command
+    else if(command == "fsmonitor--daemon") {
+        if (argc != 3) {
+            std::cerr << "Usage: fsmonitor--daemon (start | run | stop | status)\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            fsmonitor_daemon(argv[2]);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
     // handles git commit-tree <tree-hash> -m <message> command
     else if(command=="commit-tree"){
     
-        std::string tree_sha = argv[2];
-        std::string parent_sha = "";
-        std::string message = "";
+        if (argc < 3) {
+            std::cerr << "Usage: commit-tree <tree> [-p <parent>] -m <message>\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            ObjectId tree_sha = ObjectId::from_hex(argv[2]);
+            std::optional<ObjectId> parent_sha;
+            std::string message = "";
+
+            // Basic argument parsing
+            for (int i = 3; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg == "-p" && i + 1 < argc) {parent_sha = ObjectId::from_hex(argv[++i]);}
+                else if (arg == "-m" && i + 1 < argc) {message = argv[++i];}
+            }
+
+            // construct commit body
+            std::string content = build_commit_content(tree_sha, parent_sha, message);
+            // hash -> compress -> store
+            ObjectId commit_sha = store_git_object(content, "commit");
+            object_writer().flush();
 
-        // Basic argument parsing
-        for (int i = 3; i < argc; i++) {
+            std::cout << commit_sha << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    // handles git commit-graph write command
+    else if(command == "commit-graph") {
+        if (argc != 3 || std::string(argv[2]) != "write") {
+            std::cerr << "Usage: commit-graph write\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            ObjectDatabase db;
+            std::cout << "Wrote commit-graph with " << write_commit_graph(db) << " commits\n";
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    // handles git rev-list / log [-n <n>] [--count] [--oneline] [<rev>... | ^<rev> | <a>..<b>] command
+    else if(command == "rev-list" || command == "log") {
+        RevListOptions options;
+        bool count_only = false;
+        bool oneline = false;
+        bool usage_error = false;
+        std::vector<std::string> include, exclude;
+        for (int i = 2; i < argc; i++) {
             std::string arg = argv[i];
-            if (arg == "-p" && i + 1 < argc) {parent_sha = argv[++i];} 
-            else if (arg == "-m" && i + 1 < argc) {message = argv[++i];}
+            if (arg == "-n" && i + 1 < argc) usage_error |= !parse_number(std::string(argv[++i]), options.max_count);
+            else if (arg.size() > 2 && arg.rfind("-n", 0) == 0 && isdigit(static_cast<unsigned char>(arg[2]))) usage_error |= !parse_number(arg.substr(2), options.max_count);
+            else if (arg.rfind("--max-count=", 0) == 0) usage_error |= !parse_number(arg.substr(12), options.max_count);
+            else if (arg == "--count" && command == "rev-list") count_only = true;
+            else if (arg == "--oneline" && command == "log") oneline = true;
+            else if (arg.size() > 1 && arg[0] == '-') usage_error = true;
+            else if (arg[0] == '^') exclude.push_back(arg.substr(1));
+            else if (size_t dots = arg.find(".."); dots != std::string::npos) {
+                // a..b: reachable from b but not from a; an empty side means HEAD
+                std::string left = arg.substr(0, dots), right = arg.substr(dots + 2);
+                exclude.push_back(left.empty() ? "HEAD" : left);
+                include.push_back(right.empty() ? "HEAD" : right);
+            } else include.push_back(arg);
+        }
+        if (usage_error || (command == "rev-list" && include.empty())) {
+            if (command == "rev-list") std::cerr << "Usage: rev-list [--max-count=<n>] [--count] <rev>... [^<rev>] [<a>..<b>]\n";
+            else std::cerr << "Usage: log [-n <n>] [--oneline] [<rev>...] [^<rev>] [<a>..<b>]\n";
+            return EXIT_FAILURE;
         }
+        if (include.empty()) include.push_back("HEAD");
+        try {
+            // 1. Walk the commit-graph (commits newer than it are read from the object store)
+            ObjectDatabase db;
+            CommitIndex commits(db);
+            for (const auto& name : include) options.include.push_back(resolve_commit(db, name));
+            for (const auto& name : exclude) options.exclude.push_back(resolve_commit(db, name));
+            std::vector<uint32_t> found = rev_list(commits, options);
 
-        // S1 get time setup    
-        // construct  commit body
-        // hash -> compress -> store
+            // 2. Only log needs the commits themselves
+            std::string out;
+            if (count_only) out = std::to_string(found.size()) + "\n";
+            for (size_t i = 0; i < found.size() && !count_only; i++) {
+                ObjectId id = commits.id(found[i]);
+                if (command == "rev-list") out += id.hex() + "\n";
+                else format_log_entry(id, db.read(id, "commit"), oneline, i == 0, out);
+                if (out.size() >= (1 << 16)) {
+                    std::cout.write(out.data(), out.size());
+                    out.clear();
+                }
+            }
+            std::cout.write(out.data(), out.size());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
 
-        // construct commit body
-        std::string content = build_commit_content(tree_sha, parent_sha, message);
-        // hash -> compress -> store
-        std::string commit_sha = store_git_object(content, "commit");
-    
-        std::cout << commit_sha << std::endl;
+    // handles git merge-base [--all | --is-ancestor] <a> <b> command
+    else if(command == "merge-base") {
+        bool all = argc == 5 && std::string(argv[2]) == "--all";
+        bool ancestor_check = argc == 5 && std::string(argv[2]) == "--is-ancestor";
+        if (argc != 4 && !all && !ancestor_check) {
+            std::cerr << "Usage: merge-base [--all | --is-ancestor] <commit> <commit>\n";
+            return EXIT_FAILURE;
+        }
+        try {
+            ObjectDatabase db;
+            CommitIndex commits(db);
+            ObjectId a = resolve_commit(db, argv[argc - 2]);
+            ObjectId b = resolve_commit(db, argv[argc - 1]);
+            // --is-ancestor answers with the exit status only
+            if (ancestor_check) return is_ancestor(commits, a, b) ? EXIT_SUCCESS : EXIT_FAILURE;
+            std::vector<ObjectId> bases = merge_bases(commits, a, b);
+            if (bases.empty()) return EXIT_FAILURE;
+            for (size_t i = 0; i < (all ? bases.size() : 1); i++) std::cout << bases[i] << '\n';
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
     }
 
     else {